@@ -85,6 +85,7 @@
       (cdr          3)
       (cadr         3)
       (caddr        3)
+      (car          3)
       (callf        1)
       (done         1)
       (label        0)))
@@ -420,7 +421,7 @@
 					  `((movimm ,target nil)
 					    (cons ,target env)
 					    (consimm ,target ,proc-entry)
-					    (consimm ,target proc)))) ;; put symbol proc first in list
+					    (consimm ,target ,(new-indirection 'proc))))) ;; put symbol proc first in list
 	  (compile-lambda-body exp proc-entry))
 	 after-lambda))))
 
@@ -438,7 +439,7 @@
 	  (append-instr-seqs
 	   (map (lambda (p)
 		  (mk-instr-seq '(argl) '(env)
-				`((exenvargl ,p))))
+				`((exenvargl ,(new-indirection p)))))
 		formals)))
 	 (compile-instr-list (car (cdr (cdr exp))) 'val 'return)))))
 
@@ -603,3 +604,18 @@
       (let ((ir (compile-program prg))
 	    (ir-ops (car (cdr (cdr ir)))))
 	  (ops-out nil ir-ops))))
+
+;; Bytecode output: bc-out encodes one label or instruction,
+;; bc-done resolves labels and symbols and writes the image.
+(define bc-ops-out
+    (lambda (ops)
+      (if ops
+	  (progn (bc-out (car ops))
+		 (bc-ops-out (cdr ops)))
+	  (bc-done symbol-indirections))))
+
+(define gen-bytecode
+    (lambda (prg)
+      (let ((ir (compile-program prg))
+	    (ir-ops (car (cdr (cdr ir)))))
+	(bc-ops-out ir-ops))))
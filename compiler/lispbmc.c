@@ -36,6 +36,7 @@
 #include "typedefs.h"
 #include "memory.h"
 #include "env.h"
+#include "bytecode.h"
 
 #define EVAL_CPS_STACK_SIZE 256
 
@@ -216,17 +217,350 @@ VALUE ext_output_assembly(VALUE *args, int argn) {
   return enc_sym(symrepr_nil());  
 }
  
+/*
+   Bytecode output (see include/bytecode.h for the image format).
+   Instructions are encoded into bc_code as they arrive. Label
+   references are patched and the symbol indirections are given their
+   names when the program is done.
+*/
+#define BC_MAX_CODE    65536
+#define BC_MAX_LABELS  4096
+#define BC_MAX_FIXUPS  4096
+#define BC_MAX_CONSTS  1024
+#define BC_MAX_NAMES   1024
+
+typedef struct {
+  unsigned int pos;
+  UINT label;
+  bool code_addr;  // immediate code address or raw jump offset
+} label_fixup_t;
+
+typedef struct {
+  unsigned int pos;
+  VALUE indirection;
+} indirection_fixup_t;
+
+typedef struct {
+  uint8_t type;
+  UINT value;
+  const char *str;
+} bc_const_t;
+
+static uint8_t bc_code[BC_MAX_CODE];
+static unsigned int bc_pc = 0;
+static int label_loc[BC_MAX_LABELS];
+static label_fixup_t label_fixups[BC_MAX_FIXUPS];
+static unsigned int num_label_fixups = 0;
+static indirection_fixup_t ind_fixups[BC_MAX_FIXUPS];
+static unsigned int num_ind_fixups = 0;
+static bc_const_t bc_consts[BC_MAX_CONSTS];
+static unsigned int num_bc_consts = 0;
+static const char *bc_names[BC_MAX_NAMES];
+static unsigned int num_bc_names = 0;
+
+static const char *bc_op_names[BC_NUM_OPCODES] = {
+  NULL, "jmpcnt", "jmpimm", "jmpval", "movimm", "mov", "lookup",
+  "setglbval", "push", "pop", "bpf", "exenvargl", "exenvval", "cons",
+  "consimm", "cdr", "cadr", "caddr", "car", "callf", "done"
+};
+
+static const char *bc_reg_names[BC_NUM_REGS] = {
+  "env", "proc", "val", "argl", "cont"
+};
+
+static void bc_put_u32(uint8_t *p, UINT v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+static const char *array_str(VALUE arr) {
+  if (type_of(arr) != PTR_TYPE_ARRAY) return NULL;
+  array_header_t *array = (array_header_t *)car(arr);
+  if (array->elt_type != VAL_TYPE_CHAR) return NULL;
+  return (char *)array + 8;
+}
+
+static bool is_label(VALUE v) {
+  UINT label;
+  return (type_of(v) == PTR_TYPE_CONS &&
+	  symrepr_lookup("label", &label) &&
+	  car(v) == enc_sym(label));
+}
+
+static bool label_num(VALUE lab, UINT *num) {
+  VALUE n = car(cdr(cdr(lab)));
+  if (type_of(n) != VAL_TYPE_I ||
+      dec_i(n) < 0 ||
+      dec_i(n) >= BC_MAX_LABELS) return false;
+  *num = (UINT)dec_i(n);
+  return true;
+}
+
+static int bc_name_index(const char *name) {
+  for (unsigned int i = 0; i < num_bc_names; i ++) {
+    if (strcmp(bc_names[i], name) == 0) return (int)i;
+  }
+  if (num_bc_names == BC_MAX_NAMES) return -1;
+  bc_names[num_bc_names] = name;
+  return (int)num_bc_names++;
+}
+
+static bool bc_add_label_ref(UINT pos, VALUE lab, bool code_addr) {
+  UINT num;
+  if (!label_num(lab, &num) ||
+      num_label_fixups == BC_MAX_FIXUPS) return false;
+  label_fixups[num_label_fixups].pos = pos;
+  label_fixups[num_label_fixups].label = num;
+  label_fixups[num_label_fixups].code_addr = code_addr;
+  num_label_fixups ++;
+  return true;
+}
+
+static bool bc_add_const(uint8_t type, UINT value, const char *str, VALUE *res) {
+  if (num_bc_consts == BC_MAX_CONSTS) return false;
+  bc_consts[num_bc_consts].type = type;
+  bc_consts[num_bc_consts].value = value;
+  bc_consts[num_bc_consts].str = str;
+  *res = set_ptr_type(enc_cons_ptr(num_bc_consts), PTR_TYPE_BOXED_I);
+  num_bc_consts ++;
+  return true;
+}
+
+static int bc_reg(VALUE r) {
+  if (type_of(r) != VAL_TYPE_SYMBOL) return -1;
+  const char *name = symrepr_lookup_name(dec_sym(r));
+  if (!name) return -1;
+  for (int i = 0; i < BC_NUM_REGS; i ++) {
+    if (strcmp(name, bc_reg_names[i]) == 0) return i;
+  }
+  return -1;
+}
+
+/* Encode an immediate VALUE at bc_code[pos] */
+static bool bc_imm(unsigned int pos, VALUE v) {
+
+  VALUE enc = v;
+
+  switch (type_of(v)) {
+  case VAL_TYPE_I:
+  case VAL_TYPE_U:
+  case VAL_TYPE_CHAR:
+    break;
+  case VAL_TYPE_SYMBOL:
+    if (dec_sym(v) >= MAX_SPECIAL_SYMBOLS) {
+      // User symbols are referred to by name
+      const char *name = symrepr_lookup_name(dec_sym(v));
+      int ix;
+      if (!name || (ix = bc_name_index(name)) < 0) return false;
+      enc = enc_symbol_indirection((UINT)ix);
+    }
+    break;
+  case PTR_TYPE_SYMBOL_INDIRECTION:
+    if (num_ind_fixups == BC_MAX_FIXUPS) return false;
+    ind_fixups[num_ind_fixups].pos = pos;
+    ind_fixups[num_ind_fixups].indirection = v;
+    num_ind_fixups ++;
+    return true;
+  case PTR_TYPE_BOXED_I:
+    if (!bc_add_const(BC_CONST_I32, car(v), NULL, &enc)) return false;
+    break;
+  case PTR_TYPE_BOXED_U:
+    if (!bc_add_const(BC_CONST_U32, car(v), NULL, &enc)) return false;
+    break;
+  case PTR_TYPE_BOXED_F:
+    if (!bc_add_const(BC_CONST_F32, car(v), NULL, &enc)) return false;
+    break;
+  case PTR_TYPE_ARRAY: {
+    const char *str = array_str(v);
+    if (!str || !bc_add_const(BC_CONST_STRING, 0, str, &enc)) return false;
+    break;
+  }
+  case PTR_TYPE_CONS:
+    if (!is_label(v)) return false;
+    return bc_add_label_ref(pos, v, true);
+  default:
+    return false;
+  }
+  bc_put_u32(&bc_code[pos], enc);
+  return true;
+}
+
 /* ext_output_bytecode
-   args: opcode, arguments
+   args: label or instruction (op arg1 ... argn)
 */
 VALUE ext_output_bytecode(VALUE *args, int argn) {
-   
+
+  if (argn != 1) return enc_sym(symrepr_eerror());
+
+  VALUE ins = args[0];
+
+  if (is_label(ins)) {
+    UINT num;
+    if (!label_num(ins, &num)) return enc_sym(symrepr_eerror());
+    label_loc[num] = (int)bc_pc;
+    return enc_sym(symrepr_nil());
+  }
+
+  if (type_of(ins) != PTR_TYPE_CONS ||
+      type_of(car(ins)) != VAL_TYPE_SYMBOL) {
+    printf("Error in bc-out: not an instruction\n");
+    return enc_sym(symrepr_eerror());
+  }
+
+  const char *op_name = symrepr_lookup_name(dec_sym(car(ins)));
+  uint8_t op = 0;
+  for (uint8_t i = 1; op_name && i < BC_NUM_OPCODES; i ++) {
+    if (strcmp(op_name, bc_op_names[i]) == 0) {
+      op = i;
+      break;
+    }
+  }
+  if (op == 0 || bc_pc + 6 > BC_MAX_CODE) {
+    printf("Error in bc-out: unknown instruction %s\n", op_name ? op_name : "");
+    return enc_sym(symrepr_eerror());
+  }
+
+  VALUE a0 = car(cdr(ins));
+  VALUE a1 = car(cdr(cdr(ins)));
+  unsigned int pc = bc_pc;
+  bool ok = true;
+
+  bc_code[pc++] = op;
+
+  switch (op) {
+  case BC_JMPIMM:
+  case BC_BPF:
+    ok = is_label(a0) && bc_add_label_ref(pc, a0, false);
+    pc += 4;
+    break;
+  case BC_MOVIMM:
+  case BC_LOOKUP:
+  case BC_CONSIMM: {
+    int r = bc_reg(a0);
+    ok = r >= 0;
+    bc_code[pc++] = (uint8_t)r;
+    ok = ok && bc_imm(pc, a1);
+    pc += 4;
+    break;
+  }
+  case BC_SETGLBVAL:
+  case BC_EXENVARGL:
+  case BC_EXENVVAL:
+    ok = bc_imm(pc, a0);
+    pc += 4;
+    break;
+  case BC_PUSH:
+  case BC_POP: {
+    int r = bc_reg(a0);
+    ok = r >= 0;
+    bc_code[pc++] = (uint8_t)r;
+    break;
+  }
+  case BC_MOV:
+  case BC_CONS:
+  case BC_CDR:
+  case BC_CADR:
+  case BC_CADDR:
+  case BC_CAR: {
+    int r0 = bc_reg(a0);
+    int r1 = bc_reg(a1);
+    ok = r0 >= 0 && r1 >= 0;
+    bc_code[pc++] = (uint8_t)r0;
+    bc_code[pc++] = (uint8_t)r1;
+    break;
+  }
+  default:
+    break;
+  }
+
+  if (!ok) {
+    printf("Error in bc-out: bad arguments to %s\n", op_name);
+    return enc_sym(symrepr_eerror());
+  }
+  bc_pc = pc;
   return enc_sym(symrepr_nil());
 }
 
-VALUE ext_output_symbol_indirection(VALUE *args, int argn) {
+static bool write_u32(UINT v) {
+  uint8_t b[4];
+  bc_put_u32(b, v);
+  return fwrite(b, 1, 4, out_file) == 4;
+}
 
-  return enc_sym(symrepr_nil());
+/* ext_output_bytecode_done
+   args: symbol indirections ((sym ((name . indirection))) ...)
+   Resolves labels and indirections and writes the image.
+*/
+VALUE ext_output_bytecode_done(VALUE *args, int argn) {
+
+  if (argn != 1) return enc_sym(symrepr_eerror());
+
+  for (unsigned int i = 0; i < num_label_fixups; i ++) {
+    int loc = label_loc[label_fixups[i].label];
+    if (loc < 0) {
+      printf("Error: undefined label %u\n", label_fixups[i].label);
+      return enc_sym(symrepr_eerror());
+    }
+    UINT v = (UINT)loc;
+    if (label_fixups[i].code_addr) {
+      v = set_ptr_type(enc_cons_ptr(v), PTR_TYPE_BYTECODE);
+    }
+    bc_put_u32(&bc_code[label_fixups[i].pos], v);
+  }
+
+  for (unsigned int i = 0; i < num_ind_fixups; i ++) {
+    const char *name = NULL;
+    VALUE curr = args[0];
+    while (type_of(curr) == PTR_TYPE_CONS) {
+      VALUE entry = car(cdr(car(curr)));
+      if (cdr(entry) == ind_fixups[i].indirection) {
+	name = array_str(car(entry));
+	break;
+      }
+      curr = cdr(curr);
+    }
+    int ix;
+    if (!name || (ix = bc_name_index(name)) < 0) {
+      printf("Error: unknown symbol indirection\n");
+      return enc_sym(symrepr_eerror());
+    }
+    bc_put_u32(&bc_code[ind_fixups[i].pos], enc_symbol_indirection((UINT)ix));
+  }
+
+  bool ok = true;
+  ok = ok && write_u32(BC_MAGIC);
+  ok = ok && write_u32(bc_pc);
+  ok = ok && write_u32(num_bc_consts);
+  ok = ok && write_u32(num_bc_names);
+  ok = ok && fwrite(bc_code, 1, bc_pc, out_file) == bc_pc;
+
+  for (unsigned int i = 0; ok && i < num_bc_consts; i ++) {
+    ok = fwrite(&bc_consts[i].type, 1, 1, out_file) == 1;
+    if (bc_consts[i].type == BC_CONST_STRING) {
+      size_t len = strlen(bc_consts[i].str);
+      ok = ok && write_u32((UINT)len);
+      ok = ok && fwrite(bc_consts[i].str, 1, len, out_file) == len;
+    } else {
+      ok = ok && write_u32(bc_consts[i].value);
+    }
+  }
+
+  for (unsigned int i = 0; ok && i < num_bc_names; i ++) {
+    size_t len = strlen(bc_names[i]);
+    ok = write_u32(enc_symbol_indirection(i));
+    ok = ok && write_u32((UINT)len);
+    ok = ok && fwrite(bc_names[i], 1, len, out_file) == len;
+  }
+
+  if (!ok) {
+    printf("Error writing output file\n");
+    return enc_sym(symrepr_eerror());
+  }
+  printf("Bytecode: %u bytes code, %u constants, %u symbols\n",
+	 bc_pc, num_bc_consts, num_bc_names);
+  return enc_sym(symrepr_true());
 }
 
 /* load a file, caller is responsible for freeing the returned string */
@@ -440,6 +774,19 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  res = extensions_add("bc-out", ext_output_bytecode);
+  res = res && extensions_add("bc-done", ext_output_bytecode_done);
+  if (res)
+    printf("Extensions bc-out and bc-done added.\n");
+  else {
+    printf("Error adding bytecode extensions.\n");
+    return 0;
+  }
+
+  for (int i = 0; i < BC_MAX_LABELS; i ++) {
+    label_loc[i] = -1;
+  }
+
   char output[1024];
   char error[1024];
 
@@ -480,7 +827,7 @@ int main(int argc, char **argv) {
   free(file_str);
 
   UINT compiler;
-  if (symrepr_lookup("gen-asm", &compiler)) {
+  if (symrepr_lookup(output_assembler ? "gen-asm" : "gen-bytecode", &compiler)) {
     VALUE invoce_compiler = cons(cons (enc_sym(compiler),
 				       cons(cons (enc_sym(symrepr_quote()),
 						  cons (input_prg, enc_sym(symrepr_nil()))),
@@ -0,0 +1,57 @@
+/*
+    Copyright 2020 Joel Svensson	svenssonjoel@yahoo.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ANALYZE_H_
+#define ANALYZE_H_
+
+#include "typedefs.h"
+
+/*
+   Pre-analysis of parsed programs.
+
+   Rewrites a program (list of top-level forms), in place, into a form
+   where special forms are resolved, quoted constants are tagged,
+   applications are tagged and free variables are linked directly to
+   their binding in the global environment:
+
+   (an_const . v)            constant v
+   (an_global . binding)     global variable, value is (cdr binding)
+   (an_global . sym)         global variable sym, not defined yet
+   (an_app f a1 ... an)      application of f to a1 ... an
+   (an_if c t e), (an_let binds body), (an_lambda params body),
+   (an_progn e1 ... en), (an_define key e), (an_and ...), (an_or ...)
+
+   Both eval_cps and ec_eval execute analysed and unanalysed code.
+
+   Globals that are not yet defined are left out of the global
+   environment. They are linked to their binding the first time they
+   are evaluated after it has been defined. Extensions should be added
+   before analysis, names that are not extensions at that point are
+   linked as global variables.
+
+   Returns the program or the out_of_memory symbol. A program that
+   failed analysis is still correct to evaluate and the analysis can be
+   resumed after a garbage collection.
+*/
+extern VALUE analyze_program(VALUE prg);
+/*
+   Value of the global variable of an an_global node, variable_not_bound
+   if it is not defined. Links the node to the binding once there is one.
+*/
+extern VALUE analyze_global_value(VALUE node);
+
+#endif
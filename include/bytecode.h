@@ -18,6 +18,112 @@
 #ifndef BYTECODE_H_
 #define BYTECODE_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "typedefs.h"
+#include "stack.h"
+
+/*
+   Binary encoding of the instructions generated by compiler/compile.lisp.
+   All multi-byte fields are little endian.
+
+   op           size  operands
+   jmpcnt       1                   pc <- cont
+   jmpimm       5     u32 offset    pc <- offset
+   jmpval       1                   pc <- val
+   movimm       6     reg, imm      reg <- imm
+   mov          3     reg0, reg1    reg0 <- reg1
+   lookup       6     reg, sym      reg <- lookup sym (env, then global env)
+   setglbval    5     sym           global env <- (sym . val)
+   push         2     reg
+   pop          2     reg
+   bpf          5     u32 offset    pc <- offset if proc is not compiled
+   exenvargl    5     sym           env <- ((sym . (car argl)) . env), argl <- cdr argl
+   exenvval     5     sym           env <- ((sym . val) . env)
+   cons         3     reg0, reg1    reg0 <- cons reg1 reg0
+   consimm      6     reg, imm      reg <- cons imm reg
+   cdr          3     reg0, reg1    reg0 <- cdr reg1
+   cadr         3     reg0, reg1    reg0 <- cadr reg1
+   caddr        3     reg0, reg1    reg0 <- caddr reg1
+   car          3     reg0, reg1    reg0 <- car reg1
+   callf        1                   val <- apply proc argl (fundamental or extension)
+   done         1                   stop, result is val
+*/
+#define BC_JMPCNT       0x01
+#define BC_JMPIMM       0x02
+#define BC_JMPVAL       0x03
+#define BC_MOVIMM       0x04
+#define BC_MOV          0x05
+#define BC_LOOKUP       0x06
+#define BC_SETGLBVAL    0x07
+#define BC_PUSH         0x08
+#define BC_POP          0x09
+#define BC_BPF          0x0A
+#define BC_EXENVARGL    0x0B
+#define BC_EXENVVAL     0x0C
+#define BC_CONS         0x0D
+#define BC_CONSIMM      0x0E
+#define BC_CDR          0x0F
+#define BC_CADR         0x10
+#define BC_CADDR        0x11
+#define BC_CAR          0x12
+#define BC_CALLF        0x13
+#define BC_DONE         0x14
+#define BC_NUM_OPCODES  0x15
+
+#define BC_REG_ENV      0
+#define BC_REG_PROC     1
+#define BC_REG_VAL      2
+#define BC_REG_ARGL     3
+#define BC_REG_CONT     4
+#define BC_NUM_REGS     5
+
+/*
+   Image layout:
+
+   u32 magic            BC_MAGIC
+   u32 code_size        in bytes
+   u32 num_constants
+   u32 num_indirections
+   code
+   constants            u8 type, then u32 value (I32, U32, F32)
+                        or u32 length and the characters (STRING)
+   indirections         u32 symbol indirection, u32 length, name
+
+   Immediates (imm, sym) are VALUEs in the 32 bit layout of heap.h,
+   also in a LISPBM_64BIT build (see the BC_IMG_ constants). In the
+   image, pointer valued immediates are relocated when loaded:
+   - Symbol indirections are replaced by the symbol with the name
+     given in the indirection table.
+   - PTR_TYPE_BYTECODE with address n is the code address at offset n.
+   - Other pointer types with address n refer to constant n.
+   A LISPBM_64BIT build converts the immediates to 64 bit VALUEs when
+   loading, they are then kept in the constant pool of the object and
+   the code refers to them by index.
+*/
+#define BC_MAGIC        0x434D424Cu  // "LBMC"
+#define BC_HEADER_SIZE  16
+
+#define BC_IMG_PTR                          0x00000001u
+#define BC_IMG_PTR_VAL_MASK                 0x03FFFFF8u
+#define BC_IMG_PTR_TYPE_MASK                0xFC000000u
+#define BC_IMG_PTR_TYPE_CONST               0x20000000u
+#define BC_IMG_PTR_TYPE_SYMBOL_INDIRECTION  0x50000000u
+#define BC_IMG_PTR_TYPE_BYTECODE            0xC0000000u
+#define BC_IMG_ADDRESS_SHIFT                3
+#define BC_IMG_VAL_SHIFT                    4
+#define BC_IMG_VAL_TYPE_MASK                0x0000000Cu
+#define BC_IMG_VAL_TYPE_SYMBOL              0x00000000u
+#define BC_IMG_VAL_TYPE_CHAR                0x00000004u
+#define BC_IMG_VAL_TYPE_I                   0x00000008u
+#define BC_IMG_VAL_TYPE_U                   0x0000000Cu
+
+#define BC_CONST_I32    1
+#define BC_CONST_U32    2
+#define BC_CONST_F32    3
+#define BC_CONST_STRING 4
+
 typedef struct {
   char* symbol_str;
   VALUE symbol_indirection;
@@ -28,7 +134,23 @@ typedef struct {
   uint8_t *code;
   unsigned int num_indirections;
   symbol_indirection_t *indirections;
+  unsigned int num_constants;
+  VALUE *constants;             // GC roots of the object
+  uint8_t *jit;                 // Native code (BYTECODE_JIT) or NULL
+  unsigned int jit_size;
 } bytecode_t;
 
+/* Called by the VM when an allocation fails. The contents of the
+   roots stack must be marked in addition to the roots known to the
+   caller. */
+typedef void (*bytecode_gc_fptr)(stack *roots);
+
+/* Load an image. Returns the code address of offset 0 or an
+   error symbol (out_of_memory, read_error). */
+extern VALUE bytecode_create(uint8_t *image, unsigned int size);
+extern void bytecode_free(bytecode_t *bc);
+/* Code addresses and compiled procedures (proc entry env) */
+extern bool bytecode_is_callable(VALUE fun);
+extern VALUE bytecode_apply(VALUE fun, VALUE *args, unsigned int argn, bytecode_gc_fptr gc);
 
 #endif
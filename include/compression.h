@@ -19,24 +19,107 @@
 #include <stdbool.h>
 
 
+#define COMPRESSION_MAX_KEY_LENGTH  12
+#define COMPRESSION_MAX_CODE_LENGTH 7
+
+/* The 4 byte header of a compressed stream holds the number of bits
+   of code and, in its top bits, the code table that was used. A
+   stream coded with a generated table (not table 0) has the id of
+   that table in 4 more header bytes, so that it is not decoded with
+   a different table of the same number. */
+#define COMPRESSION_TABLE_SHIFT 28
+#define COMPRESSION_MAX_BITS    ((1u << COMPRESSION_TABLE_SHIFT) - 1)
+#define COMPRESSION_HEADER_BITS(table) ((table) == 0 ? 32u : 64u)
+
+/* The decode tables are indexed by the next MAX_CODE_LENGTH bits of
+   input and give the code that starts there and its length */
+#define COMPRESSION_DECODE_SIZE (1 << COMPRESSION_MAX_CODE_LENGTH)
+
+/* Keys and their codes, a complete prefix code. Table 0 is built in,
+   tables trained on a corpus of programs can be added when building,
+   see utils/gen_codes.py. id is a checksum of the keys and codes of a
+   generated table. */
 typedef struct {
+  const char *(*codes)[2];
+  uint32_t num_codes;
+  uint32_t id;
+} compression_table_t;
+
+typedef struct {
+  const compression_table_t *table;
   uint32_t compressed_bits;
+  uint32_t header_bits;
   uint32_t i;
   bool string_mode;
   char last_string_char;
   char *src;
+  uint8_t decode_ix[COMPRESSION_DECODE_SIZE];
+  uint8_t decode_len[COMPRESSION_DECODE_SIZE];
 } decomp_state; 
 
 
 extern void compression_init_state(decomp_state *s, char *src);
 
-/* 
-   Compress performs destructive changes to 
-   the input string and cannot be called on constant string literal pointers 
-   for example.
- 
-   Compress returns an array that caller must free 
-*/ 
-extern char *compression_compress(char *string, uint32_t *res_size);
+/*
+   Receives the compressed output. offset is the position of data in
+   the compressed stream. Output is written in order, except that the
+   header at offset 0 is written again last, when the length is
+   known. Returns false to stop compression.
+*/
+typedef bool (*compression_sink_fptr)(void *arg, uint32_t offset, const char *data, uint32_t n);
+
+#define COMPRESSION_OUT_SIZE 32
+
+typedef struct {
+  const compression_table_t *table;
+  int space_ix;
+  compression_sink_fptr sink;
+  void *sink_arg;
+  uint32_t compressed_bits;
+  bool string_mode;
+  bool in_comment;
+  bool gobbling_whitespace;
+  bool error;
+  char last_string_char;
+  char pending[COMPRESSION_MAX_KEY_LENGTH];
+  uint32_t pending_n;
+  uint8_t out[COMPRESSION_OUT_SIZE];
+  uint32_t out_bits;
+  uint32_t out_offset;
+} comp_state;
+
+/* A caller supplied buffer, for use with compression_buffer_sink */
+typedef struct {
+  char *data;
+  uint32_t size;
+} compression_buffer_t;
+
+extern uint32_t compression_num_tables(void);
+/* The code table that compresses n characters of string the most */
+extern uint32_t compression_best_table(const char *string, uint32_t n);
+
+/* Returns false if there is no such code table */
+extern bool compression_compress_init(comp_state *s, uint32_t table,
+				      compression_sink_fptr sink, void *arg);
+/* Compresses n more characters of input. Returns false if the input
+   cannot be compressed or the sink failed. */
+extern bool compression_compress_chunk(comp_state *s, const char *data, uint32_t n);
+/* Ends the input and writes the header. res_size is set to the size
+   of the compressed stream. */
+extern bool compression_compress_finish(comp_state *s, uint32_t *res_size);
+/* Sink writing to a compression_buffer_t, fails if it is full */
+extern bool compression_buffer_sink(void *arg, uint32_t offset, const char *data, uint32_t n);
+
+/*
+   Compresses a string with the code table that suits it best.
+   Returns an array that caller must free
+*/
+extern char *compression_compress(const char *string, uint32_t *res_size);
+/*
+   Decompresses as many codes as fit in dest_buff, which must have
+   room for at least COMPRESSION_MAX_KEY_LENGTH characters. Returns the
+   number of characters, 0 at the end of input and -1 on an invalid
+   code.
+*/
 extern int  compression_decompress_incremental(decomp_state *s, char *dest_buff, uint32_t dest_n);
 extern bool compression_decompress(char *dest, uint32_t dest_n, char *src);
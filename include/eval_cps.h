@@ -17,6 +17,8 @@
 #ifndef EVAL_CPS_H_
 #define EVAL_CPS_H_
 
+#include <stdatomic.h>
+
 #include "stack.h"
 #include "typedefs.h"
 
@@ -32,6 +34,20 @@ typedef struct eval_context_s{
   uint32_t timestamp;
   uint32_t sleep_us;
   CID id;
+  CID wait_cid;
+  bool used;      // taken from the pool
+  bool blocked;
+  bool finished;
+  /* Messages, received in order */
+  VALUE mailbox;
+  VALUE mailbox_last;
+  /* Contexts blocked in wait for this one */
+  struct eval_context_s *waiters;
+  /* CID of the context in the slot, and the CID and result once
+     finished, read by eval_cps_wait_ctx */
+  atomic_uint slot_id;
+  atomic_uint done_id;
+  _Atomic VALUE done_r;
   /* List structure */
   struct eval_context_s *prev;
   struct eval_context_s *next;
@@ -40,14 +56,111 @@ typedef struct eval_context_s{
 /* Common interface */
 extern VALUE eval_cps_get_env(void);
 extern void eval_cps_del(void);
+/*
+  Collect garbage from outside of the evaluator, for example while
+  parsing. Everything reachable from the contexts and the global
+  environment is kept, and so are the values on roots (may be NULL).
+  While eval_cps_run_eval runs in another thread the evaluator has to
+  be paused (eval_cps_pause_eval), otherwise nothing is collected and
+  0 is returned.
+*/
+extern int eval_cps_gc(stack *roots);
+/*
+  Stacks of values that live between calls into the evaluator, such as
+  the partial results of a streaming parser, are registered as roots
+  for every collection until they are removed. The root node is owned
+  by the caller.
+*/
+typedef struct eval_cps_root_s {
+  stack *values;
+  struct eval_cps_root_s *next;
+} eval_cps_root_t;
+
+extern void eval_cps_add_root(eval_cps_root_t *root);
+extern void eval_cps_remove_root(eval_cps_root_t *root);
+/*
+  Programs returned by tokpar_parse are held as roots until they are
+  handed to eval_cps_program, eval_cps_program_nc or ec_eval_program,
+  so several programs can be parsed before they are evaluated. A
+  program that is used in some other way, or dropped, is released
+  with eval_cps_release_program. eval_cps_hold_program returns false
+  if there is no memory to hold prg.
+*/
+extern bool eval_cps_hold_program(VALUE prg);
+extern void eval_cps_release_program(VALUE prg);
 
 /* Concurrent interface */
 extern int eval_cps_init(void);
+/*
+  Allocates a pool of num_contexts contexts with continuation stacks
+  of stack_size words. Creating and removing contexts does not
+  allocate, unless a program asks for a larger or growable stack.
+  At most num_contexts contexts, including finished ones that have
+  not been removed, exist at a time. num_contexts is at most 4096.
+  The CID of a removed context is only given out again after its pool
+  slot has been reused many times. Waiting for a CID that has no
+  context, for example one that has been removed, fails.
+*/
+extern int eval_cps_init_ext(unsigned int num_contexts, unsigned int stack_size);
 extern bool eval_cps_remove_done_ctx(CID cid, VALUE *v);
+/*
+  Block until context cid finishes and return its result. Can be
+  called from another thread while eval_cps_run_eval runs. The result
+  is found even if the context has been removed, as long as its pool
+  slot has not been taken by a new context. After that, or for a CID
+  that was never given out, the result is the symbol eerror.
+*/
 extern VALUE eval_cps_wait_ctx(CID cid);
 extern CID eval_cps_program(VALUE lisp);
 extern CID eval_cps_program_ext(VALUE lisp, unsigned int stack_size, bool grow_stack);
+/*
+  Apply fun, a closure or a symbol bound in the global environment, to
+  the argn values in args, without going through the parser. The
+  arguments are not evaluated. eval_cps_call starts a new context and
+  returns its CID (0 on failure), eval_cps_call_nc runs the call to
+  completion on the non concurrent evaluator and returns the result.
+*/
+extern CID eval_cps_call(VALUE fun, VALUE *args, unsigned int argn);
 extern void eval_cps_run_eval(void);
+/*
+  Pause the evaluator running eval_cps_run_eval in another thread, so
+  that the host can parse, create contexts (eval_cps_program) and
+  read results from the heap. eval_cps_pause_eval returns once the
+  evaluator has stopped, at the end of a time slice. With preemption
+  disabled (eval_cps_set_reductions(0)) that is when the running
+  context yields, waits or finishes. eval_cps_continue_eval lets it
+  run again. If the evaluator is not running yet, it starts paused.
+*/
+extern void eval_cps_pause_eval(void);
+extern void eval_cps_continue_eval(void);
+/*
+  Posting events to the evaluator. These are safe to call from other
+  threads and interrupts while eval_cps_run_eval runs, they take no
+  lock and do not allocate. Both return false if the event queue is
+  full. The evaluator delivers events between evaluation steps.
+
+  Values must not need to be kept alive by the GC: numbers, chars and
+  symbols.
+
+  eval_cps_post_event puts v in the mailbox of context cid, where recv
+  picks it up. Events for a CID with no context are dropped.
+  eval_cps_post_call starts a new context applying fun to arg, as
+  eval_cps_call does. arg is passed as it is, not evaluated.
+
+  Events are not dropped for lack of resources. A call while every
+  context of the pool is in use, or an event that finds the heap
+  full even after a collection, stays first in the queue and is
+  delivered once a context is removed or memory is freed. Until then
+  the events behind it wait and the queue may fill up.
+*/
+extern bool eval_cps_post_event(CID cid, VALUE v);
+extern bool eval_cps_post_call(VALUE fun, VALUE arg);
+/*
+  Number of evaluation steps a context may run before it is preempted
+  and put back in the ready queue. 0 disables preemption, contexts
+  then run until they yield, wait or finish. Set after eval_cps_init.
+*/
+extern void eval_cps_set_reductions(uint32_t n);
 /*
   Callback routines for sleeping and timestamp generation.
   Depending on target platform these will be implemented in different ways.
@@ -56,8 +169,16 @@ extern void eval_cps_run_eval(void);
 extern void eval_cps_set_usleep_callback(void (*fptr)(uint32_t));
 extern void eval_cps_set_timestamp_us_callback(uint32_t (*fptr)(void));
 extern void eval_cps_set_ctx_done_callback(void (*fptr)(eval_context_t *));
+/*
+  Lets eval_cps_wait_ctx block instead of polling. wait should block
+  until notify is called, notify is called by the evaluator when a
+  context finishes. A notify that comes before wait should make the
+  next wait return, like a binary semaphore.
+*/
+extern void eval_cps_set_ctx_notify_callbacks(void (*wait)(void), void (*notify)(void));
 
 /* Non concurrent interface: */
 extern int eval_cps_init_nc(unsigned int stack_size, bool grow_stack);
 extern VALUE eval_cps_program_nc(VALUE lisp);
+extern VALUE eval_cps_call_nc(VALUE fun, VALUE *args, unsigned int argn);
 #endif
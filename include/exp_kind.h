@@ -33,7 +33,10 @@ typedef enum {
   EXP_APPLICATION,
   EXP_LET,
   EXP_AND,
-  EXP_OR
+  EXP_OR,
+  EXP_CONSTANT,
+  EXP_GLOBAL,
+  EXP_ANALYSED_APPLICATION
 } exp_kind;
 
 extern exp_kind exp_kind_of(VALUE exp);
@@ -24,6 +24,11 @@
 
 typedef VALUE (*extension_fptr)(VALUE*,int);
 
+typedef struct {
+  UINT sym;
+  extension_fptr fptr;
+} extension_t;
+
 extern extension_fptr extensions_lookup(UINT sym);
 extern bool extensions_add(char *sym_str, extension_fptr ext);
 extern void extensions_del(void);
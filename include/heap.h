@@ -151,6 +151,57 @@ Aux bits could be used for storing vector size. Up to 30bits should be available
 1111 AA00 0000 0000 0000 0000 0000 0000   : 0xFC00 0000 (AA bits left unused for now, future heap growth?)
  */
 
+#ifdef LISPBM_64BIT
+/*
+64 bit layout (LISPBM_64BIT):
+
+ Pointers keep the type in the top 6 bits and the cell index in bits
+ 3 - 57, cells are 16 bytes.
+
+ Values have 6 type bits (2 - 7) and the value in bits 8 - 63, so
+ integers (i and u) are 56 bits wide. The 32 bit integers and floats
+ are values too, with the 32 bits in bits 32 - 63. They keep their
+ PTR_TYPE_BOXED_x type names so that code dispatching on type_of
+ works for both layouts, but they never allocate and is_ptr is false
+ for them.
+
+ PTR_TYPE_BOXED_I < PTR_TYPE_BOXED_U < PTR_TYPE_BOXED_F and all are
+ larger than VAL_TYPE_U, as in the 32 bit layout, the arithmetic
+ promotes towards the larger type.
+*/
+#define CONS_CELL_SIZE              16
+#define ADDRESS_SHIFT               3
+#define VAL_SHIFT                   8
+
+#define PTR_MASK                    0x0000000000000001ull
+#define PTR                         0x0000000000000001ull
+#define PTR_VAL_MASK                0x03FFFFFFFFFFFFF8ull
+#define PTR_TYPE_MASK               0xFC00000000000000ull
+
+#define PTR_TYPE_CONS               0x1000000000000000ull
+#define PTR_TYPE_SYMBOL_INDIRECTION 0x5000000000000000ull
+
+#define PTR_TYPE_BYTECODE           0xC000000000000000ull
+#define PTR_TYPE_ARRAY              0xD000000000000000ull
+#define PTR_TYPE_REF                0xE000000000000000ull //untyped reference to memory location
+#define PTR_TYPE_STREAM             0xF000000000000000ull
+
+#define GC_MASK                     0x0000000000000002ull
+#define GC_MARKED                   0x0000000000000002ull
+
+#define VAL_MASK                    0xFFFFFFFFFFFFFF00ull
+#define VAL_TYPE_MASK               0x00000000000000FCull
+                                                        //    gc ptr
+#define VAL_TYPE_SYMBOL             0x0000000000000000ull // 00  0   0
+#define VAL_TYPE_CHAR               0x0000000000000004ull // 01  0   0
+#define VAL_TYPE_I                  0x0000000000000008ull // 10  0   0
+#define VAL_TYPE_U                  0x000000000000000Cull // 11  0   0
+
+#define PTR_TYPE_BOXED_I            0x0000000000000010ull
+#define PTR_TYPE_BOXED_U            0x0000000000000014ull
+#define PTR_TYPE_BOXED_F            0x0000000000000018ull
+#define BOXED_SHIFT                 32
+#else
 #define CONS_CELL_SIZE              8
 #define ADDRESS_SHIFT               3
 #define VAL_SHIFT                   4
@@ -181,6 +232,7 @@ Aux bits could be used for storing vector size. Up to 30bits should be available
 #define VAL_TYPE_CHAR               0x00000004u // 01  0   0 
 #define VAL_TYPE_I                  0x00000008u // 10  0   0
 #define VAL_TYPE_U                  0x0000000Cu // 11  0   0
+#endif
 
 #define MAX_CONSTANTS               256
 
@@ -206,8 +258,10 @@ typedef struct {
   unsigned int gc_recovered_arrays;// Number of arrays recovered by sweep.
 } heap_state_t;
 
+/* The header is 8 bytes in both layouts, the data follows it. Elements
+   other than characters take sizeof(UINT) bytes. */
 typedef struct {
-  TYPE elt_type;            // Type of elements: VAL_TYPE_FLOAT, U, I or CHAR
+  uint32_t elt_type;        // Type of elements: VAL_TYPE_FLOAT, U, I or CHAR
   uint32_t size;            // Number of elements
 } array_header_t;
 
@@ -281,7 +335,7 @@ static inline VALUE set_ptr_type(VALUE p, TYPE t) {
   return (PTR_VAL_MASK & p) | t | PTR;
 }
 
-static inline VALUE enc_sym(uint32_t s) {
+static inline VALUE enc_sym(UINT s) {
   return (s << VAL_SHIFT) | VAL_TYPE_SYMBOL;
 }
 
@@ -293,6 +347,21 @@ static inline VALUE enc_u(UINT x) {
   return (x << VAL_SHIFT) | VAL_TYPE_U;
 }
 
+#ifdef LISPBM_64BIT
+static inline VALUE enc_I(INT x) {
+  return ((VALUE)(uint32_t)x << BOXED_SHIFT) | PTR_TYPE_BOXED_I;
+}
+
+static inline VALUE enc_U(UINT x) {
+  return ((VALUE)(uint32_t)x << BOXED_SHIFT) | PTR_TYPE_BOXED_U;
+}
+
+static inline VALUE enc_F(FLOAT x) {
+  uint32_t t;
+  memcpy(&t, &x, sizeof(float));
+  return ((VALUE)t << BOXED_SHIFT) | PTR_TYPE_BOXED_F;
+}
+#else
 static inline VALUE enc_I(INT x) {
   VALUE i = cons((UINT)x, enc_sym(DEF_REPR_BOXED_I_TYPE));
   if (type_of(i) == VAL_TYPE_SYMBOL) return i;
@@ -312,6 +381,7 @@ static inline VALUE enc_F(FLOAT x) {
   if (type_of(f) == VAL_TYPE_SYMBOL) return f;
   return set_ptr_type(f, PTR_TYPE_BOXED_F);
 }
+#endif
 
 static inline VALUE enc_char(char x) {
   return ((UINT)x << VAL_SHIFT) | VAL_TYPE_CHAR;
@@ -333,19 +403,28 @@ static inline UINT dec_sym(VALUE x) {
   return x >> VAL_SHIFT;
 }
 
+/* The 32 bits of a boxed value */
+static inline uint32_t boxed_bits(VALUE x) {
+#ifdef LISPBM_64BIT
+  return (uint32_t)(x >> BOXED_SHIFT);
+#else
+  return car(x);
+#endif
+}
+
 static inline FLOAT dec_f(VALUE x) { // Use only when knowing that x is a VAL_TYPE_F
   FLOAT f_tmp;
-  UINT tmp = car(x);
+  uint32_t tmp = boxed_bits(x);
   memcpy(&f_tmp, &tmp, sizeof(FLOAT));
   return f_tmp;
 }
 
 static inline UINT dec_U(VALUE x) {
-  return car(x);
+  return boxed_bits(x);
 }
 
 static inline INT dec_I(VALUE x) {
-  return (INT)car(x);
+  return (int32_t)boxed_bits(x);
 }
 
 static inline VALUE val_set_gc_mark(VALUE x) {
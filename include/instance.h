@@ -0,0 +1,209 @@
+/*
+    Copyright 2020 Joel Svensson	svenssonjoel@yahoo.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+   An instance holds all runtime state of one interpreter: managed
+   memory, symbols, heap, global environment, extensions and the
+   evaluators.
+
+   The functions in memory.h, symrepr.h, heap.h, env.h, extensions.h,
+   tokpar.h, eval_cps.h, ec_eval.h and bytecode.h work on the instance
+   that is bound to the calling thread. A thread that has not bound an
+   instance uses the default instance, so a host with a single
+   interpreter needs no changes.
+
+   To run several interpreters, create one instance per interpreter
+   and bind it (instance_bind) in every thread that works on it before
+   calling memory_init, symrepr_init and so on. With the concurrent
+   evaluator that is both the thread running eval_cps_run_eval and the
+   threads that parse programs or post events.
+
+   By default the binding is a plain global, shared by all threads,
+   so only one instance is active at a time. Building with
+   -DINSTANCE_USE_TLS makes it thread local (_Thread_local), which is
+   what several instances on several threads need. The Linux builds
+   do so. Thread local storage makes every instance_current() a
+   little more expensive, on x86-64 (static library, initial exec
+   model) fib 25 on the non concurrent evaluator ran about 3% slower
+   than with the plain global. On embedded targets it is often a call
+   into the C library.
+*/
+
+#ifndef INSTANCE_H_
+#define INSTANCE_H_
+
+#include <stdatomic.h>
+
+#include "typedefs.h"
+#include "heap.h"
+#include "symrepr.h"
+#include "stack.h"
+#include "extensions.h"
+#include "eval_cps.h"
+
+#ifdef INSTANCE_USE_TLS
+#define INSTANCE_THREAD_LOCAL _Thread_local
+#else
+#define INSTANCE_THREAD_LOCAL
+#endif
+
+#define ANALYZE_SCOPE_SIZE 128
+#define EVAL_CPS_EVENT_QUEUE_SIZE 64 // power of two
+#define EVAL_CPS_CALL_CACHE_SIZE  64
+
+typedef struct {
+  atomic_uint seq;
+  unsigned int type;
+  CID cid;
+  VALUE fun;
+  VALUE arg;
+} eval_cps_event_t;
+
+typedef struct {
+  VALUE exp;
+  UINT  version;
+  VALUE binding;
+} eval_cps_call_cache_entry_t;
+
+typedef struct {
+  UINT cont;
+  VALUE env;
+  VALUE unev;
+  VALUE prg;
+  VALUE exp;
+  VALUE argl;
+  VALUE val;
+  VALUE fun;
+
+  stack S;
+} register_machine_t;
+
+typedef struct instance_s {
+  /* memory.c */
+  struct {
+    uint32_t *bitmap;
+    uint32_t *data;
+    uint32_t data_size;    // in 4 byte words
+    uint32_t bitmap_size;  // in 4 byte words
+    uintptr_t base_address;
+  } mem;
+
+  /* symrepr.c */
+  struct {
+    uintptr_t *symlist;
+    UINT next_symbol_id;
+    uintptr_t *buckets[SYMREPR_HASH_SIZE];
+    uint8_t special_buckets[SYMREPR_HASH_SIZE];
+    uint8_t special_next[NUM_SPECIAL_SYMBOLS];
+  } symrepr;
+
+  /* heap.c */
+  heap_state_t heap;
+
+  /* env.c */
+  VALUE env_global;
+
+  /* extensions.c */
+  struct {
+    extension_t *table;
+    UINT table_size;
+    UINT num;
+  } extensions;
+
+  /* analyze.c */
+  struct {
+    VALUE scope[ANALYZE_SCOPE_SIZE];
+    unsigned int scope_n;
+  } analyze;
+
+  /* bytecode.c */
+  struct {
+    stack vm_stack;
+    bool vm_stack_ok;
+  } bytecode;
+
+  /* ec_eval.c */
+  struct {
+    register_machine_t rm_state;
+    char str[1024];
+    char err[1024];
+  } ec_eval;
+
+  /* eval_cps.c */
+  struct {
+    bool eval_running;
+    uint32_t reductions_per_slice;
+
+    atomic_bool eval_loop_active;
+    atomic_bool pause_request;
+    atomic_bool paused;
+
+    eval_context_t *ctx_queue;
+    eval_context_t *ctx_queue_last;
+    eval_context_t *ctx_done;
+    eval_context_t *ctx_blocked;
+    eval_context_t *ctx_running;
+    eval_context_t ctx_non_concurrent;
+
+    eval_context_t *ctx_pool;
+    UINT *ctx_pool_stacks;
+    unsigned int ctx_pool_size;
+    unsigned int ctx_pool_stack_size;
+    eval_context_t *ctx_free;
+
+    unsigned int ctx_slot_bits;
+
+    eval_context_t **ctx_sleeping;
+    unsigned int ctx_sleeping_num;
+
+    void (*usleep_callback)(uint32_t);
+    uint32_t (*timestamp_us_callback)(void);
+    void (*ctx_done_callback)(eval_context_t *);
+    void (*ctx_wait_callback)(void);
+    void (*ctx_notify_callback)(void);
+
+    eval_cps_event_t event_queue[EVAL_CPS_EVENT_QUEUE_SIZE];
+    atomic_uint event_enqueue_pos;
+    unsigned int event_dequeue_pos;
+
+    eval_cps_call_cache_entry_t call_cache[EVAL_CPS_CALL_CACHE_SIZE];
+    UINT global_version;
+
+    eval_cps_root_t *roots;
+    VALUE *held;
+    unsigned int held_num;
+    unsigned int held_size;
+  } eval_cps;
+} instance_t;
+
+extern INSTANCE_THREAD_LOCAL instance_t *instance_bound;
+
+/* The instance used by the calling thread */
+static inline instance_t *instance_current(void) {
+  return instance_bound;
+}
+
+/* Allocates a new, uninitialized instance. Returns NULL on failure. */
+extern instance_t *instance_create(void);
+/* Frees an instance after freeing the evaluator, heap, symbols and
+   extensions that it owns. The memory given to memory_init belongs
+   to the host. */
+extern void instance_destroy(instance_t *inst);
+/* Bind inst to the calling thread, NULL binds the default instance */
+extern void instance_bind(instance_t *inst);
+
+#endif
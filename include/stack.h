@@ -23,18 +23,39 @@
 
 #include "typedefs.h"
 
+/*
+   A growable stack is a linked list of segments. When the top
+   segment is full a new segment is linked on top of it, nothing is
+   copied. data, sp and size always describe the top segment, each
+   segment remembers the data, sp and size of the one below it.
+*/
+typedef struct stack_segment_s {
+  struct stack_segment_s *prev;  // NULL if the segment below is the base
+  UINT *prev_data;
+  unsigned int prev_sp;
+  unsigned int prev_size;
+  unsigned int size;
+  UINT data[];
+} stack_segment_t;
+
 typedef struct {
   UINT* data;
   unsigned int sp;
   unsigned int size;
   bool growable;
+  stack_segment_t *seg;    // top segment, NULL when data is the base
+  stack_segment_t *spare;  // last segment that was popped, kept for reuse
+  unsigned int seg_size;
 } stack;
 
+typedef int (*stack_data_fptr)(UINT *data, unsigned int n);
+
 extern int stack_allocate(stack *s, unsigned int stack_size, bool growable);
 extern int stack_create(stack *s, UINT* data, unsigned int size);
 extern void stack_free(stack *s);
 extern int stack_clear(stack *s);
 extern int stack_copy(stack *dest, stack *src);
+extern void stack_foreach_segment(stack *s, stack_data_fptr f);
 extern UINT *stack_ptr(stack *s, unsigned int n);
 extern int stack_drop(stack *s, unsigned int n);
 extern int push_u32(stack *s, UINT val);
@@ -43,13 +64,17 @@ extern int pop_u32(stack *s, UINT *val);
 extern int pop_k(stack *s, VALUE (**k)(VALUE));
 
 static inline int stack_is_empty(stack *s) {
-  if (s->sp == 0) return 1;
-  return 0;
+  if (s->sp) return 0;
+  for (stack_segment_t *seg = s->seg; seg; seg = seg->prev) {
+    if (seg->prev_sp) return 0;
+  }
+  return 1;
 }
 
 static inline int stack_arg_ix(stack *s, unsigned int ix, UINT *res) {
-  if (ix > s->sp-1) return 0;
-  *res = s->data[s->sp-(ix+1)];
+  UINT *p = stack_ptr(s, ix + 1);
+  if (!p) return 0;
+  *res = *p;
   return 1;
 }
 
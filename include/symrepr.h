@@ -66,6 +66,20 @@
 #define DEF_REPR_TYPE_CHAR      0x31
 #define DEF_REPR_TYPE_REF       0x32
 
+// Analysed expression nodes (see analyze.c)
+#define DEF_REPR_AN_CONST       0x40
+#define DEF_REPR_AN_GLOBAL      0x41
+#define DEF_REPR_AN_APP         0x42
+#define DEF_REPR_AN_IF          0x43
+#define DEF_REPR_AN_LET         0x44
+#define DEF_REPR_AN_LAMBDA      0x45
+#define DEF_REPR_AN_PROGN       0x46
+#define DEF_REPR_AN_DEFINE      0x47
+#define DEF_REPR_AN_AND         0x48
+#define DEF_REPR_AN_OR          0x49
+#define DEF_REPR_AN_FIRST       DEF_REPR_AN_CONST
+#define DEF_REPR_AN_LAST        DEF_REPR_AN_OR
+
 // Fundamental Operations
 #define FUNDAMENTALS_START      0x100
 #define SYM_ADD                 0x100
@@ -86,6 +100,9 @@
 #define SYM_YIELD               0x113
 #define SYM_WAIT                0x114
 #define SYM_SPAWN               0x115
+#define SYM_SEND                0x116
+#define SYM_RECV                0x117
+#define SYM_SELF                0x118
 
 #define SYM_CONS                0x120
 #define SYM_CAR                 0x121
@@ -110,9 +127,17 @@
 
 #define MAX_SPECIAL_SYMBOLS 4096 // 12bits (highest id allowed is 0xFFFF) 
 
+#define NUM_SPECIAL_SYMBOLS 80
+#define SYMREPR_HASH_SIZE   64  // power of two
+
 extern int symrepr_addsym(char *, UINT*);
 extern bool symrepr_init(void);
 extern int symrepr_lookup(char *, UINT*);
+/* Lookup and add for names that are len characters long, not
+   terminated, and read as lower case. Used by the parser on slices of
+   its input. */
+extern int symrepr_lookup_lower(const char *name, unsigned int len, UINT *id);
+extern int symrepr_addsym_lower(const char *name, unsigned int len, UINT *id);
 extern const char* symrepr_lookup_name(UINT);
 extern void symrepr_del(void);
 
@@ -141,6 +166,9 @@ static inline UINT symrepr_eval(void)        { return SYM_EVAL; }
 static inline UINT symrepr_yield(void)       { return SYM_YIELD; }
 static inline UINT symrepr_wait(void)        { return SYM_WAIT; }
 static inline UINT symrepr_spawn(void)       { return SYM_SPAWN; }
+static inline UINT symrepr_send(void)        { return SYM_SEND; }
+static inline UINT symrepr_recv(void)        { return SYM_RECV; }
+static inline UINT symrepr_self(void)        { return SYM_SELF; }
 
 static inline UINT symrepr_rerror(void)      { return DEF_REPR_RERROR; }
 static inline UINT symrepr_terror(void)      { return DEF_REPR_TERROR; }
@@ -20,7 +20,43 @@
 
 #include "typedefs.h"
 
+/*
+   Returns the program as a list of expressions, or the symbol rerror
+   for malformed input and merror when the heap is exhausted. When the
+   heap is full the parser collects garbage (eval_cps_gc). While the
+   evaluator runs in another thread, pause it around parsing
+   (eval_cps_pause_eval), the heap is shared. The program is a root
+   until it is evaluated or released (eval_cps_release_program).
+*/
 extern VALUE tokpar_parse(char *str);
 extern VALUE tokpar_parse_compressed(char *bytes);
 
+/*
+   Streaming parser for input that arrives in chunks. Feed the chunks
+   in order with tokpar_stream_feed and call tokpar_stream_next until
+   it returns TOKPAR_STREAM_MORE. Every complete top level expression
+   is returned as soon as it is closed, tokens and lists may be split
+   anywhere between chunks. Call tokpar_stream_end after the last
+   chunk to read the rest.
+
+   The partial results are roots for the garbage collector, and so is
+   the last returned expression until the next call, so expressions
+   can be evaluated between chunks. The same restrictions as for
+   tokpar_parse apply, and the stream must be destroyed before its
+   instance.
+*/
+#define TOKPAR_STREAM_MORE  0  // more input is needed
+#define TOKPAR_STREAM_FORM  1  // *form is an expression
+#define TOKPAR_STREAM_END   2  // all input has been read
+#define TOKPAR_STREAM_ERROR 3  // *form is rerror or merror, stays so
+
+typedef struct tokpar_stream_s tokpar_stream_t;
+
+extern tokpar_stream_t *tokpar_stream_create(void);
+extern void tokpar_stream_destroy(tokpar_stream_t *s);
+/* Copies the chunk, returns 0 if out of memory */
+extern int tokpar_stream_feed(tokpar_stream_t *s, const char *data, unsigned int n);
+extern void tokpar_stream_end(tokpar_stream_t *s);
+extern int tokpar_stream_next(tokpar_stream_t *s, VALUE *form);
+
 #endif
@@ -22,6 +22,25 @@
 #include <stdbool.h>
 #include <inttypes.h>
 
+/*
+   Building with -DLISPBM_64BIT selects 64 bit VALUEs, see heap.h for
+   the layout. The default is the 32 bit layout.
+*/
+#ifdef LISPBM_64BIT
+typedef uint64_t VALUE; // A Lisp value.
+typedef uint64_t TYPE;  // Representation of a type.
+
+typedef uint64_t UINT;
+typedef int64_t  INT;
+typedef float    FLOAT;
+
+#define PRI_VALUE PRIu64
+#define PRI_TYPE  PRIu64
+#define PRI_UINT  PRIu64
+#define PRI_INT   PRId64
+#define PRI_HEX   PRIx64
+#define PRI_FLOAT "f"
+#else
 typedef uint32_t VALUE; // A Lisp value.
 typedef uint32_t TYPE;  // Representation of a type.
 
@@ -33,8 +52,10 @@ typedef float    FLOAT;
 #define PRI_TYPE  PRIu32
 #define PRI_UINT  PRIu32
 #define PRI_INT   PRId32
+#define PRI_HEX   PRIx32
 #define PRI_FLOAT "f"
+#endif
 
-typedef uint16_t CID;
+typedef uint32_t CID;
 
 #endif
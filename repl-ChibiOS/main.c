@@ -108,6 +108,11 @@ void done_callback(eval_context_t *ctx) {
   } else {
     chprintf(chp,"<< Context %d finished with value %s >>\r\n# ", cid, error);
   }
+
+  /* Return the context to the pool */
+  if (!eval_cps_remove_done_ctx(cid, &t)) {
+    chprintf(chp,"Error: done context (%d) not in list\r\n", cid);
+  }
 }
 
 uint32_t timestamp_callback() {
@@ -194,8 +199,10 @@ int reset_repl(int heap_size) {
   else
     chprintf(chp,"Error adding extension.\r\n");
 
+  eval_cps_pause_eval();
   VALUE prelude = prelude_load();
   eval_cps_program(prelude);
+  eval_cps_continue_eval();
 
   chprintf(chp,"Lisp REPL started (ChibiOS)!\r\n");
   
@@ -230,6 +237,7 @@ static THD_FUNCTION(repl, arg) {
       reset_repl(heap_size);
       continue;
     } else if (strncmp(str, ":info", 5) == 0) {
+      eval_cps_pause_eval();
       chprintf(chp,"##(ChibiOS)#################################################\r\n");
       chprintf(chp,"Used cons cells: %lu \r\n", heap_size - heap_num_free());
       res = print_value(outbuf,2048, error, 1024, *env_get_global_ptr());
@@ -244,15 +252,18 @@ static THD_FUNCTION(repl, arg) {
       chprintf(chp,"Marked: %lu\r\n", heap_state.gc_marked);
       chprintf(chp,"Free cons cells: %lu\r\n", heap_num_free());
       chprintf(chp,"############################################################\r\n");
+      eval_cps_continue_eval();
       memset(outbuf,0, 2048);
     } else if (strncmp(str, ":quit", 5) == 0) {
       break;
     } else {
 
       VALUE t;
+      eval_cps_pause_eval();
       t = tokpar_parse(str);
 
       CID cid = eval_cps_program(t);
+      eval_cps_continue_eval();
       chprintf(chp,"started ctx: %u\r\n", cid);
     }
   }
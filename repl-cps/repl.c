@@ -305,8 +305,10 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  eval_cps_pause_eval();
   VALUE prelude = prelude_load();
   CID prelude_cid = eval_cps_program(prelude);
+  eval_cps_continue_eval();
     
   printf("Lisp REPL started!\n");
   printf("Type :quit to exit.\n");
@@ -325,6 +327,7 @@ int main(int argc, char **argv) {
     printf("\n");
 
     if (n >= 5 && strncmp(str, ":info", 5) == 0) {
+      eval_cps_pause_eval();
       printf("############################################################\n");
       printf("Used cons cells: %d\n", heap_size - heap_num_free());
       int r = print_value(output, 1024, error, 1024, *env_get_global_ptr());
@@ -345,12 +348,15 @@ int main(int argc, char **argv) {
       printf("Marked: %d\n", heap_state.gc_marked);
       printf("Free cons cells: %d\n", heap_num_free());
       printf("############################################################\n");
+      eval_cps_continue_eval();
     } else if (n >= 5 && strncmp(str, ":load", 5) == 0) {
       char *file_str = load_file(&str[5]);
       if (file_str) {
+	eval_cps_pause_eval();
 	VALUE f_exp = tokpar_parse(file_str);
 	free(file_str);
 	CID cid1 = eval_cps_program(f_exp);
+	eval_cps_continue_eval();
 	printf("started ctx: %u\n", cid1);
       }
     } else if (n >= 4 && strncmp(str, ":pon", 4) == 0) {
@@ -361,9 +367,11 @@ int main(int argc, char **argv) {
     } else {
 
       VALUE t;
+      eval_cps_pause_eval();
       t = tokpar_parse(str);
 
       CID cid = eval_cps_program(t);
+      eval_cps_continue_eval();
 
       printf("started ctx: %u\n", cid);
 
@@ -238,7 +238,9 @@ void main(void)
     usb_printf("Error initializing evaluator.\n\r");
   }
 	
+  eval_cps_pause_eval();
   VALUE prelude = prelude_load();
+  eval_cps_continue_eval();
   eval_cps_program_nc(prelude);
 
 
@@ -273,7 +275,9 @@ void main(void)
     } else {
 
       VALUE t;
+      eval_cps_pause_eval();
       t = tokpar_parse(str);
+      eval_cps_continue_eval();
 
       t = eval_cps_program_nc(t);
 
@@ -0,0 +1,234 @@
+/*
+    Copyright 2020 Joel Svensson	svenssonjoel@yahoo.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "symrepr.h"
+#include "heap.h"
+#include "env.h"
+#include "extensions.h"
+#include "typedefs.h"
+#include "analyze.h"
+#include "instance.h"
+
+/*
+   Symbols bound by enclosing lambdas and lets. A symbol that is not in
+   scope refers to the global environment. If nesting is deeper than
+   the scope can track, all symbols are assumed to be locally bound and
+   are left as they are.
+*/
+#define scope   (instance_current()->analyze.scope)
+#define scope_n (instance_current()->analyze.scope_n)
+
+static bool analyze(VALUE *exp);
+
+static void scope_push(VALUE sym) {
+  if (scope_n < ANALYZE_SCOPE_SIZE) {
+    scope[scope_n] = sym;
+  }
+  scope_n ++;
+}
+
+static bool in_scope(VALUE sym) {
+  if (scope_n > ANALYZE_SCOPE_SIZE) return true;
+
+  for (unsigned int i = 0; i < scope_n; i ++) {
+    if (scope[i] == sym) return true;
+  }
+  return false;
+}
+
+static bool global_binding(VALUE sym, VALUE *binding) {
+
+  VALUE curr = *env_get_global_ptr();
+
+  while (type_of(curr) == PTR_TYPE_CONS) {
+    if (car(car(curr)) == sym) {
+      *binding = car(curr);
+      return true;
+    }
+    curr = cdr(curr);
+  }
+  return false;
+}
+
+// Analyse each element of a list in place
+static bool analyze_list(VALUE list) {
+
+  VALUE curr = list;
+
+  while (type_of(curr) == PTR_TYPE_CONS) {
+    VALUE exp = car(curr);
+    if (!analyze(&exp)) return false;
+    set_car(curr, exp);
+    curr = cdr(curr);
+  }
+  return true;
+}
+
+static bool analyze_application(VALUE exp) {
+
+  if (!analyze_list(exp)) return false;
+
+  VALUE fun_args = cons(car(exp), cdr(exp));
+
+  if (type_of(fun_args) == VAL_TYPE_SYMBOL) {
+    return false;
+  }
+  set_car(exp, enc_sym(DEF_REPR_AN_APP));
+  set_cdr(exp, fun_args);
+  return true;
+}
+
+static bool analyze_form(VALUE exp) {
+
+  VALUE head = car(exp);
+
+  if (type_of(head) == VAL_TYPE_SYMBOL) {
+    UINT sym_id = dec_sym(head);
+
+    // Already analysed
+    if (sym_id >= DEF_REPR_AN_FIRST &&
+	sym_id <= DEF_REPR_AN_LAST) {
+      return true;
+    }
+
+    switch (sym_id) {
+    case DEF_REPR_QUOTE:
+      set_car(exp, enc_sym(DEF_REPR_AN_CONST));
+      set_cdr(exp, car(cdr(exp)));
+      return true;
+
+    case DEF_REPR_DEFINE:
+      if (!analyze_list(cdr(cdr(exp)))) return false;
+      set_car(exp, enc_sym(DEF_REPR_AN_DEFINE));
+      return true;
+
+    case DEF_REPR_LAMBDA: {
+      unsigned int n = scope_n;
+      VALUE params = car(cdr(exp));
+      while (type_of(params) == PTR_TYPE_CONS) {
+	scope_push(car(params));
+	params = cdr(params);
+      }
+      bool ok = analyze_list(cdr(cdr(exp)));
+      scope_n = n;
+      if (!ok) return false;
+      set_car(exp, enc_sym(DEF_REPR_AN_LAMBDA));
+      return true;
+    }
+
+    case DEF_REPR_LET: {
+      // let is letrec, all keys are in scope in all value expressions
+      unsigned int n = scope_n;
+      VALUE binds = car(cdr(exp));
+      VALUE curr = binds;
+      while (type_of(curr) == PTR_TYPE_CONS) {
+	scope_push(car(car(curr)));
+	curr = cdr(curr);
+      }
+      bool ok = true;
+      curr = binds;
+      while (ok && type_of(curr) == PTR_TYPE_CONS) {
+	ok = analyze_list(cdr(car(curr)));
+	curr = cdr(curr);
+      }
+      ok = ok && analyze_list(cdr(cdr(exp)));
+      scope_n = n;
+      if (!ok) return false;
+      set_car(exp, enc_sym(DEF_REPR_AN_LET));
+      return true;
+    }
+
+    case DEF_REPR_IF:
+      if (!analyze_list(cdr(exp))) return false;
+      set_car(exp, enc_sym(DEF_REPR_AN_IF));
+      return true;
+
+    case DEF_REPR_PROGN:
+      if (!analyze_list(cdr(exp))) return false;
+      set_car(exp, enc_sym(DEF_REPR_AN_PROGN));
+      return true;
+
+    case SYM_AND:
+      if (!analyze_list(cdr(exp))) return false;
+      set_car(exp, enc_sym(DEF_REPR_AN_AND));
+      return true;
+
+    case SYM_OR:
+      if (!analyze_list(cdr(exp))) return false;
+      set_car(exp, enc_sym(DEF_REPR_AN_OR));
+      return true;
+
+    case SYM_SPAWN:
+      // Spawn stays a special form, only the spawned expressions are analysed
+      return analyze_list(cdr(exp));
+
+    default:
+      break;
+    }
+  }
+  return analyze_application(exp);
+}
+
+static bool analyze(VALUE *exp) {
+
+  VALUE e = *exp;
+
+  switch (type_of(e)) {
+  case VAL_TYPE_SYMBOL: {
+    if (is_special(e) ||
+	is_extension(e) ||
+	in_scope(e)) {
+      return true;
+    }
+    VALUE binding;
+    if (!global_binding(e, &binding)) {
+      binding = e; // linked when first found defined
+    }
+    VALUE node = cons(enc_sym(DEF_REPR_AN_GLOBAL), binding);
+    if (type_of(node) == VAL_TYPE_SYMBOL) return false;
+    *exp = node;
+    return true;
+  }
+  case PTR_TYPE_CONS:
+    return analyze_form(e);
+  default:
+    return true;
+  }
+}
+
+VALUE analyze_program(VALUE prg) {
+
+  scope_n = 0;
+
+  if (!analyze_list(prg)) {
+    return enc_sym(symrepr_merror());
+  }
+  return prg;
+}
+
+VALUE analyze_global_value(VALUE node) {
+
+  VALUE binding = cdr(node);
+
+  if (type_of(binding) == VAL_TYPE_SYMBOL) {
+    if (!global_binding(binding, &binding)) {
+      return enc_sym(symrepr_not_found());
+    }
+    set_cdr(node, binding);
+  }
+  return cdr(binding);
+}
@@ -15,3 +15,1040 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef BYTECODE_JIT
+#define _DEFAULT_SOURCE
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#endif
+#include <string.h>
+
+#include "heap.h"
+#include "symrepr.h"
+#include "env.h"
+#include "stack.h"
+#include "memory.h"
+#include "fundamental.h"
+#include "extensions.h"
+#include "bytecode.h"
+#include "instance.h"
+
+#if defined(BYTECODE_JIT) && !defined(__i386__) && !defined(__x86_64__)
+#error "BYTECODE_JIT generates x86 code"
+#endif
+
+#define BYTECODE_STACK_SIZE 256
+#define BYTECODE_MAX_NAME   256
+
+/*
+   A bytecode object is a cell [bytecode_t* | sym_bytecode] (same scheme
+   as arrays). A code address is a PTR_TYPE_BYTECODE pointer to a cell
+   [object | offset]. Code addresses used as immediates are created when
+   the image is loaded and are kept alive by the constants of the object.
+*/
+
+static const uint8_t instr_size[BC_NUM_OPCODES] = {
+  0, // invalid
+  1, // jmpcnt
+  5, // jmpimm
+  1, // jmpval
+  6, // movimm
+  3, // mov
+  6, // lookup
+  5, // setglbval
+  2, // push
+  2, // pop
+  5, // bpf
+  5, // exenvargl
+  5, // exenvval
+  3, // cons
+  6, // consimm
+  3, // cdr
+  3, // cadr
+  3, // caddr
+  3, // car
+  1, // callf
+  1  // done
+};
+
+#define vm_stack    (instance_current()->bytecode.vm_stack)
+#define vm_stack_ok (instance_current()->bytecode.vm_stack_ok)
+
+#ifdef BYTECODE_JIT
+static void jit_compile(bytecode_t *bc);
+static void jit_free(bytecode_t *bc);
+#endif
+
+static inline uint32_t read_u32(uint8_t *p) {
+  return ((uint32_t)p[0]        |
+	  (uint32_t)p[1] << 8   |
+	  (uint32_t)p[2] << 16  |
+	  (uint32_t)p[3] << 24);
+}
+
+static inline void write_u32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+/* Immediates in the image, see bytecode.h */
+static inline bool img_is_ptr(uint32_t v) {
+  return v & BC_IMG_PTR;
+}
+
+static inline uint32_t img_ptr_type(uint32_t v) {
+  return v & BC_IMG_PTR_TYPE_MASK;
+}
+
+static inline unsigned int img_dec_ptr(uint32_t v) {
+  return (v & BC_IMG_PTR_VAL_MASK) >> BC_IMG_ADDRESS_SHIFT;
+}
+
+static inline VALUE img_value(uint32_t v) {
+#ifdef LISPBM_64BIT
+  switch (v & BC_IMG_VAL_TYPE_MASK) {
+  case BC_IMG_VAL_TYPE_SYMBOL: return enc_sym(v >> BC_IMG_VAL_SHIFT);
+  case BC_IMG_VAL_TYPE_CHAR:   return enc_char((char)(v >> BC_IMG_VAL_SHIFT));
+  case BC_IMG_VAL_TYPE_I:      return enc_i((int32_t)v >> BC_IMG_VAL_SHIFT);
+  default:                     return enc_u(v >> BC_IMG_VAL_SHIFT);
+  }
+#else
+  return v;
+#endif
+}
+
+static inline VALUE addr_object(VALUE addr) {
+  return car(addr);
+}
+
+static inline UINT addr_offset(VALUE addr) {
+  return dec_u(cdr(set_ptr_type(addr, PTR_TYPE_CONS)));
+}
+
+static inline bytecode_t *object_bytecode(VALUE obj) {
+  return (bytecode_t*)car(obj);
+}
+
+/* A code address and not the object it refers to, which has the same
+   pointer type */
+static inline bool is_code_addr(VALUE v) {
+  return (type_of(v) == PTR_TYPE_BYTECODE &&
+	  type_of(cdr(set_ptr_type(v, PTR_TYPE_CONS))) == VAL_TYPE_U);
+}
+
+/* offset of the VALUE immediate in an instruction, 0 if none */
+static unsigned int imm_offset(uint8_t op) {
+  switch (op) {
+  case BC_MOVIMM:
+  case BC_LOOKUP:
+  case BC_CONSIMM:
+    return 2;
+  case BC_SETGLBVAL:
+  case BC_EXENVARGL:
+  case BC_EXENVVAL:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static bool is_sym_operand(uint8_t op) {
+  return (op == BC_LOOKUP    ||
+	  op == BC_SETGLBVAL ||
+	  op == BC_EXENVARGL ||
+	  op == BC_EXENVVAL);
+}
+
+static unsigned int num_reg_operands(uint8_t op) {
+  switch (op) {
+  case BC_MOVIMM:
+  case BC_LOOKUP:
+  case BC_CONSIMM:
+  case BC_PUSH:
+  case BC_POP:
+    return 1;
+  case BC_MOV:
+  case BC_CONS:
+  case BC_CDR:
+  case BC_CADR:
+  case BC_CADDR:
+  case BC_CAR:
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+/* Jumps and code addresses must refer to the start of an instruction.
+   Returns 1 if they do, 0 if not and -1 if out of memory. */
+static int check_targets(uint8_t *code, uint32_t code_size) {
+
+  uint32_t *starts = memory_allocate((code_size + 31) / 32);
+  if (!starts) return -1;
+  memset(starts, 0, ((code_size + 31) / 32) * sizeof(uint32_t));
+
+  unsigned int pc = 0;
+  while (pc < code_size) {
+    starts[pc / 32] |= 1u << (pc % 32);
+    pc += instr_size[code[pc]];
+  }
+
+  int ok = 1;
+  pc = 0;
+  while (ok && pc < code_size) {
+    uint8_t op = code[pc];
+    uint32_t target = code_size;
+    bool is_target = false;
+    if (op == BC_JMPIMM || op == BC_BPF) {
+      target = read_u32(&code[pc + 1]);
+      is_target = true;
+    } else if (imm_offset(op)) {
+      uint32_t v = read_u32(&code[pc + imm_offset(op)]);
+      if (img_is_ptr(v) && img_ptr_type(v) == BC_IMG_PTR_TYPE_BYTECODE) {
+	target = img_dec_ptr(v);
+	is_target = true;
+      }
+    }
+    if (is_target &&
+	(target >= code_size ||
+	 !(starts[target / 32] & (1u << (target % 32))))) {
+      ok = 0;
+    }
+    pc += instr_size[op];
+  }
+  memory_free(starts);
+  return ok;
+}
+
+static VALUE mk_code_addr(VALUE obj, UINT offset) {
+  VALUE addr = cons(obj, enc_u(offset));
+  if (type_of(addr) == VAL_TYPE_SYMBOL) return addr;
+  return set_ptr_type(addr, PTR_TYPE_BYTECODE);
+}
+
+/* Find the name of a symbol indirection in the image and return the symbol */
+static bool resolve_indirection(uint8_t *table, unsigned int n, uint8_t *end,
+				uint32_t ind, VALUE *res) {
+  uint8_t *p = table;
+  char name[BYTECODE_MAX_NAME];
+
+  for (unsigned int i = 0; i < n; i ++) {
+    if (p + 8 > end) return false;
+    uint32_t v = read_u32(p);
+    uint32_t len = read_u32(p + 4);
+    p += 8;
+    if (len >= BYTECODE_MAX_NAME || p + len > end) return false;
+    if (v == ind) {
+      UINT id;
+      memcpy(name, p, len);
+      name[len] = 0;
+      if (!symrepr_lookup(name, &id) &&
+	  !symrepr_addsym(name, &id)) {
+	return false;
+      }
+      *res = enc_sym(id);
+      return true;
+    }
+    p += len;
+  }
+  return false;
+}
+
+void bytecode_free(bytecode_t *bc) {
+#ifdef BYTECODE_JIT
+  if (bc->jit) jit_free(bc);
+#endif
+  if (bc->code) memory_free((uint32_t*)bc->code);
+  if (bc->constants) memory_free((uint32_t*)bc->constants);
+  memory_free((uint32_t*)bc);
+}
+
+VALUE bytecode_create(uint8_t *image, unsigned int size) {
+
+  VALUE rerror = enc_sym(symrepr_rerror());
+  VALUE merror = enc_sym(symrepr_merror());
+
+  if (size < BC_HEADER_SIZE ||
+      read_u32(image) != BC_MAGIC) {
+    return rerror;
+  }
+
+  uint32_t code_size = read_u32(image + 4);
+  uint32_t num_consts = read_u32(image + 8);
+  uint32_t num_inds = read_u32(image + 12);
+  uint8_t *end = image + size;
+  uint8_t *code = image + BC_HEADER_SIZE;
+
+  if (code_size == 0 || code_size > size - BC_HEADER_SIZE) return rerror;
+
+  /* Validate the code and count the code address immediates */
+  unsigned int num_addrs = 0;
+  unsigned int num_imms = 0;
+  unsigned int pc = 0;
+  while (pc < code_size) {
+    uint8_t op = code[pc];
+    if (op == 0 || op >= BC_NUM_OPCODES ||
+	pc + instr_size[op] > code_size) {
+      return rerror;
+    }
+    for (unsigned int i = 0; i < num_reg_operands(op); i ++) {
+      if (code[pc + 1 + i] >= BC_NUM_REGS) return rerror;
+    }
+    unsigned int imm = imm_offset(op);
+    if (imm) {
+      uint32_t v = read_u32(&code[pc + imm]);
+      if (img_is_ptr(v) && img_ptr_type(v) == BC_IMG_PTR_TYPE_BYTECODE) {
+	num_addrs ++;
+      }
+      num_imms ++;
+    }
+    pc += instr_size[op];
+  }
+
+  int targets_ok = check_targets(code, code_size);
+  if (targets_ok < 0) return merror;
+  if (!targets_ok) return rerror;
+
+  /* Locate the indirection table */
+  uint8_t *consts = code + code_size;
+  uint8_t *p = consts;
+  for (unsigned int i = 0; i < num_consts; i ++) {
+    if (end - p < 5) return rerror;
+    uint32_t len = (p[0] == BC_CONST_STRING) ? read_u32(p + 1) : 0;
+    p += 5;
+    if (len > (size_t)(end - p)) return rerror;
+    p += len;
+  }
+  uint8_t *inds = p;
+
+  /* Allocate the object. A 64 bit VALUE does not fit in the code, so
+     there every immediate is kept in the constant pool and the code
+     holds its index. */
+#ifdef LISPBM_64BIT
+  unsigned int pool_size = num_consts + num_addrs + num_imms + 1;
+#else
+  (void)num_imms;
+  unsigned int pool_size = num_consts + num_addrs + 1;
+#endif
+  bytecode_t *bc = (bytecode_t*)memory_allocate((sizeof(bytecode_t) + 3) / 4);
+  if (!bc) return merror;
+  memset(bc, 0, sizeof(bytecode_t));
+  bc->code = (uint8_t*)memory_allocate((code_size + 3) / 4);
+  bc->constants = (VALUE*)memory_allocate(pool_size * (sizeof(VALUE) / 4));
+  if (!bc->code || !bc->constants) {
+    bytecode_free(bc);
+    return merror;
+  }
+  bc->code_size = code_size;
+  memcpy(bc->code, code, code_size);
+
+  VALUE obj = heap_allocate_cell(PTR_TYPE_CONS);
+  if (type_of(obj) == VAL_TYPE_SYMBOL) {
+    bytecode_free(bc);
+    return merror;
+  }
+  set_car(obj, (UINT)bc);
+  set_cdr(obj, enc_sym(DEF_REPR_BYTECODE_TYPE));
+  obj = set_ptr_type(obj, PTR_TYPE_BYTECODE);
+
+  /* From here on the object is owned by the GC */
+
+  p = consts;
+  for (unsigned int i = 0; i < num_consts; i ++) {
+    uint8_t type = p[0];
+    uint32_t v = read_u32(p + 1);
+    VALUE c;
+    p += 5;
+    switch (type) {
+    case BC_CONST_I32:
+      c = enc_I((INT)v);
+      break;
+    case BC_CONST_U32:
+      c = enc_U(v);
+      break;
+    case BC_CONST_F32: {
+      FLOAT f;
+      memcpy(&f, &v, sizeof(FLOAT));
+      c = enc_F(f);
+      break;
+    }
+    case BC_CONST_STRING: {
+      if (v > (size_t)(end - p)) return rerror;
+      if (heap_allocate_array(&c, v + 1, VAL_TYPE_CHAR) != 1) return merror;
+      array_header_t *array = (array_header_t*)car(c);
+      memcpy((char*)array + 8, p, v);
+      ((char*)array)[8 + v] = 0;
+      p += v;
+      break;
+    }
+    default:
+      return rerror;
+    }
+    if (type_of(c) == VAL_TYPE_SYMBOL) return c;
+    bc->constants[bc->num_constants++] = c;
+  }
+
+  /* Relocate immediates */
+  pc = 0;
+  while (pc < code_size) {
+    uint8_t op = bc->code[pc];
+    unsigned int imm = imm_offset(op);
+    if (imm) {
+      uint32_t iv = read_u32(&bc->code[pc + imm]);
+      VALUE v = img_value(iv);
+      if (img_is_ptr(iv)) {
+	switch (img_ptr_type(iv)) {
+	case BC_IMG_PTR_TYPE_SYMBOL_INDIRECTION:
+	  if (!resolve_indirection(inds, num_inds, end, iv, &v)) return rerror;
+	  break;
+	case BC_IMG_PTR_TYPE_BYTECODE:
+	  v = mk_code_addr(obj, img_dec_ptr(iv));
+	  if (type_of(v) == VAL_TYPE_SYMBOL) return v;
+	  bc->constants[bc->num_constants++] = v;
+	  break;
+	default:
+	  if (img_dec_ptr(iv) >= num_consts) return rerror;
+	  v = bc->constants[img_dec_ptr(iv)];
+	  break;
+	}
+      }
+#ifdef LISPBM_64BIT
+      write_u32(&bc->code[pc + imm], bc->num_constants);
+      bc->constants[bc->num_constants++] = v;
+#else
+      write_u32(&bc->code[pc + imm], v);
+#endif
+      if (is_sym_operand(op) && type_of(v) != VAL_TYPE_SYMBOL) return rerror;
+    }
+    pc += instr_size[op];
+  }
+
+  VALUE entry = mk_code_addr(obj, 0);
+  if (type_of(entry) == VAL_TYPE_SYMBOL) return entry;
+  bc->constants[bc->num_constants++] = entry;
+#ifdef BYTECODE_JIT
+  jit_compile(bc);
+#endif
+  return entry;
+}
+
+bool bytecode_is_callable(VALUE fun) {
+  if (is_code_addr(fun)) return true;
+
+  /* (proc entry env), the symbol is looked up last as the other
+     checks already reject interpreted closures */
+  if (type_of(fun) != PTR_TYPE_CONS) return false;
+  VALUE rest = cdr(fun);
+  if (type_of(rest) != PTR_TYPE_CONS || !is_code_addr(car(rest))) return false;
+  rest = cdr(rest);
+  UINT proc;
+  return (type_of(rest) == PTR_TYPE_CONS &&
+	  is_symbol_nil(cdr(rest)) &&
+	  is_symbol(car(fun)) &&
+	  symrepr_lookup("proc", &proc) &&
+	  dec_sym(car(fun)) == proc);
+}
+
+/* ------------------------------------------------------------
+   VM
+   ------------------------------------------------------------ */
+
+typedef struct {
+  VALUE regs[BC_NUM_REGS];
+  VALUE addr;       // code address of the running object
+  bytecode_t *bc;
+  UINT pc;
+  bytecode_gc_fptr gc;
+  bool stopped;
+  VALUE result;
+} vm_state_t;
+
+static bool vm_gc(vm_state_t *vm) {
+
+  if (!vm->gc) return false;
+
+  for (int i = 0; i < BC_NUM_REGS; i ++) {
+    if (!push_u32(&vm_stack, vm->regs[i])) {
+      stack_drop(&vm_stack, (unsigned int)i);
+      return false;
+    }
+  }
+  if (!push_u32(&vm_stack, vm->addr)) {
+    stack_drop(&vm_stack, BC_NUM_REGS);
+    return false;
+  }
+
+  vm->gc(&vm_stack);
+  stack_drop(&vm_stack, BC_NUM_REGS + 1);
+  return true;
+}
+
+/* The VALUE immediate at p, in the code or in the constant pool */
+static inline VALUE vm_imm(vm_state_t *vm, uint8_t *p) {
+#ifdef LISPBM_64BIT
+  return vm->bc->constants[read_u32(p)];
+#else
+  (void)vm;
+  return read_u32(p);
+#endif
+}
+
+static inline void vm_jump(vm_state_t *vm, VALUE addr) {
+  vm->addr = addr;
+  vm->bc = object_bytecode(addr_object(addr));
+  vm->pc = addr_offset(addr);
+}
+
+static bool vm_stop(vm_state_t *vm, VALUE res) {
+  vm->stopped = true;
+  vm->result = res;
+  return false;
+}
+
+static VALUE vm_lookup(vm_state_t *vm, VALUE sym) {
+  if (is_special(sym) ||
+      extensions_lookup(dec_sym(sym)) != NULL) {
+    return sym;
+  }
+  VALUE v = env_lookup(sym, vm->regs[BC_REG_ENV]);
+  if (type_of(v) == VAL_TYPE_SYMBOL &&
+      dec_sym(v) == symrepr_not_found()) {
+    v = env_lookup(sym, *env_get_global_ptr());
+  }
+  return v;
+}
+
+static VALUE vm_callf(vm_state_t *vm) {
+
+  VALUE proc = vm->regs[BC_REG_PROC];
+  unsigned int n = 0;
+  VALUE curr = vm->regs[BC_REG_ARGL];
+
+  if (type_of(proc) != VAL_TYPE_SYMBOL) {
+    return enc_sym(symrepr_eerror());
+  }
+
+  while (type_of(curr) == PTR_TYPE_CONS) {
+    if (!push_u32(&vm_stack, car(curr))) {
+      return enc_sym(symrepr_eerror());
+    }
+    n ++;
+    curr = cdr(curr);
+  }
+
+  extension_fptr f = extensions_lookup(dec_sym(proc));
+  VALUE res;
+
+  for (int attempt = 0; attempt < 2; attempt ++) {
+    UINT *args = stack_ptr(&vm_stack, n); // vm_gc may grow the stack
+    if (!args) {
+      res = enc_sym(symrepr_merror());
+      break;
+    }
+    if (is_fundamental(proc)) {
+      res = fundamental_exec(args, n, proc);
+    } else if (f) {
+      res = f(args, (int)n);
+    } else {
+      res = enc_sym(symrepr_eerror());
+    }
+    if (!is_symbol_merror(res) || !vm_gc(vm)) break;
+  }
+  stack_drop(&vm_stack, n);
+  return res;
+}
+
+/* Allocate, collecting garbage and retrying once on failure.
+   dest is not written until the allocation has succeeded. */
+#define VM_ALLOC(dest, exp)						\
+  do {									\
+    VALUE vm_alloc_res = (exp);						\
+    if (is_symbol_merror(vm_alloc_res)) {				\
+      if (!vm_gc(vm)) return vm_stop(vm, enc_sym(symrepr_merror()));	\
+      vm_alloc_res = (exp);						\
+      if (is_symbol_merror(vm_alloc_res)) return vm_stop(vm, vm_alloc_res); \
+    }									\
+    (dest) = vm_alloc_res;						\
+  } while (0)
+
+/* Instructions. ip points at the instruction and vm->pc is already
+   past it. Return false when the VM stops, the result is then in
+   vm->result. */
+
+static bool vm_jmpcnt(vm_state_t *vm, uint8_t *ip) {
+  (void)ip;
+  if (!is_code_addr(vm->regs[BC_REG_CONT])) {
+    return vm_stop(vm, vm->regs[BC_REG_VAL]); // Return to the caller of the VM
+  }
+  vm_jump(vm, vm->regs[BC_REG_CONT]);
+  return true;
+}
+
+static bool vm_jmpimm(vm_state_t *vm, uint8_t *ip) {
+  vm->pc = read_u32(ip + 1);
+  return true;
+}
+
+static bool vm_jmpval(vm_state_t *vm, uint8_t *ip) {
+  (void)ip;
+  if (!is_code_addr(vm->regs[BC_REG_VAL])) {
+    return vm_stop(vm, enc_sym(symrepr_eerror()));
+  }
+  vm_jump(vm, vm->regs[BC_REG_VAL]);
+  return true;
+}
+
+static bool vm_movimm(vm_state_t *vm, uint8_t *ip) {
+  vm->regs[ip[1]] = vm_imm(vm, ip + 2);
+  return true;
+}
+
+static bool vm_mov(vm_state_t *vm, uint8_t *ip) {
+  vm->regs[ip[1]] = vm->regs[ip[2]];
+  return true;
+}
+
+static bool vm_lookup_op(vm_state_t *vm, uint8_t *ip) {
+  vm->regs[ip[1]] = vm_lookup(vm, vm_imm(vm, ip + 2));
+  return true;
+}
+
+static bool vm_setglbval(vm_state_t *vm, uint8_t *ip) {
+  VALUE new_env;
+  VM_ALLOC(new_env, env_set(*env_get_global_ptr(),
+			    vm_imm(vm, ip + 1),
+			    vm->regs[BC_REG_VAL]));
+  *env_get_global_ptr() = new_env;
+  return true;
+}
+
+static bool vm_push(vm_state_t *vm, uint8_t *ip) {
+  if (!push_u32(&vm_stack, vm->regs[ip[1]])) {
+    return vm_stop(vm, enc_sym(symrepr_eerror()));
+  }
+  return true;
+}
+
+static bool vm_pop(vm_state_t *vm, uint8_t *ip) {
+  if (!pop_u32(&vm_stack, &vm->regs[ip[1]])) {
+    return vm_stop(vm, enc_sym(symrepr_eerror()));
+  }
+  return true;
+}
+
+static bool vm_bpf(vm_state_t *vm, uint8_t *ip) {
+  if (!bytecode_is_callable(vm->regs[BC_REG_PROC])) {
+    vm->pc = read_u32(ip + 1);
+  }
+  return true;
+}
+
+static bool vm_exenv(vm_state_t *vm, uint8_t *ip) {
+  VALUE *regs = vm->regs;
+  VALUE v = (ip[0] == BC_EXENVVAL) ? regs[BC_REG_VAL] : car(regs[BC_REG_ARGL]);
+  VALUE binding;
+  VALUE env;
+  VM_ALLOC(binding, cons(vm_imm(vm, ip + 1), v));
+  // binding is kept on the stack while allocating, it is not a register
+  if (!push_u32(&vm_stack, binding)) return vm_stop(vm, enc_sym(symrepr_eerror()));
+  VM_ALLOC(env, cons(*stack_ptr(&vm_stack, 1), regs[BC_REG_ENV]));
+  stack_drop(&vm_stack, 1);
+  regs[BC_REG_ENV] = env;
+  if (ip[0] == BC_EXENVARGL) {
+    regs[BC_REG_ARGL] = cdr(regs[BC_REG_ARGL]);
+  }
+  return true;
+}
+
+static bool vm_cons(vm_state_t *vm, uint8_t *ip) {
+  VM_ALLOC(vm->regs[ip[1]], cons(vm->regs[ip[2]], vm->regs[ip[1]]));
+  return true;
+}
+
+static bool vm_consimm(vm_state_t *vm, uint8_t *ip) {
+  VM_ALLOC(vm->regs[ip[1]], cons(vm_imm(vm, ip + 2), vm->regs[ip[1]]));
+  return true;
+}
+
+static bool vm_cdr(vm_state_t *vm, uint8_t *ip) {
+  vm->regs[ip[1]] = cdr(vm->regs[ip[2]]);
+  return true;
+}
+
+static bool vm_cadr(vm_state_t *vm, uint8_t *ip) {
+  vm->regs[ip[1]] = car(cdr(vm->regs[ip[2]]));
+  return true;
+}
+
+static bool vm_caddr(vm_state_t *vm, uint8_t *ip) {
+  vm->regs[ip[1]] = car(cdr(cdr(vm->regs[ip[2]])));
+  return true;
+}
+
+static bool vm_car(vm_state_t *vm, uint8_t *ip) {
+  vm->regs[ip[1]] = car(vm->regs[ip[2]]);
+  return true;
+}
+
+static bool vm_callf_op(vm_state_t *vm, uint8_t *ip) {
+  (void)ip;
+  VALUE res = vm_callf(vm);
+  if (type_of(res) == VAL_TYPE_SYMBOL &&
+      (dec_sym(res) == symrepr_eerror() ||
+       dec_sym(res) == symrepr_merror())) {
+    return vm_stop(vm, res);
+  }
+  vm->regs[BC_REG_VAL] = res;
+  return true;
+}
+
+static bool vm_done(vm_state_t *vm, uint8_t *ip) {
+  (void)ip;
+  return vm_stop(vm, vm->regs[BC_REG_VAL]);
+}
+
+static bool vm_invalid(vm_state_t *vm, uint8_t *ip) {
+  (void)ip;
+  return vm_stop(vm, enc_sym(symrepr_eerror()));
+}
+
+static VALUE vm_run(vm_state_t *vm) {
+
+  while (vm->pc < vm->bc->code_size) {
+    uint8_t *ip = &vm->bc->code[vm->pc];
+    bool ok;
+    vm->pc += instr_size[ip[0]];
+
+    // A switch lets the compiler inline the common instructions
+    switch (ip[0]) {
+    case BC_JMPCNT:    ok = vm_jmpcnt(vm, ip);    break;
+    case BC_JMPIMM:    ok = vm_jmpimm(vm, ip);    break;
+    case BC_JMPVAL:    ok = vm_jmpval(vm, ip);    break;
+    case BC_MOVIMM:    ok = vm_movimm(vm, ip);    break;
+    case BC_MOV:       ok = vm_mov(vm, ip);       break;
+    case BC_LOOKUP:    ok = vm_lookup_op(vm, ip); break;
+    case BC_SETGLBVAL: ok = vm_setglbval(vm, ip); break;
+    case BC_PUSH:      ok = vm_push(vm, ip);      break;
+    case BC_POP:       ok = vm_pop(vm, ip);       break;
+    case BC_BPF:       ok = vm_bpf(vm, ip);       break;
+    case BC_EXENVARGL:
+    case BC_EXENVVAL:  ok = vm_exenv(vm, ip);     break;
+    case BC_CONS:      ok = vm_cons(vm, ip);      break;
+    case BC_CONSIMM:   ok = vm_consimm(vm, ip);   break;
+    case BC_CDR:       ok = vm_cdr(vm, ip);       break;
+    case BC_CADR:      ok = vm_cadr(vm, ip);      break;
+    case BC_CADDR:     ok = vm_caddr(vm, ip);     break;
+    case BC_CAR:       ok = vm_car(vm, ip);       break;
+    case BC_CALLF:     ok = vm_callf_op(vm, ip);  break;
+    case BC_DONE:      ok = vm_done(vm, ip);      break;
+    default:           ok = vm_invalid(vm, ip);   break;
+    }
+    if (!ok) return vm->result;
+  }
+  return enc_sym(symrepr_eerror());
+}
+
+#ifdef BYTECODE_JIT
+/* ------------------------------------------------------------
+   Template JIT
+
+   Each instruction is translated into a fixed native template.
+   movimm, mov, jmpimm and bpf are done natively, the other
+   instructions call their vm_ops function. Jumps to code addresses go through
+   jit_jump and continue in the native code of the target object
+   or, if that object has no native code, in the interpreter.
+
+   Native code is entered as void f(vm_state_t *vm, void *target)
+   and keeps vm in ebx (rbx). The x86-64 templates are the same as
+   the x86-32 ones apart from the calling convention and, with
+   LISPBM_64BIT, 8 byte register moves and immediates that are
+   loaded from the constant pool.
+
+   The code is written to a writable mapping that is made executable
+   and read only once the code is in place.
+   ------------------------------------------------------------ */
+
+typedef bool (*vm_op_fptr)(vm_state_t *vm, uint8_t *ip);
+
+static const vm_op_fptr vm_ops[BC_NUM_OPCODES] = {
+  vm_invalid,
+  vm_jmpcnt,
+  vm_jmpimm,
+  vm_jmpval,
+  vm_movimm,
+  vm_mov,
+  vm_lookup_op,
+  vm_setglbval,
+  vm_push,
+  vm_pop,
+  vm_bpf,
+  vm_exenv,
+  vm_exenv,
+  vm_cons,
+  vm_consimm,
+  vm_cdr,
+  vm_cadr,
+  vm_caddr,
+  vm_car,
+  vm_callf_op,
+  vm_done
+};
+
+typedef void (*jit_fptr)(vm_state_t *vm, uint8_t *target);
+
+typedef struct {
+  uint8_t *buf;   // NULL when only computing the size
+  unsigned int n;
+} jit_buf_t;
+
+#if defined(__x86_64__)
+static const uint8_t jit_prologue[] = {
+  0x55,                    // push rbp
+  0x48, 0x89, 0xE5,        // mov rbp, rsp
+  0x53,                    // push rbx
+  0x48, 0x83, 0xEC, 0x08,  // sub rsp, 8
+  0x48, 0x89, 0xFB,        // mov rbx, rdi
+  0xFF, 0xE6               // jmp rsi
+};
+static const uint8_t jit_epilogue[] = {
+  0x48, 0x83, 0xC4, 0x08,  // add rsp, 8
+  0x5B,                    // pop rbx
+  0x5D,                    // pop rbp
+  0xC3                     // ret
+};
+#else
+static const uint8_t jit_prologue[] = {
+  0x55,                    // push ebp
+  0x89, 0xE5,              // mov ebp, esp
+  0x53,                    // push ebx
+  0x83, 0xEC, 0x14,        // sub esp, 20 (keeps esp 16 byte aligned at calls)
+  0x8B, 0x5D, 0x08,        // mov ebx, [ebp+8]
+  0xFF, 0x65, 0x0C         // jmp [ebp+12]
+};
+static const uint8_t jit_epilogue[] = {
+  0x83, 0xC4, 0x14,        // add esp, 20
+  0x5B,                    // pop ebx
+  0x5D,                    // pop ebp
+  0xC3                     // ret
+};
+#endif
+
+static void jit_bytes(jit_buf_t *b, const uint8_t *bytes, unsigned int n) {
+  if (b->buf) memcpy(b->buf + b->n, bytes, n);
+  b->n += n;
+}
+
+static void jit_u32(jit_buf_t *b, uint32_t v) {
+  if (b->buf) write_u32(b->buf + b->n, v);
+  b->n += 4;
+}
+
+static void jit_word(jit_buf_t *b, uintptr_t v) {
+  if (b->buf) memcpy(b->buf + b->n, &v, sizeof(uintptr_t));
+  b->n += (unsigned int)sizeof(uintptr_t);
+}
+
+static void jit_rel32(jit_buf_t *b, unsigned int target) {
+  jit_u32(b, target - (b->n + 4));
+}
+
+/* Call fun(vm, ip), the result is left in eax (rax) */
+static void jit_call(jit_buf_t *b, uintptr_t fun, uint8_t *ip) {
+#if defined(__x86_64__)
+  jit_bytes(b, (const uint8_t[]){0x48, 0x89, 0xDF}, 3); // mov rdi, rbx
+  jit_bytes(b, (const uint8_t[]){0x48, 0xBE}, 2);       // mov rsi, ip
+  jit_word(b, (uintptr_t)ip);
+  jit_bytes(b, (const uint8_t[]){0x48, 0xB8}, 2);       // mov rax, fun
+  jit_word(b, fun);
+#else
+  jit_bytes(b, (const uint8_t[]){0x89, 0x1C, 0x24}, 3);       // mov [esp], ebx
+  jit_bytes(b, (const uint8_t[]){0xC7, 0x44, 0x24, 0x04}, 4); // mov [esp+4], ip
+  jit_word(b, (uintptr_t)ip);
+  jit_bytes(b, (const uint8_t[]){0xB8}, 1);                   // mov eax, fun
+  jit_word(b, fun);
+#endif
+  jit_bytes(b, (const uint8_t[]){0xFF, 0xD0}, 2);             // call eax
+}
+
+static uint8_t jit_reg_disp(uint8_t r) {
+  return (uint8_t)(offsetof(vm_state_t, regs) + r * sizeof(VALUE));
+}
+
+static inline uint32_t *jit_map(bytecode_t *bc) {
+  return (uint32_t*)bc->jit;
+}
+
+static inline uint8_t *jit_code(bytecode_t *bc) {
+  return bc->jit + ((bc->code_size * sizeof(uint32_t) + 15) & ~15u);
+}
+
+static int jit_proc_compiled(vm_state_t *vm, uint8_t *ip) {
+  (void)ip;
+  return bytecode_is_callable(vm->regs[BC_REG_PROC]) ? 1 : 0;
+}
+
+/* Returns the native address to continue at or NULL to leave native code */
+static uint8_t *jit_jump(vm_state_t *vm, uint8_t *ip) {
+  if (!vm_ops[ip[0]](vm, ip) || !vm->bc->jit) return NULL;
+  return jit_code(vm->bc) + jit_map(vm->bc)[vm->pc];
+}
+
+/* Emit native code for bc. map[pc] is the native offset of the
+   instruction at pc, it is filled in when sizing and used for jumps
+   when emitting. Returns the offset of the exit. */
+static unsigned int jit_emit(bytecode_t *bc, jit_buf_t *b, uint32_t *map, unsigned int exit) {
+
+  jit_bytes(b, jit_prologue, sizeof(jit_prologue));
+
+  unsigned int pc = 0;
+  while (pc < bc->code_size) {
+    uint8_t *ip = &bc->code[pc];
+    map[pc] = b->n;
+
+    switch (ip[0]) {
+#ifdef LISPBM_64BIT
+    case BC_MOVIMM:
+      jit_bytes(b, (const uint8_t[]){0x48, 0xB8}, 2);                     // mov rax, &constant
+      jit_word(b, (uintptr_t)&bc->constants[read_u32(ip + 2)]);
+      jit_bytes(b, (const uint8_t[]){0x48, 0x8B, 0x00,                    // mov rax, [rax]
+				     0x48, 0x89, 0x43, jit_reg_disp(ip[1])}, 7); // mov [rbx+r], rax
+      break;
+    case BC_MOV:
+      jit_bytes(b, (const uint8_t[]){0x48, 0x8B, 0x43, jit_reg_disp(ip[2]),      // mov rax, [rbx+r1]
+				     0x48, 0x89, 0x43, jit_reg_disp(ip[1])}, 8); // mov [rbx+r0], rax
+      break;
+#else
+    case BC_MOVIMM:
+      jit_bytes(b, (const uint8_t[]){0xC7, 0x43, jit_reg_disp(ip[1])}, 3); // mov [ebx+r], imm
+      jit_u32(b, read_u32(ip + 2));
+      break;
+    case BC_MOV:
+      jit_bytes(b, (const uint8_t[]){0x8B, 0x43, jit_reg_disp(ip[2]),      // mov eax, [ebx+r1]
+				     0x89, 0x43, jit_reg_disp(ip[1])}, 6); // mov [ebx+r0], eax
+      break;
+#endif
+    case BC_JMPIMM:
+      jit_bytes(b, (const uint8_t[]){0xE9}, 1);             // jmp target
+      jit_rel32(b, map[read_u32(ip + 1)]);
+      break;
+    case BC_BPF:
+      jit_call(b, (uintptr_t)jit_proc_compiled, ip);
+      jit_bytes(b, (const uint8_t[]){0x85, 0xC0, 0x0F, 0x84}, 4); // test eax, eax; jz target
+      jit_rel32(b, map[read_u32(ip + 1)]);
+      break;
+    case BC_JMPCNT:
+    case BC_JMPVAL:
+      jit_call(b, (uintptr_t)jit_jump, ip);
+#if defined(__x86_64__)
+      jit_bytes(b, (const uint8_t[]){0x48}, 1);
+#endif
+      jit_bytes(b, (const uint8_t[]){0x85, 0xC0, 0x0F, 0x84}, 4); // test eax, eax; jz exit
+      jit_rel32(b, exit);
+      jit_bytes(b, (const uint8_t[]){0xFF, 0xE0}, 2);             // jmp eax
+      break;
+    default:
+      jit_call(b, (uintptr_t)vm_ops[ip[0]], ip);
+      jit_bytes(b, (const uint8_t[]){0x84, 0xC0, 0x0F, 0x84}, 4); // test al, al; jz exit
+      jit_rel32(b, exit);
+      break;
+    }
+    pc += instr_size[ip[0]];
+  }
+
+  // Running past the end of the code is an error
+  jit_call(b, (uintptr_t)vm_invalid, NULL);
+
+  unsigned int exit_offset = b->n;
+  jit_bytes(b, jit_epilogue, sizeof(jit_epilogue));
+  return exit_offset;
+}
+
+/* On failure bc is left without native code and is interpreted */
+static void jit_compile(bytecode_t *bc) {
+
+  size_t map_size = (bc->code_size * sizeof(uint32_t) + 15) & ~(size_t)15;
+  uint32_t *map = (uint32_t*)malloc(bc->code_size * sizeof(uint32_t));
+  if (!map) return;
+
+  jit_buf_t b = {NULL, 0};
+  unsigned int exit = jit_emit(bc, &b, map, 0);
+
+  size_t size = map_size + b.n;
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    free(map);
+    return;
+  }
+  bc->jit = (uint8_t*)mem;
+  bc->jit_size = (unsigned int)size;
+
+  b.buf = jit_code(bc);
+  b.n = 0;
+  jit_emit(bc, &b, map, exit);
+  memcpy(jit_map(bc), map, bc->code_size * sizeof(uint32_t));
+  free(map);
+
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, size);
+    bc->jit = NULL;
+    bc->jit_size = 0;
+  }
+}
+
+static void jit_free(bytecode_t *bc) {
+  munmap(bc->jit, bc->jit_size);
+}
+
+static void jit_run(vm_state_t *vm) {
+  jit_fptr f;
+  uint8_t *code = jit_code(vm->bc);
+  memcpy(&f, &code, sizeof(f));
+  f(vm, code + jit_map(vm->bc)[vm->pc]);
+}
+#endif
+
+/* Runs to completion: compiled code is not preempted by eval_cps */
+VALUE bytecode_apply(VALUE fun, VALUE *args, unsigned int argn, bytecode_gc_fptr gc) {
+
+  vm_state_t state;
+  vm_state_t *vm = &state;
+
+  if (!vm_stack_ok) {
+    if (!stack_allocate(&vm_stack, BYTECODE_STACK_SIZE, true)) {
+      return enc_sym(symrepr_merror());
+    }
+    vm_stack_ok = true;
+  }
+  stack_clear(&vm_stack);
+
+  VALUE entry = is_code_addr(fun) ? fun : car(cdr(fun));
+
+  for (int i = 0; i < BC_NUM_REGS; i ++) {
+    vm->regs[i] = enc_sym(symrepr_nil());
+  }
+  vm->gc = gc;
+  vm->stopped = false;
+  vm->regs[BC_REG_PROC] = fun;
+  vm_jump(vm, entry);
+
+  for (unsigned int i = argn; i > 0; i --) {
+    VALUE argl = cons(args[i-1], vm->regs[BC_REG_ARGL]);
+    if (is_symbol_merror(argl)) {
+      if (!vm_gc(vm)) return argl;
+      argl = cons(args[i-1], vm->regs[BC_REG_ARGL]);
+      if (is_symbol_merror(argl)) return argl;
+    }
+    vm->regs[BC_REG_ARGL] = argl;
+  }
+
+#ifdef BYTECODE_JIT
+  if (vm->bc->jit) {
+    jit_run(vm);
+    if (vm->stopped) return vm->result;
+  }
+#endif
+  return vm_run(vm);
+}
@@ -16,7 +16,6 @@
 */
 
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -27,14 +26,18 @@
 #define  CODE 1
 
 /* The codes are generated using python script in utils directory 
-   - Depends on the Huffman library (pip3 install huffman)
    - exec(open('gen_codes.py').read()) 
    - print(make_c())
 */
 #define NUM_CODES 66
 #define MAX_KEY_LENGTH 6
 #define MAX_CODE_LENGTH 7
-char *codes[NUM_CODES][2] = {
+
+#if MAX_KEY_LENGTH > COMPRESSION_MAX_KEY_LENGTH || MAX_CODE_LENGTH > COMPRESSION_MAX_CODE_LENGTH
+#error "The code table does not fit the decode tables"
+#endif
+
+static const char *codes[NUM_CODES][2] = {
     { "9", "010111" },
     { "8", "101110" },
     { "7", "100001" },
@@ -103,6 +106,24 @@ char *codes[NUM_CODES][2] = {
     { "a", "010101" }
     };
 
+#ifdef COMPRESSION_TABLES
+#include "compression_tables.inc"
+#endif
+
+static const compression_table_t tables[] = {
+  { codes, NUM_CODES, 0 },
+#ifdef COMPRESSION_TABLES
+  COMPRESSION_GENERATED_TABLES
+#endif
+};
+
+#define NUM_TABLES (sizeof(tables) / sizeof(tables[0]))
+
+#if defined(COMPRESSION_TABLES) && \
+  COMPRESSION_NUM_GENERATED_TABLES >= (1 << (32 - COMPRESSION_TABLE_SHIFT))
+#error "Too many code tables for the header"
+#endif
+
 /*
 #define NUM_CODES 64
 #define MAX_KEY_LENGTH 6
@@ -247,276 +268,291 @@ char *codes[NUM_CODES][2] = {
     { "a", "010111" }
     };
 */
-int match_longest_key(char *string) {
+/* Index of the longest key that starts string, or -1 */
+static int match_longest_key(const compression_table_t *t, const char *string, uint32_t n) {
 
   int longest_match_ix = -1;
-  int longest_match_length = 0;
-  int n = strlen(string);
-
-  for (int i = 0; i < NUM_CODES; i ++) {
-    int s_len = strlen(codes[i][KEY]);
-    if (s_len <= n) {
-      if (strncmp(codes[i][KEY], string, s_len) == 0) {
-	if (s_len > longest_match_length) {
-	  longest_match_ix = i;
-	  longest_match_length = s_len;
-	}
-      }
+  uint32_t longest_match_length = 0;
+
+  for (int i = 0; i < (int)t->num_codes; i ++) {
+    const char *key = t->codes[i][KEY];
+    if (key[0] != string[0]) continue;
+    uint32_t s_len = (uint32_t)strlen(key);
+    if (s_len <= n &&
+	s_len > longest_match_length &&
+	strncmp(key, string, s_len) == 0) {
+      longest_match_ix = i;
+      longest_match_length = s_len;
     }
   }
   return longest_match_ix;
 }
 
-int match_longest_code(char *string, uint32_t start_bit, uint32_t total_bits) {
-
-  uint32_t bits_left = total_bits - start_bit;
-  int longest_match_ix = -1;
-  int longest_match_length = 0;
+static void flush_output(comp_state *s, uint32_t n) {
+  if (!s->sink(s->sink_arg, s->out_offset, (char*)s->out, n)) {
+    s->error = true;
+  }
+  s->out_offset += n;
+  s->out_bits = 0;
+}
 
-  for (int i = 0; i < NUM_CODES; i++) {
-    int s_len = strlen(codes[i][CODE]);
-    if ((uint32_t)s_len <= bits_left) {
-      bool match = true;
-      for (uint32_t b = 0; b < (uint32_t)s_len; b ++) {
-	uint32_t byte_ix = (start_bit + b) / 8;
-	uint32_t bit_ix  = (start_bit + b) % 8;
+static void emit_bit(comp_state *s, bool set) {
+  uint32_t byte_ix = s->out_bits / 8;
+  uint32_t bit_ix  = s->out_bits % 8;
+  if (bit_ix == 0) s->out[byte_ix] = 0;
+  if (set) s->out[byte_ix] |= (uint8_t)(1 << bit_ix);
+  s->out_bits ++;
+  s->compressed_bits ++;
+  if (s->out_bits == COMPRESSION_OUT_SIZE * 8) {
+    flush_output(s, COMPRESSION_OUT_SIZE);
+  }
+}
 
-	char *code_str = codes[i][CODE];
+static void emit_string_char_code(comp_state *s, char c) {
+  for (int i = 0; i < 8; i ++) {
+    emit_bit(s, c & (1 << i));
+  }
+}
 
-	if (((string[byte_ix] & (1 << bit_ix)) ? '1' : '0') !=
-	      code_str[b]) {
-	  match = false;
-	}
-      }
-      if (match && (s_len > longest_match_length)) {
-	longest_match_length = s_len;
-	longest_match_ix = i;
-      }
-    }
+static void emit_code(comp_state *s, int ix) {
+  for (const char *code = s->table->codes[ix][CODE]; *code; code ++) {
+    emit_bit(s, *code == '1');
   }
-  return longest_match_ix;
 }
 
-int compressed_length(char *string) {
-  uint32_t i = 0;
-
-  uint32_t n = strlen(string);
-  int comp_len = 0; // in bits
-
-  bool string_mode = false;
-  bool gobbling_whitespace = false;
-
-  while (i < n) {
-    if (string_mode) {
-      if (string[i] == '\"'  &&
-	  !(string[i-1] == '\\')) {
-	string_mode = false;
-	comp_len += 8;
-	i++;
-      } else {
-	comp_len += 8;
-	i++;
-      }
+static bool is_blank(char c) {
+  return c == '\n' || c == ' ' || c == '\t' || c == '\r';
+}
 
-    } else {
+/* Codes the first of the pending characters. Until the input ends
+   there are COMPRESSION_MAX_KEY_LENGTH of them, enough to match any key. */
+static void compress_step(comp_state *s) {
+  char c = s->pending[0];
+  uint32_t used = 1;
 
-      // Gobble up any comments
-      if (string[i] == ';' ) {
-	while (string[i] && string[i] != '\n') {
-	  i++;
-	}
-	continue;
-      }
+  if (s->string_mode) {
+    if (c == '\"' && s->last_string_char != '\\') {
+      s->string_mode = false;
+    }
+    s->last_string_char = c;
+    emit_string_char_code(s, c);
+  } else if (s->in_comment) {
+    // The newline ending a comment is whitespace
+    if (c == '\n') {
+      s->in_comment = false;
+      s->gobbling_whitespace = true;
+    }
+  } else if (c == ';') {
+    s->in_comment = true;
+  } else if (is_blank(c)) {
+    // A run of whitespace and comments becomes a single space
+    s->gobbling_whitespace = true;
+  } else {
+    if (s->gobbling_whitespace) {
+      s->gobbling_whitespace = false;
+      emit_code(s, s->space_ix);
+    }
+    /* Compress string-starting " character */
+    if (c == '\"') {
+      s->string_mode = true;
+      s->last_string_char = c;
+    }
+    int ix = match_longest_key(s->table, s->pending, s->pending_n);
+    if (ix == -1) {
+      s->error = true;
+      return;
+    }
+    emit_code(s, ix);
+    used = (uint32_t)strlen(s->table->codes[ix][KEY]);
+  }
 
-      if ( string[i] == '\n' ||
-	   string[i] == ' '  ||
-	   string[i] == '\t' ||
-	   string[i] == '\r') {
-	gobbling_whitespace = true;
-	i ++;
-	continue;
-      } else if (gobbling_whitespace) {
-	gobbling_whitespace = false;
-	i--;
-      }
+  s->pending_n -= used;
+  memmove(s->pending, s->pending + used, s->pending_n);
+}
 
-      if (string[i] == '\"') string_mode = true;
+uint32_t compression_num_tables(void) {
+  return NUM_TABLES;
+}
 
-      int ix;
-      if (isspace(string[i])) {
-	ix = match_longest_key(" ");
-      } else {
-	ix = match_longest_key(string + i);
-      }
+bool compression_compress_init(comp_state *s, uint32_t table,
+			       compression_sink_fptr sink, void *arg) {
+  memset(s, 0, sizeof(comp_state));
+  if (table >= NUM_TABLES) return false;
+  s->table = &tables[table];
+  s->space_ix = match_longest_key(s->table, " ", 1);
+  s->sink = sink;
+  s->sink_arg = arg;
+  // Room for the header, which is written once the length is known
+  s->out_bits = COMPRESSION_HEADER_BITS(table);
+  return true;
+}
 
-      if (ix == -1)return -1;
-      int code_len = strlen(codes[ix][1]);
-      comp_len += code_len;
-      i += strlen(codes[ix][0]);
+bool compression_compress_chunk(comp_state *s, const char *data, uint32_t n) {
+  for (uint32_t i = 0; i < n && !s->error; i ++) {
+    s->pending[s->pending_n++] = data[i];
+    if (s->pending_n == COMPRESSION_MAX_KEY_LENGTH) {
+      compress_step(s);
     }
   }
-  return comp_len;
+  return !s->error;
 }
 
-void set_bit(char *c, char bit_pos, bool set) {
-  char bval = 1 << bit_pos;
-  if (set) {
-    *c = *c | bval;
-  } else {
-    *c = *c & ~bval;
+bool compression_compress_finish(comp_state *s, uint32_t *res_size) {
+  while (s->pending_n > 0 && !s->error) {
+    compress_step(s);
   }
-}
+  if (s->error || s->compressed_bits > COMPRESSION_MAX_BITS) return false;
 
-void emit_string_char_code(char *compressed, char c, int *bit_pos) {
+  flush_output(s, (s->out_bits + 7) / 8);
 
-  for (int i = 0; i < 8; i ++) {
-    int byte_ix = (*bit_pos) / 8;
-    int bit_ix  = (*bit_pos) % 8;
-    bool s = (c & (1 << i));
-    set_bit(&compressed[byte_ix], bit_ix, s);
-    *bit_pos = *bit_pos + 1;
+  uint32_t table = (uint32_t)(s->table - tables);
+  uint32_t header_value = s->compressed_bits | (table << COMPRESSION_TABLE_SHIFT);
+  uint8_t header[8];
+  for (int i = 0; i < 4; i ++) {
+    header[i] = (uint8_t)(header_value >> (8 * i));
+    header[i + 4] = (uint8_t)(s->table->id >> (8 * i));
+  }
+  if (s->error ||
+      !s->sink(s->sink_arg, 0, (char*)header, COMPRESSION_HEADER_BITS(table) / 8)) {
+    s->error = true;
+    return false;
   }
+  *res_size = s->out_offset;
+  return true;
 }
 
-void emit_code(char *compressed, char *code, int *bit_pos) {
-  int n = strlen(code);
+bool compression_buffer_sink(void *arg, uint32_t offset, const char *data, uint32_t n) {
+  compression_buffer_t *b = (compression_buffer_t*)arg;
+  if (offset > b->size || n > b->size - offset) return false;
+  memcpy(b->data + offset, data, n);
+  return true;
+}
 
-  for (int i = 0; i < n; i ++) {
-    int byte_ix = (*bit_pos) / 8;
-    int bit_ix  = (*bit_pos) % 8;
-    bool s = (code[i] == '1');
-    set_bit(&compressed[byte_ix], bit_ix, s);
-    *bit_pos = *bit_pos + 1;
+/* A buffer sink that grows the buffer as needed */
+static bool malloc_sink(void *arg, uint32_t offset, const char *data, uint32_t n) {
+  compression_buffer_t *b = (compression_buffer_t*)arg;
+  if (offset + n > b->size) {
+    uint32_t size = b->size ? b->size : 256;
+    while (offset + n > size) size *= 2;
+    char *d = realloc(b->data, size);
+    if (!d) return false;
+    b->data = d;
+    b->size = size;
   }
+  return compression_buffer_sink(arg, offset, data, n);
 }
 
-void emit_key(char *dest, char *key, int nk, uint32_t *char_pos) {
+static bool null_sink(void *arg, uint32_t offset, const char *data, uint32_t n) {
+  (void)arg;
+  (void)offset;
+  (void)data;
+  (void)n;
+  return true;
+}
 
-  for (int i = 0; i < nk; i ++) {
-    dest[*char_pos] = key[i];
-    *char_pos = *char_pos + 1;
+uint32_t compression_best_table(const char *string, uint32_t n) {
+  uint32_t best = 0;
+  uint32_t best_size = UINT32_MAX;
+
+  for (uint32_t t = 0; t < NUM_TABLES; t ++) {
+    comp_state s;
+    uint32_t size;
+    compression_compress_init(&s, t, null_sink, NULL);
+    if (compression_compress_chunk(&s, string, n) &&
+	compression_compress_finish(&s, &size) &&
+	size < best_size) {
+      best = t;
+      best_size = size;
+    }
   }
+  return best;
 }
 
-char read_character(char *src, uint32_t *bit_pos) {
-
-  char c = 0;
-
-  for (int i = 0; i < 8; i ++) {
-    int byte_ix = (*bit_pos)/8;
-    int bit_ix  = (*bit_pos)%8;
-    bool s = src[byte_ix] & (1 << bit_ix);
-    set_bit(&c, i, s);
-    *bit_pos = *bit_pos + 1;
+char *compression_compress(const char *string, uint32_t *res_size) {
+  comp_state s;
+  compression_buffer_t b = { NULL, 0 };
+  uint32_t n = (uint32_t)strlen(string);
+
+  compression_compress_init(&s, compression_best_table(string, n), malloc_sink, &b);
+  if (!compression_compress_chunk(&s, string, n) ||
+      !compression_compress_finish(&s, res_size) ||
+      s.compressed_bits == 0) {
+    free(b.data);
+    return NULL;
   }
-  return c;
+  return b.data;
 }
 
-char *compression_compress(char *string, uint32_t *res_size) {
 
-  uint32_t c_size_bits = compressed_length(string);
+static uint32_t read_u32(const unsigned char *p) {
+  return
+    (uint32_t)p[0] |
+    (uint32_t)p[1] << 8 |
+    (uint32_t)p[2] << 16 |
+    (uint32_t)p[3] << 24;
+}
 
-  uint32_t c_size_bytes = 4 + (c_size_bits/8);
-  if (c_size_bits % 8 > 0) {
-    c_size_bytes += 1;
+void compression_init_state(decomp_state *s, char *src) {
+  const unsigned char *header = (const unsigned char *)src;
+  uint32_t header_value = read_u32(header);
+  uint32_t table = header_value >> COMPRESSION_TABLE_SHIFT;
+
+  s->table = table < NUM_TABLES ? &tables[table] : NULL;
+  // A generated table that is not the one the stream was coded with
+  if (s->table && table != 0 && read_u32(header + 4) != s->table->id) {
+    s->table = NULL;
   }
-  
-  uint32_t header_value = c_size_bits;
-
-  if (header_value == 0) return NULL;
-
-  char *compressed = malloc(c_size_bytes);
-  if (!compressed) return NULL;
-  memset(compressed, 0, c_size_bytes);
-  *res_size = c_size_bytes;
-  int bit_pos = 0;
-
-  compressed[0] = (unsigned char)header_value;
-  compressed[1] = (unsigned char)(header_value >> 8);
-  compressed[2] = (unsigned char)(header_value >> 16);
-  compressed[3] = (unsigned char)(header_value >> 24);
-  bit_pos = 32;
-
-  bool string_mode = false;
-  bool gobbling_whitespace = false;
-  uint32_t n = strlen(string);
-  uint32_t i = 0;
-
-  while (i < n) {
-    if (string_mode) {
-
-      if (string[i] == '\"' &&
-	  !(string[i-1] == '\\')) {
-	emit_string_char_code(compressed, '\"', &bit_pos);
-	i ++;
-	string_mode = false;
-	continue;
-      } else {
-	emit_string_char_code(compressed, string[i], &bit_pos);
-	i++;
-      }
-
-    } else {
-
-      // Gobble up any comments
-      if (string[i] == ';' ) {
-	while (string[i] && string[i] != '\n') {
-	  i++;
-	}
-	continue;
-      }
-
-      // gobble up whitespaces
-      if ( string[i] == '\n' ||
-	   string[i] == ' '  ||
-	   string[i] == '\t' ||
-	   string[i] == '\r') {
-	gobbling_whitespace = true;
-	*(string + i) = ' ';
-	i ++;
-	continue;
-      } else if (gobbling_whitespace) {
-	gobbling_whitespace = false;
-	i--;
-      }
-
-      /* Compress string-starting " character */
-      if (string[i] == '\"') {
-	string_mode = true;
-      }
-      int ix = match_longest_key(&string[i]);
-
-      if (ix == -1) {
-	free(compressed);
-	return NULL;
-      }
-
-      emit_code(compressed, codes[ix][CODE], &bit_pos);
+  s->compressed_bits = header_value & COMPRESSION_MAX_BITS;
+  s->header_bits = COMPRESSION_HEADER_BITS(table);
+  s->i = s->header_bits;
+  s->string_mode = false;
+  s->last_string_char = 0;
+  s->src = src;
 
-      i += strlen(codes[ix][0]);
+  /* Every index whose low bits are a code maps to that code. The
+     codes are a complete prefix code, so every index gets one. */
+  memset(s->decode_len, 0, COMPRESSION_DECODE_SIZE);
+  if (s->table == NULL) return;
+  for (int ix = 0; ix < (int)s->table->num_codes; ix ++) {
+    const char *code = s->table->codes[ix][CODE];
+    uint32_t len = (uint32_t)strlen(code);
+    uint32_t bits = 0;
+    for (uint32_t b = 0; b < len; b ++) {
+      if (code[b] == '1') bits |= 1u << b;
+    }
+    for (uint32_t v = bits; v < COMPRESSION_DECODE_SIZE; v += 1u << len) {
+      s->decode_ix[v] = (uint8_t)ix;
+      s->decode_len[v] = (uint8_t)len;
     }
   }
-
-  return compressed;
 }
 
-
-void compression_init_state(decomp_state *s, char *src) {
-  memcpy(&s->compressed_bits, src, 4);
-  s->i = 32;
-  s->string_mode = false;
-  s->last_string_char = 0;
-  s->src = src;
+/* The next n <= 8 bits, first bit lowest. Bits after the end of the
+   input read as 0. */
+static uint32_t read_bits(decomp_state *s, uint32_t n) {
+  const unsigned char *src = (const unsigned char *)s->src;
+  uint32_t end = s->compressed_bits + s->header_bits;
+  uint32_t byte_ix = s->i / 8;
+  uint32_t bit_ix  = s->i % 8;
+
+  uint32_t v = (uint32_t)src[byte_ix] >> bit_ix;
+  if (bit_ix + n > 8 && (byte_ix + 1) * 8 < end) {
+    v |= (uint32_t)src[byte_ix + 1] << (8 - bit_ix);
+  }
+  return v & ((1u << n) - 1);
 }
 
 int compression_decompress_incremental(decomp_state *s, char *dest_buff, uint32_t dest_n) {
 
-  memset(dest_buff, 0, dest_n);
+  uint32_t end = s->compressed_bits + s->header_bits;
   uint32_t char_pos = 0;
 
-  if (s->i < s->compressed_bits + 32) {
-     if (s->string_mode) {
-      char c = read_character(s->src, &s->i);
+  if (s->table == NULL) return -1;
+
+  while (s->i < end && char_pos + COMPRESSION_MAX_KEY_LENGTH <= dest_n) {
+    if (s->string_mode) {
+      char c = (char)read_bits(s, 8);
+      s->i += 8;
       if (c == '\"') {
 	if (s->last_string_char != '\\') {
 	  s->string_mode = false;
@@ -524,30 +560,27 @@ int compression_decompress_incremental(decomp_state *s, char *dest_buff, uint32_
 	}
       }
       s->last_string_char = c;
-      dest_buff[0] = c;
-      return 1;
+      dest_buff[char_pos++] = c;
+      continue;
     }
 
-    int ix = match_longest_code(s->src, s->i, (s->compressed_bits + 32));
-    if (ix == -1) {
-      return -1;
+    uint32_t v = read_bits(s, COMPRESSION_MAX_CODE_LENGTH);
+    uint32_t len = s->decode_len[v];
+    if (len == 0 || len > end - s->i) {
+      return char_pos > 0 ? (int)char_pos : -1;
     }
 
-    if( strlen(codes[ix][KEY]) == 1 &&
-	strncmp(codes[ix][KEY], "\"", 1) == 0) {
+    const char *key = s->table->codes[s->decode_ix[v]][KEY];
+    if (key[0] == '\"' && key[1] == 0) {
       s->string_mode = true;
       s->last_string_char = 0;
     }
-
-    int n_bits_decoded = strlen(codes[ix][CODE]);
-    emit_key(dest_buff, codes[ix][KEY], strlen(codes[ix][KEY]), &char_pos);
-    s->i+=n_bits_decoded;
-    return char_pos;
-
-  } else {
-    return 0;
+    while (*key) {
+      dest_buff[char_pos++] = *key++;
+    }
+    s->i += len;
   }
-
+  return (int)char_pos;
 }
 
 bool compression_decompress(char *dest, uint32_t dest_n, char *src) {
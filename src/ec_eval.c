@@ -23,8 +23,11 @@
 #include "extensions.h"
 #include "typedefs.h"
 #include "ec_eval.h"
+#include "eval_cps.h"
+#include "analyze.h"
 #include "exp_kind.h"
 #include "print.h"
+#include "instance.h"
 
 typedef enum {
   CONT_DONE,
@@ -59,23 +62,9 @@ typedef enum {
  * fun  : Evaluated function (for application)
  */
 
-typedef struct {
-  uint32_t cont;
-  VALUE env;
-  VALUE unev;
-  VALUE prg;
-  VALUE exp;
-  VALUE argl;
-  VALUE val;
-  VALUE fun;
-
-  stack S;
-} register_machine_t;
-
-register_machine_t rm_state;
-
-char str[1024];
-char err[1024];
+#define rm_state (instance_current()->ec_eval.rm_state)
+#define str      (instance_current()->ec_eval.str)
+#define err      (instance_current()->ec_eval.err)
 
 static int gc(VALUE env,
        register_machine_t *rm) {
@@ -127,6 +116,20 @@ static inline void eval_quoted(eval_state *es) {
   *es = EVAL_CONTINUATION;
 }
 
+static inline void eval_constant(eval_state *es) {
+  rm_state.val = cdr(rm_state.exp);
+  *es = EVAL_CONTINUATION;
+}
+
+static inline void eval_global(eval_state *es) {
+  rm_state.val = analyze_global_value(rm_state.exp);
+  if (type_of(rm_state.val) == VAL_TYPE_SYMBOL &&
+      dec_sym(rm_state.val) == symrepr_not_found()) {
+    rm_state.cont = enc_u(CONT_ERROR);
+  }
+  *es = EVAL_CONTINUATION;
+}
+
 static inline void eval_define(eval_state *es) {
   rm_state.unev = car(cdr(rm_state.exp));
   rm_state.exp  = car(cdr(cdr(rm_state.exp)));
@@ -210,6 +213,15 @@ static inline void eval_application(eval_state *es) {
   *es = EVAL_DISPATCH;
 }
 
+static inline void eval_analysed_application(eval_state *es) {
+  rm_state.exp = cdr(rm_state.exp);
+  if (is_symbol_nil(cdr(rm_state.exp))) {
+    eval_no_args(es);
+  } else {
+    eval_application(es);
+  }
+}
+
 static inline void eval_last_arg(eval_state *es) {
   rm_state.cont = enc_u(CONT_ACCUMULATE_LAST_ARG);
   *es = EVAL_DISPATCH;
@@ -604,6 +616,9 @@ void ec_eval(void) {
       case EXP_LET:             eval_let(&es);             break;
       case EXP_AND:             eval_and(&es);             break;
       case EXP_OR:              eval_or(&es);              break;
+      case EXP_CONSTANT:        eval_constant(&es);        break;
+      case EXP_GLOBAL:          eval_global(&es);          break;
+      case EXP_ANALYSED_APPLICATION: eval_analysed_application(&es); break;
       case EXP_KIND_ERROR:      done = true;               break;
       }
       break;
@@ -631,6 +646,8 @@ void ec_eval(void) {
 
 VALUE ec_eval_program(VALUE prg) {
 
+  eval_cps_release_program(prg);
+
   rm_state.prg = cdr(prg);
   rm_state.exp = car(prg);
   rm_state.cont = enc_u(CONT_DONE);
@@ -21,8 +21,9 @@
 #include "heap.h"
 #include "print.h"
 #include "typedefs.h"
+#include "instance.h"
 
-VALUE env_global;
+#define env_global (instance_current()->env_global)
 
 int env_init(void) {
   env_global = enc_sym(symrepr_nil());
@@ -15,6 +15,8 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
+
 #include "symrepr.h"
 #include "heap.h"
 #include "env.h"
@@ -23,6 +25,9 @@
 #include "fundamental.h"
 #include "extensions.h"
 #include "typedefs.h"
+#include "bytecode.h"
+#include "analyze.h"
+#include "instance.h"
 #ifdef VISUALIZE_HEAP
 #include "heap_vis.h"
 #endif
@@ -38,6 +43,7 @@
 #define OR                9
 #define WAIT              10
 #define SPAWN_ALL         11
+#define RECV              12
 
 #define FATAL_ON_FAIL(done, x)  if (!(x)) { (done)=true; ctx->r = enc_sym(symrepr_fatal_error()); return ; }
 #define FATAL_ON_FAIL_R(done, x)  if (!(x)) { (done)=true; ctx->r = enc_sym(symrepr_fatal_error()); return ctx->r; }
@@ -46,11 +52,14 @@
 #define DEFAULT_SLEEP_US  1000
 
 #define EVAL_CPS_DEFAULT_STACK_SIZE 256
-#define EVAL_CPS_DEFAULT_STACK_GROW_POLICY false
+#define EVAL_CPS_DEFAULT_STACK_GROW_POLICY true
+#define EVAL_CPS_DEFAULT_NUM_CONTEXTS 32
 
 /* 768 us -> ~128000 "ticks" at 168MHz I assume this means also roughly 128000 instructions */
 #define EVAL_CPS_QUANTA_US 768
+#define EVAL_CPS_DEFAULT_REDUCTIONS 1000
 #define EVAL_CPS_WAIT_US   1536
+#define EVAL_CPS_PAUSE_US  100
 
 /*
    On ChibiOs the CH_CFG_ST_FREQUENCY setting in chconf.h sets the
@@ -65,28 +74,229 @@
    sleep duration possible is 2 * 100us = 200us.
 */
 
-static VALUE NIL;
-static VALUE NONSENSE;
+#define NIL      enc_sym(DEF_REPR_NIL)
+#define NONSENSE enc_sym(DEF_REPR_NONSENSE)
+
+/* All state below belongs to the instance bound to the calling
+   thread, see instance.h */
+#define ES (instance_current()->eval_cps)
+
+#define eval_running         (ES.eval_running)
+#define reductions_per_slice (ES.reductions_per_slice)
 
-static bool     eval_running = false;
-static uint32_t next_ctx_id = 1;
+/* eval_cps_pause_eval handshake, between the evaluator thread and the
+   host. The evaluator only pauses between time slices, when no
+   context is running, so the heap and the contexts are consistent
+   while it is paused. */
+#define eval_loop_active     (ES.eval_loop_active)
+#define pause_request        (ES.pause_request)
+#define paused               (ES.paused)
 
 /* Callbacks and task queue */
-static eval_context_t *ctx_queue = NULL;
-static eval_context_t *ctx_queue_last = NULL;
-static eval_context_t *ctx_done = NULL;
-static eval_context_t *ctx_running = NULL;
+#define ctx_queue            (ES.ctx_queue)      // ready to run
+#define ctx_queue_last       (ES.ctx_queue_last)
+#define ctx_done             (ES.ctx_done)
+#define ctx_blocked          (ES.ctx_blocked)    // waiting in recv
+#define ctx_running          (ES.ctx_running)
+
+#define ctx_non_concurrent   (ES.ctx_non_concurrent)
+
+/* Contexts and their continuation stacks come from a pool that is
+   allocated by eval_cps_init. Free contexts are linked through next. */
+#define ctx_pool             (ES.ctx_pool)
+#define ctx_pool_stacks      (ES.ctx_pool_stacks)
+#define ctx_pool_size        (ES.ctx_pool_size)
+#define ctx_pool_stack_size  (ES.ctx_pool_stack_size)
+#define ctx_free             (ES.ctx_free)
+
+/* A CID is the index of the context in the pool in the low
+   ctx_slot_bits bits and a generation above that. The generation of a
+   slot is bumped (skipping 0) every time the slot is taken, so a CID
+   refers to one context until the generations of its slot wrap
+   around, and a stale CID does not find the context that reuses the
+   slot. CIDs are handed to programs as integers, so they are kept to
+   CID_BITS bits, which fit a positive integer on every VALUE layout.
+   With at most EVAL_CPS_MAX_CONTEXTS contexts that leaves at least 15
+   bits of generation. */
+#define ctx_slot_bits        (ES.ctx_slot_bits)
+
+#define EVAL_CPS_MAX_CONTEXTS 4096
+#define CID_BITS              27
+
+/* Sleeping contexts are kept in a binary min-heap ordered by wake up
+   time. The heap has room for every context in the pool so putting a
+   context to sleep never allocates. */
+#define ctx_sleeping         (ES.ctx_sleeping)
+#define ctx_sleeping_num     (ES.ctx_sleeping_num)
+
+#define usleep_callback       (ES.usleep_callback)
+#define timestamp_us_callback (ES.timestamp_us_callback)
+#define ctx_done_callback     (ES.ctx_done_callback)
+#define ctx_wait_callback     (ES.ctx_wait_callback)
+#define ctx_notify_callback   (ES.ctx_notify_callback)
+
+#define gc_roots              (ES.roots)  // registered by the host
+
+/* Programs returned by the parser that have not been handed to the
+   evaluator yet. They are roots until then. */
+#define held                  (ES.held)
+#define held_num              (ES.held_num)
+#define held_size             (ES.held_size)
+#define HELD_INITIAL_SIZE     8
+
+static void bytecode_gc(stack *roots);
+static int gc(VALUE env, stack *aux);
+
+/* Events posted by the host. A bounded multi producer, single consumer
+   ring buffer where every slot has a sequence number that tells if it
+   is free for the producer at position pos (seq == pos) or holds the
+   event at position pos for the consumer (seq == pos + 1). Producers
+   claim a position with a compare and swap, posting takes no lock and
+   does not allocate. */
+#define EVENT_MSG  0
+#define EVENT_CALL 1
+
+typedef eval_cps_event_t event_t;
+
+#define event_queue       (ES.event_queue)
+#define event_enqueue_pos (ES.event_enqueue_pos)
+#define event_dequeue_pos (ES.event_dequeue_pos)
+
+/* Inline caches for the head symbol of applications.
+
+   Entries are keyed by the application cell and hold the global
+   binding, (key . value), or the extension symbol that the head
+   resolved to. Local bindings are still looked up first, so only the
+   global environment scan and the extension lookup are skipped.
+   Analysed applications whose head is a global variable do not use
+   the cache, the analysis links the head to its binding.
+
+   All entries are invalidated by bumping global_version. That happens
+   on define and when a program is started from the host (which may
+   have added extensions or bindings in between). Garbage collection
+   does not invalidate, cells are not moved and a hit checks that the
+   head symbol is the key of the cached binding. A binding stays in
+   the global environment, and so is not freed, once it is there. */
+#define CALL_CACHE_SIZE EVAL_CPS_CALL_CACHE_SIZE
+
+typedef eval_cps_call_cache_entry_t call_cache_entry_t;
+
+#define call_cache     (ES.call_cache)
+#define global_version (ES.global_version)
+
+static void call_cache_invalidate(void) {
+  global_version++;
+  if (global_version == 0) {
+    memset(call_cache, 0, sizeof(call_cache));
+    global_version = 1;
+  }
+}
+
+static VALUE global_binding(VALUE sym) {
+  VALUE curr = *env_get_global_ptr();
+  while (type_of(curr) == PTR_TYPE_CONS) {
+    if (car(car(curr)) == sym) {
+      return car(curr);
+    }
+    curr = cdr(curr);
+  }
+  return enc_sym(symrepr_not_found());
+}
+
+/* Value of the (non-special) head symbol of the application exp */
+static VALUE resolve_head(VALUE exp, VALUE sym, VALUE env) {
+  call_cache_entry_t *e =
+    &call_cache[(exp >> ADDRESS_SHIFT) & (CALL_CACHE_SIZE - 1)];
+  VALUE value;
+
+  if (e->exp == exp && e->version == global_version &&
+      (e->binding == sym || car(e->binding) == sym)) {
+    if (e->binding == sym) {
+      return sym;
+    }
+    value = env_lookup(sym, env);
+    if (type_of(value) == VAL_TYPE_SYMBOL &&
+	dec_sym(value) == symrepr_not_found()) {
+      value = cdr(e->binding);
+    }
+    return value;
+  }
 
-static eval_context_t ctx_non_concurrent;
+  if (extensions_lookup(dec_sym(sym)) != NULL) {
+    e->exp = exp;
+    e->version = global_version;
+    e->binding = sym;
+    return sym;
+  }
+
+  value = env_lookup(sym, env);
+  if (type_of(value) != VAL_TYPE_SYMBOL ||
+      dec_sym(value) != symrepr_not_found()) {
+    return value;
+  }
 
-static void (*usleep_callback)(uint32_t) = NULL;
-static uint32_t (*timestamp_us_callback)(void) = NULL;
-static void (*ctx_done_callback)(eval_context_t *) = NULL;
+  VALUE binding = global_binding(sym);
+  if (type_of(binding) != PTR_TYPE_CONS) {
+    return binding;
+  }
+  e->exp = exp;
+  e->version = global_version;
+  e->binding = binding;
+  return cdr(binding);
+}
 
 void eval_cps_set_usleep_callback(void (*fptr)(uint32_t)) {
   usleep_callback = fptr;
 }
 
+void eval_cps_set_reductions(uint32_t n) {
+  reductions_per_slice = n;
+}
+
+static void event_queue_init(void) {
+  for (unsigned int i = 0; i < EVAL_CPS_EVENT_QUEUE_SIZE; i ++) {
+    atomic_init(&event_queue[i].seq, i);
+  }
+  atomic_init(&event_enqueue_pos, 0);
+  event_dequeue_pos = 0;
+}
+
+static bool event_post(unsigned int type, CID cid, VALUE fun, VALUE arg) {
+  unsigned int pos = atomic_load_explicit(&event_enqueue_pos, memory_order_relaxed);
+  event_t *e;
+
+  while (true) {
+    e = &event_queue[pos & (EVAL_CPS_EVENT_QUEUE_SIZE - 1)];
+    unsigned int seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+    int diff = (int)(seq - pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&event_enqueue_pos, &pos, pos + 1,
+						memory_order_relaxed,
+						memory_order_relaxed)) {
+	break;
+      }
+    } else if (diff < 0) {
+      return false; // full
+    } else {
+      pos = atomic_load_explicit(&event_enqueue_pos, memory_order_relaxed);
+    }
+  }
+  e->type = type;
+  e->cid = cid;
+  e->fun = fun;
+  e->arg = arg;
+  atomic_store_explicit(&e->seq, pos + 1, memory_order_release);
+  return true;
+}
+
+bool eval_cps_post_event(CID cid, VALUE v) {
+  return event_post(EVENT_MSG, cid, NIL, v);
+}
+
+bool eval_cps_post_call(VALUE fun, VALUE arg) {
+  return event_post(EVENT_CALL, 0, fun, arg);
+}
+
 void eval_cps_set_timestamp_us_callback(uint32_t (*fptr)(void)) {
   timestamp_us_callback = fptr;
 }
@@ -95,6 +305,11 @@ void eval_cps_set_ctx_done_callback(void (*fptr)(eval_context_t *)) {
   ctx_done_callback = fptr;
 }
 
+void eval_cps_set_ctx_notify_callbacks(void (*wait)(void), void (*notify)(void)) {
+  ctx_wait_callback = wait;
+  ctx_notify_callback = notify;
+}
+
 void enqueue_ctx(eval_context_t *ctx) {
 
   if (ctx_queue_last == NULL) {
@@ -110,7 +325,24 @@ void enqueue_ctx(eval_context_t *ctx) {
   }
 }
 
+/* Move a context from the blocked list to the ready queue */
+static void unblock_ctx(eval_context_t *ctx) {
+  if (ctx->prev) {
+    ctx->prev->next = ctx->next;
+  } else {
+    ctx_blocked = ctx->next;
+  }
+  if (ctx->next) {
+    ctx->next->prev = ctx->prev;
+  }
+  ctx->blocked = false;
+  ctx->timestamp = 0;
+  ctx->sleep_us = 0;
+  enqueue_ctx(ctx);
+}
+
 void finish_ctx(void) {
+  ctx_running->finished = true;
   if (ctx_done == NULL) {
     ctx_running->prev = NULL;
     ctx_running->next = NULL;
@@ -126,63 +358,174 @@ void finish_ctx(void) {
 
   ctx_running = NULL;
 
+  /* The contexts waiting for this one get its result before the done
+     callback runs, the callback may remove the context. A context
+     that has been waited for is joined and goes back to the pool,
+     unless the callback removed it already. */
+  eval_context_t *ctx = ctx_done;
+  CID cid = ctx->id;
+  bool joined = ctx->waiters != NULL;
+  while (ctx->waiters) {
+    eval_context_t *waiter = ctx->waiters;
+    ctx->waiters = waiter->next;
+    waiter->blocked = false;
+    waiter->timestamp = 0;
+    waiter->sleep_us = 0;
+    waiter->r = ctx->r;
+    waiter->app_cont = true;
+    enqueue_ctx(waiter);
+  }
+
+  /* Published for eval_cps_wait_ctx, the CID last */
+  atomic_store(&ctx->done_r, ctx->r);
+  atomic_store(&ctx->done_id, (unsigned int)cid);
+
   if (ctx_done_callback) {
-    ctx_done_callback(ctx_done);
+    ctx_done_callback(ctx);
+  }
+  if (joined) {
+    VALUE r;
+    eval_cps_remove_done_ctx(cid, &r);
+  }
+  if (ctx_notify_callback) {
+    ctx_notify_callback();
   }
 }
 
-bool eval_cps_remove_done_ctx(CID cid, VALUE *v) {
+/* Move the running context to the waiters of target until target
+   finishes. Waiters are linked through next and are only reachable
+   from the context they wait for. */
+static void wait_for_ctx(eval_context_t *target) {
+  ctx_running->wait_cid = target->id;
+  ctx_running->blocked = true;
+  ctx_running->prev = NULL;
+  ctx_running->next = target->waiters;
+  target->waiters = ctx_running;
+  ctx_running = NULL;
+}
+
+/* Move the running context to the blocked list until a message is
+   delivered to its mailbox */
+static void block_ctx(void) {
+  ctx_running->wait_cid = 0;
+  ctx_running->blocked = true;
+  ctx_running->prev = NULL;
+  ctx_running->next = ctx_blocked;
+  if (ctx_blocked) {
+    ctx_blocked->prev = ctx_running;
+  }
+  ctx_blocked = ctx_running;
+  ctx_running = NULL;
+}
+
+/* The context with CID cid, finished or not, or NULL */
+static eval_context_t *ctx_lookup(CID cid) {
+  unsigned int slot = cid & ((1u << ctx_slot_bits) - 1);
+  if (slot >= ctx_pool_size) return NULL;
+  eval_context_t *ctx = &ctx_pool[slot];
+  return (ctx->used && ctx->id == cid) ? ctx : NULL;
+}
 
-  if (!ctx_done) return false;
+/* The CID the free context ctx gets when it is taken from the pool */
+static CID next_cid(eval_context_t *ctx) {
+  unsigned int gen = (ctx->id >> ctx_slot_bits) + 1;
+  if (gen >= (1u << (CID_BITS - ctx_slot_bits))) gen = 1;
+  return (CID)((gen << ctx_slot_bits) | (unsigned int)(ctx - ctx_pool));
+}
 
-  eval_context_t * curr = ctx_done->next;
+static inline UINT *pool_stack(eval_context_t *ctx) {
+  return ctx_pool_stacks + (ctx - ctx_pool) * ctx_pool_stack_size;
+}
 
-  if (ctx_done->id == cid) {
-    *v = ctx_done->r;
-    stack_free(&ctx_done->K);
-    free(ctx_done);
-    ctx_done = curr;
-    if (ctx_done) {
-      ctx_done->prev = NULL;
-    }
-    return true;
+/* Return a finished context to the pool */
+static void release_ctx(eval_context_t *ctx) {
+  ctx->used = false;
+  stack_clear(&ctx->K);
+  if (ctx->K.data != pool_stack(ctx)) {
+    stack_free(&ctx->K);
   }
+  ctx->next = ctx_free;
+  ctx_free = ctx;
+}
 
-  while(curr) {
-    if (curr->id == cid) {
-      if (curr->prev) {
-	curr->prev->next = curr->next;
-      }
-      if (curr->next) {
-	curr->next->prev = curr->prev;
-      }
-      *v = curr->r;
-      stack_free(&curr->K);
-      free(curr);
-      return true;
-    }
-    curr = curr->next;
+bool eval_cps_remove_done_ctx(CID cid, VALUE *v) {
+
+  eval_context_t *ctx = ctx_lookup(cid);
+  if (!ctx || !ctx->finished) return false;
+
+  if (ctx->prev) {
+    ctx->prev->next = ctx->next;
+  } else {
+    ctx_done = ctx->next;
   }
-  return false;
+  if (ctx->next) {
+    ctx->next->prev = ctx->prev;
+  }
+  *v = ctx->r;
+  release_ctx(ctx);
+  return true;
 }
 
+/* Called by the host while the evaluator runs, it only reads the
+   pool slot of cid and what new_ctx and finish_ctx publish there. The
+   CID is read again after the result as the slot may have been reused
+   (its done_id is then cleared before slot_id is set). Once the slot
+   holds another context, or never held cid, the wait fails. */
 VALUE eval_cps_wait_ctx(CID cid) {
 
+  unsigned int slot = cid & ((1u << ctx_slot_bits) - 1);
+  if (slot >= ctx_pool_size) return enc_sym(symrepr_eerror());
+  eval_context_t *ctx = &ctx_pool[slot];
+
   while (true) {
-    eval_context_t *curr = ctx_done;
-    while (curr) {
-      if (curr->id == cid) {
-	return curr->r;
-      }
-      if (curr->next) {
-	curr = curr->next;
-      } else {
-	break;
-      }
+    if (atomic_load(&ctx->done_id) == cid) {
+      VALUE r = atomic_load(&ctx->done_r);
+      if (atomic_load(&ctx->done_id) == cid) return r;
+    }
+    if (atomic_load(&ctx->slot_id) != cid) {
+      return enc_sym(symrepr_eerror());
     }
-    usleep_callback(1000);
+    if (ctx_wait_callback) {
+      ctx_wait_callback();
+    } else {
+      usleep_callback(1000);
+    }
+  }
+}
+
+/* The CID an integer argument names, false if it is not one */
+static bool dec_cid(VALUE v, CID *cid) {
+  if (type_of(v) != VAL_TYPE_I ||
+      dec_i(v) <= 0 || dec_i(v) >= ((INT)1 << CID_BITS)) return false;
+  *cid = (CID)dec_i(v);
+  return true;
+}
+
+/* Find a context that has not finished */
+static eval_context_t *find_ctx(CID cid) {
+  eval_context_t *ctx = ctx_lookup(cid);
+  if (ctx && !ctx->finished) return ctx;
+  return NULL;
+}
+
+/* Append msg to the mailbox of ctx and wake it up if it is blocked
+   in recv. Messages are passed by reference. Returns false if out of
+   memory. */
+static bool mailbox_put(eval_context_t *ctx, VALUE msg) {
+  VALUE cell = cons(msg, NIL);
+  if (type_of(cell) == VAL_TYPE_SYMBOL) return false;
+
+  if (type_of(ctx->mailbox) == PTR_TYPE_CONS) {
+    set_cdr(ctx->mailbox_last, cell);
+  } else {
+    ctx->mailbox = cell;
   }
-  return enc_sym(symrepr_nil());
+  ctx->mailbox_last = cell;
+
+  if (ctx->blocked && ctx->wait_cid == 0) {
+    unblock_ctx(ctx);
+  }
+  return true;
 }
 
 void error_ctx(VALUE err_val) {
@@ -190,56 +533,81 @@ void error_ctx(VALUE err_val) {
   finish_ctx();
 }
 
-eval_context_t *dequeue_ctx(uint32_t *us) {
-  uint32_t min_us = DEFAULT_SLEEP_US;
+/* Timestamps wrap around, wake up times are compared by their
+   distance, which is correct as long as sleeps are shorter than
+   2^31 us. */
+static inline uint32_t wake_time(eval_context_t *ctx) {
+  return ctx->timestamp + ctx->sleep_us;
+}
 
-  uint32_t t_now;
-  if (timestamp_us_callback) {
-    t_now = timestamp_us_callback();
-  } else {
-    t_now = 0;
+static inline bool wakes_before(eval_context_t *a, eval_context_t *b) {
+  return (int32_t)(wake_time(a) - wake_time(b)) < 0;
+}
+
+static void sleep_ctx(eval_context_t *ctx) {
+  unsigned int i = ctx_sleeping_num++;
+  while (i > 0) {
+    unsigned int parent = (i - 1) / 2;
+    if (!wakes_before(ctx, ctx_sleeping[parent])) break;
+    ctx_sleeping[i] = ctx_sleeping[parent];
+    i = parent;
   }
+  ctx_sleeping[i] = ctx;
+}
 
-  eval_context_t *curr = ctx_queue;
+static eval_context_t *wake_ctx(void) {
+  eval_context_t *res = ctx_sleeping[0];
+  eval_context_t *last = ctx_sleeping[--ctx_sleeping_num];
+  unsigned int i = 0;
 
-  while (curr != NULL) {
-    uint32_t t_diff;
-    if ( curr->timestamp > t_now) {
-      /* There was an overflow on the counter */
-      t_diff = (0xFFFFFFFF - curr->timestamp) + t_now;
-    } else {
-      t_diff = t_now - curr->timestamp;
+  while (true) {
+    unsigned int child = 2 * i + 1;
+    if (child >= ctx_sleeping_num) break;
+    if (child + 1 < ctx_sleeping_num &&
+	wakes_before(ctx_sleeping[child + 1], ctx_sleeping[child])) {
+      child ++;
     }
+    if (!wakes_before(ctx_sleeping[child], last)) break;
+    ctx_sleeping[i] = ctx_sleeping[child];
+    i = child;
+  }
+  if (ctx_sleeping_num > 0) {
+    ctx_sleeping[i] = last;
+  }
+  return res;
+}
 
-    if (t_diff >= curr->sleep_us) {
-      eval_context_t *result = curr;
-      if (curr == ctx_queue_last) {
-	if (curr->prev) {
-	  ctx_queue_last = curr->prev;
-	  ctx_queue_last->next = NULL;
-	} else {
-	  ctx_queue = NULL;
-	  ctx_queue_last = NULL;
-	}
-      } else if (curr->prev == NULL) {
-	ctx_queue = curr->next;
-	if (ctx_queue) {
-	  ctx_queue->prev = NULL;
-	}
-      } else {
-	curr->prev->next = curr->next;
-	if (curr->next) {
-	  curr->next->prev = curr->prev;
+eval_context_t *dequeue_ctx(uint32_t *us) {
+
+  if (ctx_sleeping_num > 0) {
+    uint32_t t_now = timestamp_us_callback ? timestamp_us_callback() : 0;
+
+    while (ctx_sleeping_num > 0) {
+      eval_context_t *first = ctx_sleeping[0];
+      uint32_t t_diff = t_now - first->timestamp;
+      if (t_diff < first->sleep_us) {
+	if (ctx_queue == NULL) {
+	  *us = first->sleep_us - t_diff;
+	  return NULL;
 	}
+	break;
       }
-      return result;
+      enqueue_ctx(wake_ctx());
     }
-    if (min_us > t_diff) min_us = t_diff;
-    curr = curr->next;
   }
 
-  *us = min_us;
-  return NULL;
+  eval_context_t *res = ctx_queue;
+  if (res == NULL) {
+    *us = DEFAULT_SLEEP_US;
+    return NULL;
+  }
+  ctx_queue = res->next;
+  if (ctx_queue) {
+    ctx_queue->prev = NULL;
+  } else {
+    ctx_queue_last = NULL;
+  }
+  return res;
 }
 
 void yield_ctx(uint32_t sleep_us) {
@@ -252,20 +620,29 @@ void yield_ctx(uint32_t sleep_us) {
   }
   ctx_running->r = enc_sym(symrepr_true());
   ctx_running->app_cont = true;
-  enqueue_ctx(ctx_running);
+  if (ctx_running->sleep_us > 0) {
+    sleep_ctx(ctx_running);
+  } else {
+    enqueue_ctx(ctx_running);
+  }
   ctx_running = NULL;
 }
 
-CID create_ctx(VALUE program, VALUE env, uint32_t stack_size, bool grow_stack) {
+/* Take a context from the pool, the caller enqueues it */
+static eval_context_t *new_ctx(VALUE program, VALUE env, uint32_t stack_size, bool grow_stack) {
 
-  if (next_ctx_id == 0) return 0; // overflow of CIDs
+  eval_context_t *ctx = ctx_free;
+  if (ctx == NULL) return NULL; // pool exhausted
 
-  if (type_of(program) != PTR_TYPE_CONS) return 0;
+  /* The pooled stack is used unless a larger one is asked for */
+  if (stack_size > ctx_pool_stack_size) {
+    if (!stack_allocate(&ctx->K, stack_size, grow_stack)) return NULL;
+  } else {
+    stack_create(&ctx->K, pool_stack(ctx), ctx_pool_stack_size);
+  }
+  ctx->K.growable = grow_stack;
+  ctx_free = ctx->next;
 
-  eval_context_t *ctx = NULL;
-  ctx = malloc(sizeof(eval_context_t));
-  if (ctx == NULL) return 0;
-  
   ctx->program = cdr(program);
   ctx->curr_exp = car(program);
   ctx->curr_env = env;
@@ -273,22 +650,109 @@ CID create_ctx(VALUE program, VALUE env, uint32_t stack_size, bool grow_stack) {
   ctx->app_cont = false;
   ctx->timestamp = 0;
   ctx->sleep_us = 0;
-  ctx->id = next_ctx_id++;
-  if (!stack_allocate(&ctx->K, stack_size, grow_stack)) {
-    free(ctx);
-    return 0;
+  ctx->id = next_cid(ctx);
+  atomic_store(&ctx->done_id, 0);
+  atomic_store(&ctx->slot_id, (unsigned int)ctx->id);
+  ctx->used = true;
+  ctx->finished = false;
+  ctx->waiters = NULL;
+  ctx->wait_cid = 0;
+  ctx->blocked = false;
+  ctx->mailbox = NIL;
+  ctx->mailbox_last = NIL;
+  push_u32(&ctx->K, enc_u(DONE));
+  return ctx;
+}
+
+CID create_ctx(VALUE program, VALUE env, uint32_t stack_size, bool grow_stack) {
+
+  if (type_of(program) != PTR_TYPE_CONS) return 0;
+
+  eval_context_t *ctx = new_ctx(program, env, stack_size, grow_stack);
+  if (ctx == NULL) return 0;
+
+  enqueue_ctx(ctx);
+  return ctx->id;
+}
+
+/* Set up ctx to start by applying fun to args. The application frame
+   is pushed as if the arguments had been evaluated, so nothing is
+   parsed or allocated. A symbol that is not special or an extension
+   is looked up in the global environment. */
+static bool push_call(eval_context_t *ctx, VALUE fun, VALUE *args, unsigned int argn) {
+
+  if (type_of(fun) == VAL_TYPE_SYMBOL &&
+      !is_special(fun) &&
+      extensions_lookup(dec_sym(fun)) == NULL) {
+    fun = env_lookup(fun, *env_get_global_ptr());
   }
-  if (!push_u32(&ctx->K, enc_u(DONE))) {
-    free(ctx);
-    stack_free(&ctx->K);
-    return 0;
+
+  if (!push_u32(&ctx->K, fun)) return false;
+  for (unsigned int i = 0; i < argn; i ++) {
+    if (!push_u32(&ctx->K, args[i])) return false;
   }
+  if (!push_u32_2(&ctx->K, enc_u(argn), enc_u(APPLICATION))) return false;
 
-  enqueue_ctx(ctx);
+  ctx->r = NIL;
+  ctx->app_cont = true;
+  return true;
+}
+
+/* A new context applying fun to args, 0 if out of contexts or stack */
+static CID call_ctx(VALUE fun, VALUE *args, unsigned int argn) {
 
+  eval_context_t *ctx = new_ctx(NIL, NIL,
+				EVAL_CPS_DEFAULT_STACK_SIZE,
+				EVAL_CPS_DEFAULT_STACK_GROW_POLICY);
+  if (ctx == NULL) return 0;
+
+  if (!push_call(ctx, fun, args, argn)) {
+    release_ctx(ctx);
+    return 0;
+  }
+  enqueue_ctx(ctx);
   return ctx->id;
 }
 
+CID eval_cps_call(VALUE fun, VALUE *args, unsigned int argn) {
+  call_cache_invalidate();
+  return call_ctx(fun, args, argn);
+}
+
+/* Returns false if out of memory or contexts. A call is applied to
+   its argument as eval_cps_call does, so the argument is not
+   evaluated. */
+static bool event_deliver(event_t *e) {
+  if (e->type == EVENT_MSG) {
+    eval_context_t *ctx = find_ctx(e->cid);
+    return !ctx || mailbox_put(ctx, e->arg); // events for no context are dropped
+  }
+  return call_ctx(e->fun, &e->arg, 1) != 0;
+}
+
+/* Deliver the posted events, called between evaluation steps when
+   no context is running. An event that cannot be delivered, a call
+   when the pool is exhausted or any event when there is no memory
+   even after a GC, is left at the head of the ring and retried the
+   next time. The events behind it wait, and posting fails once the
+   ring is full. */
+static void process_events(void) {
+  while (true) {
+    event_t *e = &event_queue[event_dequeue_pos & (EVAL_CPS_EVENT_QUEUE_SIZE - 1)];
+    unsigned int seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+    if (seq != event_dequeue_pos + 1) return;
+
+    if (e->type == EVENT_CALL && ctx_free == NULL) return;
+    if (!event_deliver(e)) {
+      gc(*env_get_global_ptr(), NULL);
+      if (!event_deliver(e)) return;
+    }
+    atomic_store_explicit(&e->seq, event_dequeue_pos + EVAL_CPS_EVENT_QUEUE_SIZE,
+			  memory_order_release);
+    event_dequeue_pos ++;
+  }
+}
+
 void advance_ctx(void) {
 
   if (type_of(ctx_running->program) == PTR_TYPE_CONS) {
@@ -315,6 +779,7 @@ void cont_set_global_env(eval_context_t *ctx, bool *perform_gc){
 
   pop_u32(&ctx->K, &key);
   VALUE new_env = env_set(*env_get_global_ptr(),key,val);
+  call_cache_invalidate();
 
   if (type_of(new_env) == VAL_TYPE_SYMBOL) {
     if (dec_sym(new_env) == symrepr_merror()) {
@@ -386,7 +851,7 @@ void apply_continuation(eval_context_t *ctx, bool *perform_gc){
       return;
     }
 
-    VALUE cid_val = enc_i(next_ctx_id);
+    VALUE cid_val = enc_i(ctx_free ? next_cid(ctx_free) : 0);
     VALUE cid_list = cons(cid_val, ctx->r);
     if (type_of(cid_list) == VAL_TYPE_SYMBOL) {
       FATAL_ON_FAIL(ctx->done, push_u32_3(&ctx->K, env, rest, enc_u(SPAWN_ALL)));
@@ -394,12 +859,13 @@ void apply_continuation(eval_context_t *ctx, bool *perform_gc){
       ctx->app_cont = true;
       return;
     }
-    // TODO: error checking
     CID cid = create_ctx(car(rest),
 			 env,
 			 EVAL_CPS_DEFAULT_STACK_SIZE,
 			 EVAL_CPS_DEFAULT_STACK_GROW_POLICY);
-    (void) cid;
+    if (cid == 0) { // no free context
+      set_car(cid_list, NIL);
+    }
     FATAL_ON_FAIL(ctx->done, push_u32_3(&ctx->K, env, cdr(rest), enc_u(SPAWN_ALL)));
     ctx->r = cid_list;
     ctx->app_cont = true;
@@ -412,15 +878,31 @@ void apply_continuation(eval_context_t *ctx, bool *perform_gc){
     CID cid = dec_u(cid_val);
 
     VALUE r;
+    eval_context_t *target = ctx_lookup(cid);
 
+    if (!target) { // no such context, or it has been removed
+      ERROR
+      error_ctx(enc_sym(symrepr_eerror()));
+      return;
+    }
     if (eval_cps_remove_done_ctx(cid, &r)) {
       ctx->r = r;
       ctx->app_cont = true;
     } else {
-      FOF(push_u32_2(&ctx->K, enc_u(cid), enc_u(WAIT)));
-      ctx->r = enc_sym(symrepr_true());
+      wait_for_ctx(target); // finish_ctx hands over the result
+    }
+    return;
+  }
+
+  case RECV: {
+    if (type_of(ctx->mailbox) == PTR_TYPE_CONS) {
+      ctx->r = car(ctx->mailbox);
+      ctx->mailbox = cdr(ctx->mailbox);
       ctx->app_cont = true;
-      yield_ctx(50000);
+    } else {
+      FOF(push_u32(&ctx->K, enc_u(RECV)));
+      ctx->app_cont = true;
+      block_ctx();
     }
     return;
   }
@@ -430,10 +912,29 @@ void apply_continuation(eval_context_t *ctx, bool *perform_gc){
     pop_u32(&ctx->K, &count);
 
     UINT *fun_args = stack_ptr(&ctx->K, dec_u(count)+1);
+    if (!fun_args) {
+      ERROR
+      error_ctx(enc_sym(symrepr_merror()));
+      return;
+    }
 
     VALUE fun = fun_args[0];
 
-    if (type_of(fun) == PTR_TYPE_CONS) { // a closure (it better be)
+    if (bytecode_is_callable(fun)) {
+      VALUE res = bytecode_apply(fun, &fun_args[1], dec_u(count), bytecode_gc);
+      if (type_of(res) == VAL_TYPE_SYMBOL &&
+	  (dec_sym(res) == symrepr_eerror() ||
+	   dec_sym(res) == symrepr_merror() ||
+	   dec_sym(res) == symrepr_rerror())) {
+	ERROR
+	error_ctx(res);
+	return;
+      }
+      stack_drop(&ctx->K, dec_u(count)+1);
+      ctx->r = res;
+      ctx->app_cont = true;
+      return;
+    } else if (type_of(fun) == PTR_TYPE_CONS) { // a closure (it better be)
       VALUE args = NIL;
       for (UINT i = dec_u(count); i > 0; i --) {
 	args = cons(fun_args[i], args);
@@ -502,13 +1003,12 @@ void apply_continuation(eval_context_t *ctx, bool *perform_gc){
       }
 
       if (dec_sym(fun) == symrepr_wait()) {
-	if (type_of(fun_args[1]) == VAL_TYPE_I) {
-	  CID cid = dec_i(fun_args[1]);
+	CID cid;
+	if (dec_cid(fun_args[1], &cid)) {
 	  stack_drop(&ctx->K, dec_u(count)+1);
 	  FOF(push_u32_2(&ctx->K, enc_u(cid), enc_u(WAIT)));
 	  ctx->r = enc_sym(symrepr_true());
 	  ctx->app_cont = true;
-	  yield_ctx(50000);
 	} else {
 	  ERROR
 	  error_ctx(enc_sym(symrepr_eerror()));
@@ -516,6 +1016,45 @@ void apply_continuation(eval_context_t *ctx, bool *perform_gc){
 	return;
       }
 
+      if (dec_sym(fun) == symrepr_send()) {
+	CID cid;
+	if (dec_u(count) == 2 && type_of(fun_args[1]) == VAL_TYPE_I) {
+	  eval_context_t *target = dec_cid(fun_args[1], &cid) ? find_ctx(cid) : NULL;
+	  VALUE res = NIL;
+	  if (target) {
+	    if (!mailbox_put(target, fun_args[2])) {
+	      FATAL_ON_FAIL(ctx->done, push_u32_2(&ctx->K, count, enc_u(APPLICATION)));
+	      *perform_gc = true;
+	      ctx->app_cont = true;
+	      ctx->r = fun;
+	      return;
+	    }
+	    res = enc_sym(symrepr_true());
+	  }
+	  stack_drop(&ctx->K, dec_u(count)+1);
+	  ctx->r = res;
+	  ctx->app_cont = true;
+	} else {
+	  ERROR
+	  error_ctx(enc_sym(symrepr_eerror()));
+	}
+	return;
+      }
+
+      if (dec_sym(fun) == symrepr_recv()) {
+	stack_drop(&ctx->K, dec_u(count)+1);
+	FOF(push_u32(&ctx->K, enc_u(RECV)));
+	ctx->app_cont = true;
+	return;
+      }
+
+      if (dec_sym(fun) == symrepr_self()) {
+	stack_drop(&ctx->K, dec_u(count)+1);
+	ctx->r = enc_i((INT)ctx->id);
+	ctx->app_cont = true;
+	return;
+      }
+
       if (dec_sym(fun) == symrepr_eval()) {
 	ctx->curr_exp = fun_args[1];
 	stack_drop(&ctx->K, dec_u(count)+1);
@@ -547,7 +1086,7 @@ void apply_continuation(eval_context_t *ctx, bool *perform_gc){
     }
 
     // It may be an extension
-    printf("Trying to apply to: %u\n", dec_sym(fun));
+    printf("Trying to apply to: %"PRI_UINT"\n", dec_sym(fun));
 
     extension_fptr f = extensions_lookup(dec_sym(fun));
     if (f == NULL) {
@@ -713,37 +1252,57 @@ void apply_continuation(eval_context_t *ctx, bool *perform_gc){
   return;
 }
 
-static int gc(VALUE env,
-	      eval_context_t *runnable,
-	      eval_context_t *done,
-	      eval_context_t *running) {
+static void mark_context(eval_context_t *ctx) {
+  gc_mark_phase(ctx->curr_env);
+  gc_mark_phase(ctx->curr_exp);
+  gc_mark_phase(ctx->program);
+  gc_mark_phase(ctx->r);
+  gc_mark_phase(ctx->mailbox);
+  stack_foreach_segment(&ctx->K, gc_mark_aux);
+}
+
+/* Every context taken from the pool is marked, wherever it is
+   queued. Contexts waiting for another context are only linked from
+   that context, and finished contexts keep just their result. The
+   context of the non concurrent evaluator is not in the pool. */
+static int gc(VALUE env, stack *aux) {
 
   gc_state_inc();
   gc_mark_freelist();
   gc_mark_phase(env);
-
-  eval_context_t *curr = runnable;
-  while (curr) {
-    gc_mark_phase(curr->curr_env);
-    gc_mark_phase(curr->curr_exp);
-    gc_mark_phase(curr->program);
-    gc_mark_phase(curr->r);
-    gc_mark_aux(curr->K.data, curr->K.sp);
-    curr = curr->next;
+  if (aux) {
+    stack_foreach_segment(aux, gc_mark_aux);
   }
-
-  curr = done;
-  while (curr) {
-    gc_mark_phase(curr->r);
-    curr = curr->next;
+  for (eval_cps_root_t *r = gc_roots; r; r = r->next) {
+    stack_foreach_segment(r->values, gc_mark_aux);
+  }
+  gc_mark_aux(held, held_num);
+
+  /* A collection from the parser or the host may come while
+     ec_eval_program runs */
+  register_machine_t *rm = &instance_current()->ec_eval.rm_state;
+  gc_mark_phase(rm->env);
+  gc_mark_phase(rm->unev);
+  gc_mark_phase(rm->prg);
+  gc_mark_phase(rm->exp);
+  gc_mark_phase(rm->argl);
+  gc_mark_phase(rm->val);
+  gc_mark_phase(rm->fun);
+  gc_mark_aux(rm->S.data, rm->S.sp);
+
+  for (unsigned int i = 0; i < ctx_pool_size; i ++) {
+    eval_context_t *ctx = &ctx_pool[i];
+    if (!ctx->used) continue;
+    if (ctx->finished) {
+      gc_mark_phase(ctx->r);
+    } else {
+      mark_context(ctx);
+    }
   }
 
-  gc_mark_phase(running->curr_env);
-  gc_mark_phase(running->curr_exp);
-  gc_mark_phase(running->program);
-  gc_mark_phase(running->r);
-  gc_mark_aux(running->K.data, running->K.sp);
-
+  if (ctx_running == &ctx_non_concurrent) {
+    mark_context(ctx_running);
+  }
 
 #ifdef VISUALIZE_HEAP
   heap_vis_gen_image();
@@ -752,6 +1311,57 @@ static int gc(VALUE env,
   return gc_sweep_phase();
 }
 
+int eval_cps_gc(stack *roots) {
+  if (atomic_load(&eval_loop_active) && !atomic_load(&paused)) {
+    return 0;
+  }
+  return gc(*env_get_global_ptr(), roots);
+}
+
+void eval_cps_add_root(eval_cps_root_t *root) {
+  root->next = gc_roots;
+  gc_roots = root;
+}
+
+void eval_cps_remove_root(eval_cps_root_t *root) {
+  eval_cps_root_t **r = &gc_roots;
+  while (*r) {
+    if (*r == root) {
+      *r = root->next;
+      return;
+    }
+    r = &(*r)->next;
+  }
+}
+
+bool eval_cps_hold_program(VALUE prg) {
+  if (!is_ptr(prg)) return true;
+  if (held_num == held_size) {
+    unsigned int size = held_size ? held_size * 2 : HELD_INITIAL_SIZE;
+    VALUE *h = realloc(held, size * sizeof(VALUE));
+    if (h == NULL) return false;
+    held = h;
+    held_size = size;
+  }
+  held[held_num ++] = prg;
+  return true;
+}
+
+void eval_cps_release_program(VALUE prg) {
+  for (unsigned int i = held_num; i > 0; i --) {
+    if (held[i-1] == prg) {
+      held[i-1] = held[-- held_num];
+      return;
+    }
+  }
+}
+
+/* Compiled code runs to completion inside an application, its
+   registers and stack are passed in as additional roots. */
+static void bytecode_gc(stack *roots) {
+  gc(*env_get_global_ptr(), roots);
+}
+
 void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
   eval_context_t *ctx = ctx_running;
 
@@ -766,10 +1376,7 @@ void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
       return;
     }
     *last_iteration_gc = true;
-    gc(*env_get_global_ptr(),
-       ctx_queue,
-       ctx_done,
-       ctx_running);
+    gc(*env_get_global_ptr(), NULL);
     *perform_gc = false;
   } else {
     *last_iteration_gc = false;;
@@ -826,15 +1433,74 @@ void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
 
       UINT sym_id = dec_sym(head);
 
+      switch (sym_id) {
+      // Analysed constant
+      case DEF_REPR_AN_CONST:
+	ctx->r = cdr(ctx->curr_exp);
+	ctx->app_cont = true;
+	return;
+
+      // Analysed global variable
+      case DEF_REPR_AN_GLOBAL:
+	ctx->r = analyze_global_value(ctx->curr_exp);
+	ctx->app_cont = true;
+	return;
+
+      // Analysed application
+      case DEF_REPR_AN_APP: {
+	VALUE fun_args = cdr(ctx->curr_exp);
+	VALUE fun_exp = car(fun_args);
+	FOF(push_u32_4(&ctx->K,
+		       ctx->curr_env,
+		       enc_u(0),
+		       cdr(fun_args),
+		       enc_u(APPLICATION_ARGS)));
+	if (is_special(fun_exp)) {
+	  ctx->r = fun_exp;
+	  ctx->app_cont = true;
+	} else if (type_of(fun_exp) == VAL_TYPE_SYMBOL) {
+	  ctx->r = resolve_head(ctx->curr_exp, fun_exp, ctx->curr_env);
+	  ctx->app_cont = true;
+	} else if (type_of(fun_exp) == PTR_TYPE_CONS &&
+		   car(fun_exp) == enc_sym(DEF_REPR_AN_GLOBAL)) {
+	  // Not locally bound, no lookup
+	  ctx->r = analyze_global_value(fun_exp);
+	  ctx->app_cont = true;
+	} else {
+	  ctx->curr_exp = fun_exp;
+	}
+	return;
+      }
+
+      // Analysed AND / OR
+      case DEF_REPR_AN_AND:
+      case DEF_REPR_AN_OR: {
+	VALUE rest = cdr(ctx->curr_exp);
+	bool is_and = sym_id == DEF_REPR_AN_AND;
+	if (type_of(rest) == VAL_TYPE_SYMBOL &&
+	    rest == NIL) {
+	  ctx->r = enc_sym(is_and ? symrepr_true() : symrepr_nil());
+	  ctx->app_cont = true;
+	  return;
+	}
+	FOF(push_u32_3(&ctx->K,
+		       ctx->curr_env,
+		       cdr(rest),
+		       enc_u(is_and ? AND : OR)));
+	ctx->curr_exp = car(rest);
+	return;
+      }
+
       // Special form: QUOTE
-      if (sym_id == symrepr_quote()) {
+      case DEF_REPR_QUOTE: {
 	ctx->r = car(cdr(ctx->curr_exp));
 	ctx->app_cont = true;
 	return;
       }
 
       // Special form: DEFINE
-      if (sym_id == symrepr_define()) {
+      case DEF_REPR_AN_DEFINE:
+      case DEF_REPR_DEFINE: {
 	VALUE key = car(cdr(ctx->curr_exp));
 	VALUE val_exp = car(cdr(cdr(ctx->curr_exp)));
 
@@ -851,7 +1517,8 @@ void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
       }
 
       // Special form: PROGN
-      if (sym_id == symrepr_progn()) {
+      case DEF_REPR_AN_PROGN:
+      case DEF_REPR_PROGN: {
 	VALUE exps = cdr(ctx->curr_exp);
 	VALUE env  = ctx->curr_env;
 
@@ -873,7 +1540,7 @@ void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
       }
 
       // Special form: SPAWN
-      if (sym_id == symrepr_spawn()) {
+      case SYM_SPAWN: {
 	VALUE prgs = cdr(ctx->curr_exp);
 	VALUE env = ctx->curr_env;
 
@@ -891,7 +1558,8 @@ void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
       }
 
       // Special form: LAMBDA
-      if (sym_id == symrepr_lambda()) {
+      case DEF_REPR_AN_LAMBDA:
+      case DEF_REPR_LAMBDA: {
 
 	VALUE env_cpy = env_copy_shallow(ctx->curr_env);
 
@@ -926,7 +1594,8 @@ void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
       }
 
       // Special form: IF
-      if (sym_id == symrepr_if()) {
+      case DEF_REPR_AN_IF:
+      case DEF_REPR_IF: {
 
 	FOF(push_u32_3(&ctx->K,
 		       car(cdr(cdr(cdr(ctx->curr_exp)))), // Else branch
@@ -936,7 +1605,8 @@ void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
 	return;
       }
       // Special form: LET
-      if (sym_id == symrepr_let()) {
+      case DEF_REPR_AN_LET:
+      case DEF_REPR_LET: {
 	VALUE orig_env = ctx->curr_env;
 	VALUE binds    = car(cdr(ctx->curr_exp)); // key value pairs.
 	VALUE exp      = car(cdr(cdr(ctx->curr_exp))); // exp to evaluate in the new env.
@@ -976,6 +1646,9 @@ void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
 	ctx->curr_env = new_env;
 	return;
       }
+      default:
+	break;
+      }
     } // If head is symbol
     FOF(push_u32_4(&ctx->K,
 		   ctx->curr_env,
@@ -983,6 +1656,11 @@ void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
 		   cdr(ctx->curr_exp),
 		   enc_u(APPLICATION_ARGS)));
 
+    if (type_of(head) == VAL_TYPE_SYMBOL && !is_special(head)) {
+      ctx->r = resolve_head(ctx->curr_exp, head, ctx->curr_env);
+      ctx->app_cont = true;
+      return;
+    }
     ctx->curr_exp = head; // evaluate the function
     return;
   default:
@@ -994,15 +1672,49 @@ void evaluation_step(bool *perform_gc, bool *last_iteration_gc){
   return;
 }
 
+void eval_cps_pause_eval(void) {
+  atomic_store(&pause_request, true);
+  while (atomic_load(&eval_loop_active) && !atomic_load(&paused)) {
+    if (usleep_callback) {
+      usleep_callback(EVAL_CPS_PAUSE_US);
+    }
+  }
+}
+
+void eval_cps_continue_eval(void) {
+  atomic_store(&pause_request, false);
+}
+
+static void pause_eval(void) {
+  atomic_store(&paused, true);
+  while (atomic_load(&pause_request)) {
+    if (usleep_callback) {
+      usleep_callback(EVAL_CPS_PAUSE_US);
+    }
+  }
+  atomic_store(&paused, false);
+}
+
 void eval_cps_run_eval(void){
 
   bool perform_gc = false;
   bool last_iteration_gc = false;
+  uint32_t reductions = 0;
+
+  /* A host that sees the loop as inactive returns from
+     eval_cps_pause_eval at once, the request is then seen here before
+     the first step. */
+  atomic_store(&eval_loop_active, true);
 
   while (eval_running) {
 
     if (!ctx_running) {
       uint32_t us;
+      if (atomic_load(&pause_request)) {
+	pause_eval();
+	continue;
+      }
+      process_events();
       ctx_running = dequeue_ctx(&us);
       if (!ctx_running) {
 	if (usleep_callback) {
@@ -1010,9 +1722,23 @@ void eval_cps_run_eval(void){
 	}
 	continue;
       }
+      reductions = reductions_per_slice;
     }
     evaluation_step(&perform_gc, &last_iteration_gc);
+
+    /* Preempt a context that has used up its reductions. Not while a
+       garbage collection is pending, the step that asked for it is
+       retried directly after. */
+    if (ctx_running && reductions_per_slice &&
+	!perform_gc && --reductions == 0) {
+      ctx_running->timestamp = 0;
+      ctx_running->sleep_us = 0;
+      enqueue_ctx(ctx_running);
+      ctx_running = NULL;
+    }
   }
+
+  atomic_store(&eval_loop_active, false);
 }
 
 VALUE evaluate_non_concurrent(void) {
@@ -1033,17 +1759,19 @@ VALUE evaluate_non_concurrent(void) {
 }
 
 CID eval_cps_program(VALUE lisp) {
-  return create_ctx(lisp, NIL, 256, false);
+  return eval_cps_program_ext(lisp, EVAL_CPS_DEFAULT_STACK_SIZE,
+			      EVAL_CPS_DEFAULT_STACK_GROW_POLICY);
 }
 
+/* Once the context exists it keeps the program alive */
 CID eval_cps_program_ext(VALUE lisp, unsigned int stack_size, bool grow_stack) {
-  return create_ctx(lisp, NIL, stack_size, grow_stack);
+  call_cache_invalidate();
+  CID cid = create_ctx(lisp, NIL, stack_size, grow_stack);
+  if (cid) eval_cps_release_program(lisp);
+  return cid;
 }
 
-VALUE eval_cps_program_nc(VALUE lisp) {
-
-  if (type_of(lisp) != PTR_TYPE_CONS)
-    return enc_sym(symrepr_eerror());
+static void reset_nc_ctx(VALUE lisp) {
   ctx_non_concurrent.program = cdr(lisp);
   ctx_non_concurrent.curr_exp = car(lisp);
   ctx_non_concurrent.curr_env = NIL;
@@ -1052,8 +1780,24 @@ VALUE eval_cps_program_nc(VALUE lisp) {
   ctx_non_concurrent.timestamp = 0;
   ctx_non_concurrent.sleep_us = 0;
   ctx_non_concurrent.id = 0;
+  ctx_non_concurrent.used = false;
+  ctx_non_concurrent.finished = false;
+  ctx_non_concurrent.waiters = NULL;
+  ctx_non_concurrent.wait_cid = 0;
+  ctx_non_concurrent.blocked = false;
+  ctx_non_concurrent.mailbox = NIL;
+  ctx_non_concurrent.mailbox_last = NIL;
 
   stack_clear(&ctx_non_concurrent.K);
+}
+
+VALUE eval_cps_program_nc(VALUE lisp) {
+
+  eval_cps_release_program(lisp);
+  if (type_of(lisp) != PTR_TYPE_CONS)
+    return enc_sym(symrepr_eerror());
+  call_cache_invalidate();
+  reset_nc_ctx(lisp);
 
   if (!push_u32(&ctx_non_concurrent.K, enc_u(DONE)))
     return enc_sym(symrepr_merror());
@@ -1063,11 +1807,24 @@ VALUE eval_cps_program_nc(VALUE lisp) {
   return evaluate_non_concurrent();
 }
 
+VALUE eval_cps_call_nc(VALUE fun, VALUE *args, unsigned int argn) {
+
+  call_cache_invalidate();
+  reset_nc_ctx(NIL);
+
+  if (!push_u32(&ctx_non_concurrent.K, enc_u(DONE)) ||
+      !push_call(&ctx_non_concurrent, fun, args, argn))
+    return enc_sym(symrepr_merror());
+
+  ctx_running = &ctx_non_concurrent;
+
+  return evaluate_non_concurrent();
+}
+
 int eval_cps_init_nc(unsigned int stack_size, bool grow_stack) {
 
-  NIL = enc_sym(symrepr_nil());
-  NONSENSE = enc_sym(symrepr_nonsense());
- 
+  global_version = 1;
+
   VALUE nil_entry = cons(NIL, NIL);
   *env_get_global_ptr() = cons(nil_entry, *env_get_global_ptr());
 
@@ -1082,9 +1839,14 @@ int eval_cps_init_nc(unsigned int stack_size, bool grow_stack) {
 }
 
 int eval_cps_init() {
+  return eval_cps_init_ext(EVAL_CPS_DEFAULT_NUM_CONTEXTS,
+			   EVAL_CPS_DEFAULT_STACK_SIZE);
+}
+
+int eval_cps_init_ext(unsigned int num_contexts, unsigned int stack_size) {
   int res = 1;
-  NIL = enc_sym(symrepr_nil());
-  NONSENSE = enc_sym(symrepr_nonsense());
+  global_version = 1;
+  reductions_per_slice = EVAL_CPS_DEFAULT_REDUCTIONS;
 
   VALUE nil_entry = cons(NIL, NIL);
   *env_get_global_ptr() = cons(nil_entry, *env_get_global_ptr());
@@ -1092,6 +1854,38 @@ int eval_cps_init() {
   if (type_of(nil_entry) == VAL_TYPE_SYMBOL ||
       type_of(*env_get_global_ptr()) == VAL_TYPE_SYMBOL) res = 0;
 
+  if (num_contexts == 0 || num_contexts > EVAL_CPS_MAX_CONTEXTS || stack_size == 0) return 0;
+
+  ctx_slot_bits = 0;
+  while ((1u << ctx_slot_bits) < num_contexts) ctx_slot_bits ++;
+
+  ctx_pool = malloc(num_contexts * sizeof(eval_context_t));
+  ctx_pool_stacks = malloc(num_contexts * stack_size * sizeof(UINT));
+  ctx_sleeping = malloc(num_contexts * sizeof(eval_context_t *));
+  if (!ctx_pool || !ctx_pool_stacks || !ctx_sleeping) {
+    eval_cps_del();
+    return 0;
+  }
+  ctx_pool_size = num_contexts;
+  ctx_pool_stack_size = stack_size;
+  ctx_sleeping_num = 0;
+
+  event_queue_init();
+  atomic_init(&eval_loop_active, false);
+  atomic_init(&pause_request, false);
+  atomic_init(&paused, false);
+
+  ctx_free = NULL;
+  for (unsigned int i = num_contexts; i > 0; i --) {
+    ctx_pool[i-1].id = (CID)(i-1); // generation 0, the first CID has 1
+    ctx_pool[i-1].used = false;
+    atomic_init(&ctx_pool[i-1].slot_id, ctx_pool[i-1].id);
+    atomic_init(&ctx_pool[i-1].done_id, 0);
+    atomic_init(&ctx_pool[i-1].done_r, NIL);
+    ctx_pool[i-1].next = ctx_free;
+    ctx_free = &ctx_pool[i-1];
+  }
+
   eval_running = true;
 
   return res;
@@ -1099,4 +1893,16 @@ int eval_cps_init() {
 
 void eval_cps_del(void) {
   stack_free(&ctx_non_concurrent.K);
+  free(ctx_pool);
+  free(ctx_pool_stacks);
+  free(ctx_sleeping);
+  ctx_pool = NULL;
+  ctx_pool_stacks = NULL;
+  ctx_sleeping = NULL;
+  ctx_pool_size = 0;
+  ctx_free = NULL;
+  free(held);
+  held = NULL;
+  held_num = 0;
+  held_size = 0;
 }
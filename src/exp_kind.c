@@ -38,6 +38,22 @@ exp_kind exp_kind_of(VALUE exp) {
     if (type_of(head) == VAL_TYPE_SYMBOL) {
       UINT sym_id = dec_sym(head);
 
+      if (sym_id >= DEF_REPR_AN_FIRST &&
+	  sym_id <= DEF_REPR_AN_LAST) {
+	switch (sym_id) {
+	case DEF_REPR_AN_CONST:  return EXP_CONSTANT;
+	case DEF_REPR_AN_GLOBAL: return EXP_GLOBAL;
+	case DEF_REPR_AN_APP:    return EXP_ANALYSED_APPLICATION;
+	case DEF_REPR_AN_IF:     return EXP_IF;
+	case DEF_REPR_AN_LET:    return EXP_LET;
+	case DEF_REPR_AN_LAMBDA: return EXP_LAMBDA;
+	case DEF_REPR_AN_PROGN:  return EXP_PROGN;
+	case DEF_REPR_AN_DEFINE: return EXP_DEFINE;
+	case DEF_REPR_AN_AND:    return EXP_AND;
+	case DEF_REPR_AN_OR:     return EXP_OR;
+	}
+      }
+
       if (sym_id == symrepr_and())
 	return EXP_AND;
       if (sym_id == symrepr_or())
@@ -21,50 +21,73 @@
 #include <string.h>
 
 #include "extensions.h"
+#include "instance.h"
 
-typedef struct s_extension_function{
-  VALUE sym;
-  extension_fptr ext_fun;
-  struct s_extension_function* next;
-} extension_function_t;
+/* Extensions are stored in an open addressing hash table keyed by
+   symbol id. Symbol ids are handed out in sequence, so the low bits
+   of the id are used as the hash. The table is kept at most half
+   full, a lookup (done for every symbol that is evaluated) then
+   mostly probes one or two slots. */
+#define EXTENSION_TABLE_MIN_SIZE 16
 
-extension_function_t* extensions = NULL;
+#define extension_table      (instance_current()->extensions.table)
+#define extension_table_size (instance_current()->extensions.table_size)
+#define extension_num        (instance_current()->extensions.num)
+
+static extension_t *find_slot(extension_t *table, UINT size, UINT sym) {
+  UINT mask = size - 1;
+  UINT i = sym & mask;
+  while (table[i].fptr && table[i].sym != sym) {
+    i = (i + 1) & mask;
+  }
+  return &table[i];
+}
 
 extension_fptr extensions_lookup(UINT sym) {
-  extension_function_t *t = extensions;
-  while (t != NULL) {
-    if (t->sym == sym) {
-      return t->ext_fun;
+  if (sym < MAX_SPECIAL_SYMBOLS || extension_num == 0) {
+    return NULL;
+  }
+  return find_slot(extension_table, extension_table_size, sym)->fptr;
+}
+
+static bool grow(void) {
+  UINT size = extension_table_size ? extension_table_size * 2 : EXTENSION_TABLE_MIN_SIZE;
+  extension_t *table = calloc(size, sizeof(extension_t));
+
+  if (!table) return false;
+
+  for (UINT i = 0; i < extension_table_size; i ++) {
+    if (extension_table[i].fptr) {
+      *find_slot(table, size, extension_table[i].sym) = extension_table[i];
     }
-    t = t->next;
   }
-  return NULL;
+  free(extension_table);
+  extension_table = table;
+  extension_table_size = size;
+  return true;
 }
 
 bool extensions_add(char *sym_str, extension_fptr ext) {
-  VALUE symbol;
+  UINT symbol;
   int res = symrepr_addsym(sym_str, &symbol);
 
-  if (!res) return false;
+  if (!res || symbol < MAX_SPECIAL_SYMBOLS || !ext) return false;
 
-  extension_function_t *extension = malloc(sizeof(extension_function_t));
-
-  if (!extension) return false;
+  if (2 * (extension_num + 1) > extension_table_size &&
+      !grow()) {
+    return false;
+  }
 
-  extension->sym = symbol;
-  extension->ext_fun = ext;
-  extension->next = extensions;
-  extensions = extension;
+  extension_t *slot = find_slot(extension_table, extension_table_size, symbol);
+  if (!slot->fptr) extension_num ++;
+  slot->sym = symbol;
+  slot->fptr = ext;
   return true;
 }
 
 void extensions_del(void) {
-  extension_function_t *curr = extensions;
-  extension_function_t *t;
-  while (curr) {
-    t = curr;
-    curr = curr->next;
-    free(t);
-  }
-  extensions = NULL;
+  free(extension_table);
+  extension_table = NULL;
+  extension_table_size = 0;
+  extension_num = 0;
 }
@@ -25,51 +25,40 @@
 
 static UINT as_i(UINT a) {
 
-  UINT tmp;
-  FLOAT f_tmp;
-
   switch (type_of(a)) {
   case VAL_TYPE_I:
     return dec_i(a);
   case VAL_TYPE_U:
     return (INT) dec_u(a);
   case PTR_TYPE_BOXED_I:
+    return dec_I(a);
   case PTR_TYPE_BOXED_U:
-    return (INT)car(a);
+    return (INT)dec_U(a);
   case PTR_TYPE_BOXED_F:
-    tmp = car(a);
-    memcpy(&f_tmp, &tmp, sizeof(FLOAT));
-    return (INT)f_tmp;
+    return (INT)dec_f(a);
   }
   return 0;
 }
 
 static UINT as_u(UINT a) {
 
-  UINT tmp;
-  FLOAT f_tmp;
-
   switch (type_of(a)) {
   case VAL_TYPE_I:
     return (UINT) dec_i(a);
   case VAL_TYPE_U:
     return dec_u(a);
   case PTR_TYPE_BOXED_I:
+    return (UINT)dec_I(a);
   case PTR_TYPE_BOXED_U:
-    return (UINT)car(a);
+    return dec_U(a);
   case PTR_TYPE_BOXED_F:
-    tmp = car(a);
-    memcpy(&f_tmp, &tmp, sizeof(FLOAT));
-    return (UINT)f_tmp;
+    return (UINT)dec_f(a);
   }
   return 0;
 }
 
 static UINT as_f(UINT a) {
 
-  UINT tmp;
-  FLOAT f_tmp;
-
   switch (type_of(a)) {
   case VAL_TYPE_I:
     return (FLOAT) dec_i(a);
@@ -77,11 +66,9 @@ static UINT as_f(UINT a) {
     return (FLOAT)dec_u(a);
   case PTR_TYPE_BOXED_I:
   case PTR_TYPE_BOXED_U:
-    return (FLOAT)car(a);
+    return (FLOAT)dec_U(a);
   case PTR_TYPE_BOXED_F:
-    tmp = car(a);
-    memcpy(&f_tmp, &tmp, sizeof(FLOAT));
-    return f_tmp;
+    return dec_f(a);
   }
   return 0;
 }
@@ -417,7 +404,7 @@ static bool array_equality(VALUE a, VALUE b) {
 	if (memcmp((char*)a_+8, (char*)b_+8, a_->size) == 0) return true;
 	break;
       case PTR_TYPE_BOXED_F:
-	if (memcmp((char*)a_+8, (char*)b_+8, a_->size * sizeof(FLOAT)) == 0) return true;
+	if (memcmp((char*)a_+8, (char*)b_+8, a_->size * sizeof(UINT)) == 0) return true;
 	break;
       default:
 	break; 
@@ -429,6 +416,16 @@ static bool array_equality(VALUE a, VALUE b) {
 
 static bool struct_eq(VALUE a, VALUE b) {
 
+  switch (type_of(a)) {
+  case PTR_TYPE_BOXED_I:
+  case PTR_TYPE_BOXED_U:
+  case PTR_TYPE_BOXED_F:
+    return (type_of(a) == type_of(b) &&
+	    boxed_bits(a) == boxed_bits(b));
+  default:
+    break;
+  }
+
   if (!is_ptr(a) && !is_ptr(b)) {
     if (val_type(a) == val_type(b)){
       switch (val_type(a)) {
@@ -457,12 +454,6 @@ static bool struct_eq(VALUE a, VALUE b) {
       case PTR_TYPE_CONS:
 	return ( struct_eq(car(a),car(b)) &&
 		 struct_eq(cdr(a),cdr(b)) );
-      case PTR_TYPE_BOXED_I:
-	return ((INT)car(a) == (INT)car(b));
-      case PTR_TYPE_BOXED_U:
-	return (car(a) == car(b));
-      case PTR_TYPE_BOXED_F:
-	return ((FLOAT)car(a) == (FLOAT)car(b));
       case PTR_TYPE_ARRAY:
 	return array_equality(a, b);
       default:
@@ -593,26 +584,24 @@ void array_read(VALUE *args, UINT nargs, UINT *result) {
       *result = enc_char((UINT) ((char*)array+8)[ix]);
       break;
     case VAL_TYPE_U:
-      *result = enc_u(((UINT*)array + 2)[ix]);
+      *result = enc_u(((UINT*)((char*)array + 8))[ix]);
       break;
     case VAL_TYPE_I:
-      *result = enc_i(((INT*)array + 2)[ix]);
+      *result = enc_i(((INT*)((char*)array + 8))[ix]);
       break;
     case PTR_TYPE_BOXED_U:
-      *result = cons(((UINT*)array + 2)[ix], enc_sym(DEF_REPR_BOXED_U_TYPE));
-      if (type_of(*result) == VAL_TYPE_SYMBOL) return;
-      *result = set_ptr_type(*result, PTR_TYPE_BOXED_U);
+      *result = enc_U(((UINT*)((char*)array + 8))[ix]);
       break;
     case PTR_TYPE_BOXED_I:
-      *result = cons(((INT*)array + 2)[ix], enc_sym(DEF_REPR_BOXED_I_TYPE));
-      if (type_of(*result) == VAL_TYPE_SYMBOL) return;
-      *result = set_ptr_type(*result, PTR_TYPE_BOXED_I);
+      *result = enc_I(((INT*)((char*)array + 8))[ix]);
       break;
-    case PTR_TYPE_BOXED_F:
-      *result = cons(((UINT*)array+2)[ix], enc_sym(DEF_REPR_BOXED_F_TYPE));
-      if (type_of(*result) == VAL_TYPE_SYMBOL) return;
-      *result = set_ptr_type(*result, PTR_TYPE_BOXED_F);
+    case PTR_TYPE_BOXED_F: {
+      FLOAT f;
+      uint32_t bits = (uint32_t)((UINT*)((char*)array + 8))[ix];
+      memcpy(&f, &bits, sizeof(FLOAT));
+      *result = enc_F(f);
       break;
+    }
     default:
       *result = enc_sym(symrepr_eerror());
       return;
@@ -642,10 +631,10 @@ void array_write(VALUE *args, UINT nargs, UINT *result) {
     ix = (UINT) tmp;
     break;
   case PTR_TYPE_BOXED_U:
-    ix = car(index);
+    ix = dec_U(index);
     break;
   case PTR_TYPE_BOXED_I:
-    tmp = (INT)car(index);
+    tmp = dec_I(index);
     if (tmp < 0) {
       *result = enc_sym(symrepr_eerror());
       return;
@@ -673,30 +662,28 @@ void array_write(VALUE *args, UINT nargs, UINT *result) {
       break;
     }
     case VAL_TYPE_U: {
-      UINT* data = (UINT*)array + 2;
+      UINT* data = (UINT*)((char*)array + 8);
       data[ix] = dec_u(val);
       break;
     }
     case VAL_TYPE_I: {
-      INT *data = (INT*)array + 2;
+      INT *data = (INT*)((char*)array + 8);
       data[ix] = dec_i(val);
       break;
     }
     case PTR_TYPE_BOXED_U: {
-      UINT *data = (UINT*)array + 2;
+      UINT *data = (UINT*)((char*)array + 8);
       data[ix] = dec_U(val);
       break;
     }
     case PTR_TYPE_BOXED_I: {
-      INT *data = (INT*)array + 2;
+      INT *data = (INT*)((char*)array + 8);
       data[ix] = dec_I(val);
       break;
     }
     case PTR_TYPE_BOXED_F: {
-      //uv = car(val);
-      //memcpy(&v, &uv, sizeof(FLOAT));
-      UINT *data = (UINT*)array + 2;
-      data[ix] = car(val);
+      UINT *data = (UINT*)((char*)array + 8);
+      data[ix] = boxed_bits(val);
       break;
     }
     default:
@@ -24,14 +24,16 @@
 #include "symrepr.h"
 #include "stack.h"
 #include "memory.h"
+#include "bytecode.h"
+#include "instance.h"
 #ifdef VISUALIZE_HEAP
 #include "heap_vis.h"
 #endif
 
-static heap_state_t heap_state;
+#define heap_state (instance_current()->heap)
 
-static VALUE        NIL;
-static VALUE        RECOVERED;
+#define NIL        enc_sym(DEF_REPR_NIL)
+#define RECOVERED  enc_sym(DEF_REPR_RECOVERED)
 
 // ref_cell: returns a reference to the cell addressed by bits 3 - 26
 //           Assumes user has checked that is_ptr was set
@@ -110,9 +112,6 @@ static void heap_init_state(cons_t *addr, unsigned int num_cells, bool malloced)
 
 int heap_init_addr(cons_t *addr, unsigned int num_cells) {
 
-  NIL = enc_sym(symrepr_nil());
-  RECOVERED = enc_sym(DEF_REPR_RECOVERED);
-
   heap_init_state(addr, num_cells, false);
 
   return generate_freelist(num_cells);
@@ -120,9 +119,6 @@ int heap_init_addr(cons_t *addr, unsigned int num_cells) {
 
 int heap_init(unsigned int num_cells) {
 
-  NIL = enc_sym(symrepr_nil());
-  RECOVERED = enc_sym(DEF_REPR_RECOVERED);
-
   cons_t *heap = (cons_t *)malloc(num_cells * sizeof(cons_t));
 
   if (!heap) return 0;
@@ -134,6 +130,7 @@ int heap_init(unsigned int num_cells) {
 void heap_del(void) {
   if (heap_state.heap && heap_state.malloced)
     free(heap_state.heap);
+  heap_state.heap = NULL;
 }
 
 unsigned int heap_num_free(void) {
@@ -256,6 +253,21 @@ int gc_mark_phase(VALUE env) {
 	t_ptr == PTR_TYPE_ARRAY) {
       continue;
     }
+
+    // A bytecode object keeps its constants alive, a code address its object.
+    if (t_ptr == PTR_TYPE_BYTECODE) {
+      cons_t *cell = ref_cell(curr);
+      if (type_of(read_cdr(cell)) == VAL_TYPE_SYMBOL &&
+	  dec_sym(read_cdr(cell)) == DEF_REPR_BYTECODE_TYPE) {
+	bytecode_t *bc = (bytecode_t*)read_car(cell);
+	for (unsigned int i = 0; i < bc->num_constants; i ++) {
+	  if (!gc_mark_phase(bc->constants[i])) return 0;
+	}
+      } else {
+	if (!push_u32(&s, read_car(cell))) return 0;
+      }
+      continue;
+    }
     res &= push_u32(&s, cdr(curr));
     res &= push_u32(&s, car(curr));
 
@@ -308,7 +320,8 @@ int gc_mark_aux(UINT *aux_data, unsigned int aux_size) {
 	    pt_t == PTR_TYPE_BOXED_F ||
 	    pt_t == PTR_TYPE_ARRAY ||
 	    pt_t == PTR_TYPE_REF ||
-	    pt_t == PTR_TYPE_STREAM) &&
+	    pt_t == PTR_TYPE_STREAM ||
+	    pt_t == PTR_TYPE_BYTECODE) &&
 	   pt_v < heap_state.heap_size) {
 
 	gc_mark_phase(aux_data[i]);
@@ -338,6 +351,11 @@ int gc_sweep_phase(void) {
 	heap_state.gc_recovered_arrays++;
       }
 
+      if (type_of(heap[i].cdr) == VAL_TYPE_SYMBOL &&
+	  dec_sym(heap[i].cdr) == DEF_REPR_BYTECODE_TYPE) {
+	bytecode_free((bytecode_t*)heap[i].car);
+      }
+
       // create pointer to use as new freelist
       UINT addr = enc_cons_ptr(i);
 
@@ -528,7 +546,7 @@ int heap_allocate_array(VALUE *res, unsigned int size, TYPE type){
       allocate_size = (size >> 2) + 1;
     }
   } else {
-    allocate_size = size;
+    allocate_size = size * (sizeof(UINT) / 4);
   }
 
   array = (array_header_t*)memory_allocate(2 + allocate_size);
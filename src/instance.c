@@ -0,0 +1,54 @@
+/*
+    Copyright 2020 Joel Svensson	svenssonjoel@yahoo.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+
+#include "instance.h"
+#include "symrepr.h"
+#include "heap.h"
+#include "extensions.h"
+#include "eval_cps.h"
+
+static instance_t instance_default;
+
+INSTANCE_THREAD_LOCAL instance_t *instance_bound = &instance_default;
+
+instance_t *instance_create(void) {
+  return calloc(1, sizeof(instance_t));
+}
+
+void instance_bind(instance_t *inst) {
+  instance_bound = inst ? inst : &instance_default;
+}
+
+void instance_destroy(instance_t *inst) {
+  if (inst == NULL || inst == &instance_default) return;
+
+  instance_t *prev = instance_bound;
+  instance_bound = inst;
+
+  eval_cps_del();
+  extensions_del();
+  symrepr_del();
+  heap_del();
+  if (inst->bytecode.vm_stack_ok) {
+    stack_free(&inst->bytecode.vm_stack);
+  }
+
+  instance_bound = (prev == inst) ? &instance_default : prev;
+  free(inst);
+}
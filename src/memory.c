@@ -20,6 +20,7 @@
 #include <stdio.h>
 
 #include "memory.h"
+#include "instance.h"
 
 /* Status bit patterns */
 #define FREE_OR_USED  0  //00b
@@ -34,19 +35,24 @@
 #define ALLOC_DONE           0xF00DF00D
 #define ALLOC_FAILED         0xDEADBEAF
 
-uint32_t *bitmap = NULL;
-uint32_t *memory = NULL;
-uint32_t memory_size;  // in 4 byte words
-uint32_t bitmap_size;  // in 4 byte words
-unsigned int memory_base_address = 0;
+/* Allocations start at a multiple of this many words, so that a block
+   can hold VALUEs */
+#define ALIGN_WORDS          (sizeof(UINT) / 4)
+
+/* State of the instance bound to the calling thread, see instance.h */
+#define bitmap              (instance_current()->mem.bitmap)
+#define memory              (instance_current()->mem.data)
+#define memory_size         (instance_current()->mem.data_size)
+#define bitmap_size         (instance_current()->mem.bitmap_size)
+#define memory_base_address (instance_current()->mem.base_address)
 
 int memory_init(unsigned char *data, uint32_t data_size,
 		unsigned char *bits, uint32_t bits_size) {
 
   if (data == NULL || bits == NULL) return 0;
 
-  if (((unsigned int)data % 4 != 0) || data_size != 16 * bits_size || data_size % 4 != 0 ||
-      ((unsigned int)bits % 4 != 0) || bits_size < 1 || bits_size % 4 != 0) {
+  if (((uintptr_t)data % (4 * ALIGN_WORDS) != 0) || data_size != 16 * bits_size || data_size % 4 != 0 ||
+      ((uintptr_t)bits % 4 != 0) || bits_size < 1 || bits_size % 4 != 0) {
     // data is not 4 byte aligned
     // size is too small
     // or size is not a multiple of 4
@@ -61,17 +67,17 @@ int memory_init(unsigned char *data, uint32_t data_size,
   }
 
   memory = (uint32_t *) data;
-  memory_base_address = (unsigned int)data;
+  memory_base_address = (uintptr_t)data;
   memory_size = data_size >> 2;
   return 1;
 }
 
 static inline unsigned int address_to_bitmap_ix(uint32_t *ptr) {
-  return ((unsigned int)ptr - memory_base_address) >> 2;
+  return (unsigned int)(((uintptr_t)ptr - memory_base_address) >> 2);
 }
 
 static inline uint32_t *bitmap_ix_to_address(unsigned int ix) {
-  return (uint32_t*)(memory_base_address + (ix << 2));
+  return (uint32_t*)(memory_base_address + ((uintptr_t)ix << 2));
 }
 
 static inline unsigned int status(unsigned int i) {
@@ -159,6 +165,7 @@ uint32_t *memory_allocate(uint32_t num_words) {
     case FREE_OR_USED:
       switch (state) {
       case INIT:
+	if (i % ALIGN_WORDS != 0) break;
 	start_ix = i;
 	if (num_words == 1) {
 	  end_ix = i;
@@ -155,24 +155,27 @@ int print_value(char *buf,int len, char *error, int len_error, VALUE t) {
 	offset += n;
 	break;
 
+      case PTR_TYPE_BYTECODE:
+	n = snprintf(buf + offset, len - offset, "_bytecode_");
+	offset += n;
+	break;
+
       case PTR_TYPE_BOXED_F: {
-	VALUE uv = car(curr);
-	float v;
-	memcpy(&v, &uv, sizeof(float)); // = *(float*)(&uv);
+	float v = dec_f(curr);
 	n = snprintf(buf + offset, len - offset, "{%"PRI_FLOAT"}", v);
 	offset += n;
 	break;
       }
 	
       case PTR_TYPE_BOXED_U: {
-	VALUE v = car(curr);
+	UINT v = dec_U(curr);
 	n = snprintf(buf + offset, len - offset, "{%"PRI_UINT"}", v);
 	offset += n;
 	break;
       }
 	
       case PTR_TYPE_BOXED_I: {
-	int32_t v = (int32_t)car(curr);
+	INT v = dec_I(curr);
 	n = snprintf(buf + offset, len - offset, "{%"PRI_INT"}", v);
 	offset += n;
 	break;
@@ -226,7 +229,7 @@ int print_value(char *buf,int len, char *error, int len_error, VALUE t) {
 	break;
 	
       default:
-	snprintf(error, len_error, "Error: print does not recognize type of value: %"PRIx32"", curr);
+	snprintf(error, len_error, "Error: print does not recognize type of value: %"PRI_HEX"", curr);
 	return -1;
 	break;
       } // Switch type of curr
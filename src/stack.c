@@ -27,6 +27,9 @@ int stack_allocate(stack *s, unsigned int stack_size, bool growable) {
   s->sp = 0;
   s->size = stack_size;
   s->growable = growable;
+  s->seg = NULL;
+  s->spare = NULL;
+  s->seg_size = stack_size;
 
   if (s->data) return 1;
   return 0;
@@ -37,91 +40,148 @@ int stack_create(stack *s, UINT* data, unsigned int size) {
   s->sp = 0;
   s->size = size;
   s->growable = false;
+  s->seg = NULL;
+  s->spare = NULL;
+  s->seg_size = size;
   return 1;
 }
 
+static stack_segment_t *stack_new_segment(stack *s, unsigned int size) {
+  stack_segment_t *seg = s->spare;
+  if (seg && seg->size >= size) {
+    s->spare = NULL;
+    return seg;
+  }
+  seg = malloc(sizeof(stack_segment_t) + sizeof(UINT) * size);
+  if (seg) seg->size = size;
+  return seg;
+}
+
+static void stack_link_segment(stack *s, stack_segment_t *seg) {
+  seg->prev = s->seg;
+  seg->prev_data = s->data;
+  seg->prev_sp = s->sp;
+  seg->prev_size = s->size;
+  s->seg = seg;
+  s->data = seg->data;
+  s->sp = 0;
+  s->size = seg->size;
+}
+
+/* Unlink the top segment, it is kept as spare */
+static void stack_pop_segment(stack *s) {
+  stack_segment_t *seg = s->seg;
+  s->seg = seg->prev;
+  s->data = seg->prev_data;
+  s->sp = seg->prev_sp;
+  s->size = seg->prev_size;
+  free(s->spare);
+  s->spare = seg;
+}
+
 void stack_free(stack *s) {
+  stack_clear(s);
   if (s->data) {
     free(s->data);
   }
 }
 
+/* Also frees all segments, the stack is back at its base */
 int stack_clear(stack *s) {
+  while (s->seg) {
+    stack_pop_segment(s);
+  }
+  free(s->spare);
+  s->spare = NULL;
   s->sp = 0;
   return 1;
 }
 
-
-int stack_grow(stack *s) {
+static int stack_grow(stack *s) {
 
   if (!s->growable) return 0;
-  
-  unsigned int new_size = s->size * 2;
-  UINT *data    = malloc(sizeof(UINT) * new_size);
-
-  if (data == NULL) return 0;
 
-  memcpy(data, s->data, s->size*sizeof(UINT));
-  free(s->data);
-  s->data = data;
-  s->size = new_size;
+  stack_segment_t *seg = stack_new_segment(s, s->seg_size);
+  if (seg == NULL) return 0;
+  stack_link_segment(s, seg);
   return 1;
 }
 
 int stack_copy(stack *dest, stack *src) {
 
-  if (dest->growable) {
-    while (dest->size < src->sp) {
-      if (!stack_grow(dest)) return 0;
-    }
-  }
-  if (dest->size < src->size) return 0;
+  if (src->seg) return 0;
+  if (dest->size < src->sp) return 0;
   dest->sp = src->sp;
   memcpy(dest->data, src->data, src->sp * sizeof(UINT));
 
   return 1;
 }
 
+void stack_foreach_segment(stack *s, stack_data_fptr f) {
+  f(s->data, s->sp);
+  for (stack_segment_t *seg = s->seg; seg; seg = seg->prev) {
+    f(seg->prev_data, seg->prev_sp);
+  }
+}
+
+/* The n top elements as an array. If they are spread over several
+   segments they are moved to a new top segment first. */
 UINT *stack_ptr(stack *s, unsigned int n) {
-  if (n > s->sp) return NULL;
-  int index = s->sp - n;
-  return &s->data[index]; 
+  if (n <= s->sp) return &s->data[s->sp - n];
+
+  unsigned int num = s->sp;
+  for (stack_segment_t *seg = s->seg; seg && num < n; seg = seg->prev) {
+    num += seg->prev_sp;
+  }
+  if (num < n) return NULL;
+
+  stack_segment_t *top = stack_new_segment(s, n + s->seg_size);
+  if (top == NULL) return NULL;
+
+  for (unsigned int i = n; i > 0; i --) {
+    while (s->sp == 0) {
+      stack_pop_segment(s);
+    }
+    top->data[i-1] = s->data[--s->sp];
+  }
+  stack_link_segment(s, top);
+  s->sp = n;
+  return s->data;
 }
 
 int stack_drop(stack *s, unsigned int n) {
 
-  if (n > s->sp) return 0;
-
+  while (n > s->sp) {
+    if (!s->seg) return 0;
+    n -= s->sp;
+    s->sp = 0;
+    stack_pop_segment(s);
+  }
   s->sp -= n;
   return 1;
 }
 
 int push_u32(stack *s, UINT val) {
-  int res = 1;
   if (s->sp == s->size) {
-    res = stack_grow(s);
+    if (!stack_grow(s)) return 0;
   }
 
-  if (!res) return res;
-  
   s->data[s->sp] = val;
   s->sp++;
 
-  return res;
+  return 1;
 }
 
 int push_k(stack *s, VALUE (*k)(VALUE)) {
-  int res = 1;
-  s->data[s->sp] = (UINT)k;
-  s->sp++;
-  if ( s->sp >= s->size) {
-    res = stack_grow(s);
-  }
-  return res;
+  return push_u32(s, (UINT)k);
 }
 
 int pop_u32(stack *s, UINT *val) {
 
+  while (s->sp == 0) {
+    if (!s->seg) return 0;
+    stack_pop_segment(s);
+  }
   s->sp--;
   *val = s->data[s->sp];
 
@@ -129,7 +189,8 @@ int pop_u32(stack *s, UINT *val) {
 }
 
 int pop_k(stack *s, VALUE (**k)(VALUE)) {
-  s->sp--;
-  *k = (VALUE (*)(VALUE))s->data[s->sp];
+  UINT v;
+  if (!pop_u32(s, &v)) return 0;
+  *k = (VALUE (*)(VALUE))v;
   return 1;
 }
@@ -20,15 +20,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <ctype.h>
 
 #include "symrepr.h"
 #include "memory.h"
-
-#define NUM_SPECIAL_SYMBOLS 67
+#include "instance.h"
 
 #define NAME   0
 #define ID     1
 #define NEXT   2
+#define HNEXT  3   // next in the same hash bucket
+#define NODE_SIZE 4
+
+#define NO_SPECIAL 0xFF
 
 typedef struct {
   const char *name;
@@ -65,6 +69,16 @@ special_sym const special_symbols[NUM_SPECIAL_SYMBOLS] =  {
   {"sym_bytecode"       , DEF_REPR_BYTECODE_TYPE},
   {"sym_nonsense"       , DEF_REPR_NONSENSE},
   {"variable_not_bound" , DEF_REPR_NOT_FOUND},
+  {"an_const"           , DEF_REPR_AN_CONST},
+  {"an_global"          , DEF_REPR_AN_GLOBAL},
+  {"an_app"             , DEF_REPR_AN_APP},
+  {"an_if"              , DEF_REPR_AN_IF},
+  {"an_let"             , DEF_REPR_AN_LET},
+  {"an_lambda"          , DEF_REPR_AN_LAMBDA},
+  {"an_progn"           , DEF_REPR_AN_PROGN},
+  {"an_define"          , DEF_REPR_AN_DEFINE},
+  {"an_and"             , DEF_REPR_AN_AND},
+  {"an_or"              , DEF_REPR_AN_OR},
   
   // special symbols with parseable names
   {"type-list"        , DEF_REPR_TYPE_LIST},
@@ -94,6 +108,9 @@ special_sym const special_symbols[NUM_SPECIAL_SYMBOLS] =  {
   {"yield"          , SYM_YIELD},
   {"wait"           , SYM_WAIT},
   {"spawn"          , SYM_SPAWN},
+  {"send"           , SYM_SEND},
+  {"recv"           , SYM_RECV},
+  {"self"           , SYM_SELF},
   {"num-eq"         , SYM_NUMEQ},
   {"car"            , SYM_CAR},
   {"cdr"            , SYM_CDR},
@@ -113,32 +130,79 @@ special_sym const special_symbols[NUM_SPECIAL_SYMBOLS] =  {
 };
 
 
-uint32_t *symlist = NULL;
-UINT next_symbol_id = 0;
+#define symlist         (instance_current()->symrepr.symlist)
+#define next_symbol_id  (instance_current()->symrepr.next_symbol_id)
+#define buckets         (instance_current()->symrepr.buckets)
+#define special_buckets (instance_current()->symrepr.special_buckets)
+#define special_next    (instance_current()->symrepr.special_next)
+
+/*
+   Names are found through a hash table. The hash ignores case so
+   that the parser can look up a slice of its input, in lower case,
+   without copying it. Special symbols are chained by index, symbols
+   in memory through the HNEXT field of their node.
+*/
+static uint32_t sym_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i ++) {
+    h = (h ^ (uint32_t)tolower((unsigned char)name[i])) * 16777619u;
+  }
+  return h & (SYMREPR_HASH_SIZE - 1);
+}
+
+static bool sym_eq(const char *str, const char *name, size_t len, bool lower) {
+  for (size_t i = 0; i < len; i ++) {
+    char c = lower ? (char)tolower((unsigned char)name[i]) : name[i];
+    if (str[i] != c) return false;
+  }
+  return str[len] == 0;
+}
 
 bool symrepr_init(void) {
+  memset(special_buckets, NO_SPECIAL, sizeof(special_buckets));
+  for (int i = NUM_SPECIAL_SYMBOLS - 1; i >= 0; i --) {
+    const char *name = special_symbols[i].name;
+    uint32_t h = sym_hash(name, strlen(name));
+    special_next[i] = special_buckets[h];
+    special_buckets[h] = (uint8_t)i;
+  }
+
+  for (int i = 0; i < SYMREPR_HASH_SIZE; i ++) {
+    buckets[i] = NULL;
+  }
+  for (uintptr_t *curr = symlist; curr; curr = (uintptr_t*)curr[NEXT]) {
+    const char *name = (const char *)curr[NAME];
+    uint32_t h = sym_hash(name, strlen(name));
+    curr[HNEXT] = (uintptr_t)buckets[h];
+    buckets[h] = curr;
+  }
   return true;
 }
 
 void symrepr_del(void) {
 
-  uint32_t *curr = symlist;
+  uintptr_t *curr = symlist;
   while (curr) {
-    uint32_t *tmp = curr; 
-    curr = (uint32_t*)curr[NEXT];
+    uintptr_t *tmp = curr; 
+    curr = (uintptr_t*)curr[NEXT];
     memory_free((uint32_t*)tmp[NAME]);
-    memory_free(tmp);
+    memory_free((uint32_t*)tmp);
+  }
+  symlist = NULL;
+  next_symbol_id = 0;
+  for (int i = 0; i < SYMREPR_HASH_SIZE; i ++) {
+    buckets[i] = NULL;
   }
 }
 
 const char *lookup_symrepr_name_memory(UINT id) {
 
-  uint32_t *curr = symlist;
+  uintptr_t *curr = symlist;
   while (curr) {
     if (id == curr[ID]) {
       return (const char *)curr[NAME];
     }
-    curr = (uint32_t*)curr[NEXT];
+    curr = (uintptr_t*)curr[NEXT];
   }
   return NULL;
 }
@@ -155,81 +219,89 @@ const char *symrepr_lookup_name(UINT id) {
   return lookup_symrepr_name_memory(id);
 }
 
-// Lookup symbol id given symbol name
-int symrepr_lookup(char *name, UINT* id) {
+static int lookup(const char *name, size_t len, bool lower, UINT *id) {
+  uint32_t h = sym_hash(name, len);
 
-  // loop through special symbols
-  for (int i = 0; i < NUM_SPECIAL_SYMBOLS; i ++) {
-    if (strcmp(name, special_symbols[i].name) == 0) {
+  for (uint8_t i = special_buckets[h]; i != NO_SPECIAL; i = special_next[i]) {
+    if (sym_eq(special_symbols[i].name, name, len, lower)) {
       *id = special_symbols[i].id;
       return 1;
     }
   }
 
-  uint32_t *curr = symlist;
-  while (curr) {
-    char *str = (char*)curr[NAME];
-    if (strcmp(name, str) == 0) {
+  for (uintptr_t *curr = buckets[h]; curr; curr = (uintptr_t*)curr[HNEXT]) {
+    if (sym_eq((const char*)curr[NAME], name, len, lower)) {
       *id = curr[ID];
       return 1;
     }
-    curr = (uint32_t*)curr[NEXT];
   }
   return 0;
 }
 
-int symrepr_addsym(char *name, UINT* id) {
-  size_t  n = 0;
-
-  n = strlen(name) + 1;
+static int addsym(const char *name, size_t len, bool lower, UINT *id) {
+  size_t n = len + 1;
   if (n == 1) return 0; // failure if empty symbol
 
-  uint32_t *m = memory_allocate(3);
+  uintptr_t *m = (uintptr_t*)memory_allocate(NODE_SIZE * sizeof(uintptr_t) / 4);
 
   if (m == NULL) {
     return 0;
   }
 
-  char *symbol_name_storage = NULL;;
-  if (n % 4 == 0) {
-    symbol_name_storage = (char *)memory_allocate(n);
-  } else {
-    symbol_name_storage = (char *)memory_allocate(n);
-  }
+  char *symbol_name_storage = (char *)memory_allocate((uint32_t)((n + 3) / 4));
 
   if (symbol_name_storage == NULL) {
-    memory_free(m);
+    memory_free((uint32_t*)m);
     return 0;
   }
 
-  strcpy(symbol_name_storage, name);
-
-  m[NAME] = (uint32_t)symbol_name_storage;
-  
-  if (symlist == NULL) {
-    m[NEXT] = (uint32_t) NULL;
-    symlist = m;
-  } else {
-    m[NEXT] = (uint32_t) symlist;
-    symlist = m;
+  for (size_t i = 0; i < len; i ++) {
+    symbol_name_storage[i] = lower ? (char)tolower((unsigned char)name[i]) : name[i];
   }
+  symbol_name_storage[len] = 0;
+
+  m[NAME] = (uintptr_t)symbol_name_storage;
+  m[NEXT] = (uintptr_t) symlist;
+  symlist = m;
+
+  uint32_t h = sym_hash(name, len);
+  m[HNEXT] = (uintptr_t) buckets[h];
+  buckets[h] = m;
+
   m[ID] = MAX_SPECIAL_SYMBOLS + next_symbol_id++; 
   *id = m[ID];
   return 1;
 }
 
+// Lookup symbol id given symbol name
+int symrepr_lookup(char *name, UINT* id) {
+  return lookup(name, strlen(name), false, id);
+}
+
+int symrepr_lookup_lower(const char *name, unsigned int len, UINT *id) {
+  return lookup(name, len, true, id);
+}
+
+int symrepr_addsym(char *name, UINT* id) {
+  return addsym(name, strlen(name), false, id);
+}
+
+int symrepr_addsym_lower(const char *name, unsigned int len, UINT *id) {
+  return addsym(name, len, true, id);
+}
+
 unsigned int symrepr_size(void) {
 
   unsigned int n = 0;
-  uint32_t *curr = symlist;
+  uintptr_t *curr = symlist;
 
   while (curr) {
     // up to 3 extra bytes are used for string storage if length is not multiple of 4
     size_t s = strlen((char *)curr[NAME]);
     s ++;
-    n += s % 4;
-    n += 12; // sizeof the node in the linked list
-    curr = (uint32_t *)curr[NEXT];
+    n += (unsigned int)((s + 3) / 4 * 4);
+    n += NODE_SIZE * sizeof(uintptr_t); // sizeof the node in the linked list
+    curr = (uintptr_t *)curr[NEXT];
   }
   return n;
 }
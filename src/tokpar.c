@@ -17,7 +17,6 @@
 
 #include <stdbool.h>
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -29,6 +28,8 @@
 #include "qq_expand.h"
 #include "memory.h"
 #include "env.h"
+#include "stack.h"
+#include "eval_cps.h"
 
 #define TOKOPENPAR      0
 #define TOKCLOSEPAR     1
@@ -47,6 +48,8 @@
 #define TOKENIZER_ERROR 1024
 #define TOKENIZER_END   2048
 
+/* The text of a symbol or string token is a slice of the lookahead
+   window, valid until the next token is read */
 typedef struct {
 
   unsigned int type;
@@ -54,7 +57,7 @@ typedef struct {
   unsigned int text_len;
   union {
     char  c;
-    char  *text;
+    const char *text;
     INT   i;
     UINT  u;
     FLOAT f;
@@ -62,701 +65,873 @@ typedef struct {
 } token;
 
 
-typedef struct {
-  char *str;
-  unsigned int pos;
-} tokenizer_state;
-
-
-typedef struct tcs{
+/*
+   The tokenizer reads from a lookahead window. buf[pos] is the next
+   character and buf[len - 1] the last one that is available. fill is
+   called to make n characters available from pos and returns false if
+   the input ends first. A source that holds all of its input in memory
+   gives the whole input as the window.
+*/
+typedef struct tcs {
   void *state;
-  bool (*more)(struct tcs);
-  char (*get)(struct tcs);
-  char (*peek)(struct tcs, unsigned int);
-  void (*drop)(struct tcs, unsigned int);
+  const char *buf;
+  unsigned int pos;
+  unsigned int len;
+  bool (*fill)(struct tcs *str, unsigned int n);
 } tokenizer_char_stream;
 
-// Todo: Try to figure out how to do GC while reading
-static int gc() {
-  gc_state_inc();
-  gc_mark_freelist();
-  gc_mark_phase(*env_get_global_ptr());
-  return gc_sweep_phase();
-}
-
-bool more(tokenizer_char_stream str) {
-  return str.more(str);
-}
-
-char get(tokenizer_char_stream str) {
-  return str.get(str);
-}
-
-char peek(tokenizer_char_stream str, unsigned int n) {
-  return str.peek(str,n);
-}
-
-void drop(tokenizer_char_stream str, unsigned int n) {
-  str.drop(str,n);
-}
-
-int tok_openpar(tokenizer_char_stream str) {
-  if (peek(str,0) == '(') {
-    drop(str,1);
-    return 1;
-  }
-  return 0;
-}
-
-int tok_closepar(tokenizer_char_stream str) {
-  if (peek(str,0) == ')') {
-    drop(str,1);
-    return 1;
-  }
-  return 0;
+static inline bool more(tokenizer_char_stream *str) {
+  return str->pos < str->len || str->fill(str, 1);
 }
 
-int tok_quote(tokenizer_char_stream str) {
-  if (peek(str,0) == '\'') {
-    drop(str,1);
-    return 1;
+/* The character n positions ahead, 0 after the end of the input */
+static inline char peek(tokenizer_char_stream *str, unsigned int n) {
+  if (n < str->len - str->pos || str->fill(str, n + 1)) {
+    return str->buf[str->pos + n];
   }
   return 0;
 }
 
-int tok_backquote(tokenizer_char_stream str) {
-  if (peek(str,0) == '`') {
-    drop(str, 1);
-    return 1;
-  }
-  return 0;
+/* Only drop characters that have been peeked at */
+static inline void drop(tokenizer_char_stream *str, unsigned int n) {
+  str->pos += n;
 }
 
-int tok_commaat(tokenizer_char_stream str) {
-  if (peek(str,0) == ',' &&
-      peek(str,1) == '@') {
-    drop(str,2);
-    return 2;
-  }
-  return 0;
-} 
-
-int tok_comma(tokenizer_char_stream str) {
-  if (peek(str,0) == ',') {
-    drop(str, 1);
-    return 1;
-  }
-  return 0;
-}
+/* Character classes */
+#define CC_SPACE  0x01
+#define CC_SYM0   0x02  // may start a symbol
+#define CC_SYM    0x04
+#define CC_DIGIT  0x08
+#define CC_HEX    0x10
+#define CC_GRAPH  0x20
 
-bool symchar0(char c) {
-  const char *allowed = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ+-*/=<>";
+#define SP CC_SPACE
+#define PU CC_GRAPH
+#define DG (CC_SYM | CC_DIGIT | CC_HEX | CC_GRAPH)
+#define LH (CC_SYM0 | CC_SYM | CC_HEX | CC_GRAPH)
+#define LT (CC_SYM0 | CC_SYM | CC_GRAPH)
 
-  int i = 0;
-  while (allowed[i] != 0) {
-    if (c == allowed[i++]) return true;
-  }
-  return false;
-}
+static const uint8_t char_class_table[256] = {
+   0,  0,  0,  0,  0,  0,  0,  0,  0, SP, SP, SP, SP, SP,  0,  0,  // 0x00
+   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 0x10
+  SP, PU, PU, PU, PU, PU, PU, PU, PU, PU, LT, LT, PU, LT, PU, LT,  // 0x20
+  DG, DG, DG, DG, DG, DG, DG, DG, DG, DG, PU, PU, LT, LT, LT, PU,  // 0x30
+  PU, LH, LH, LH, LH, LH, LH, LT, LT, LT, LT, LT, LT, LT, LT, LT,  // 0x40
+  LT, LT, LT, LT, LT, LT, LT, LT, LT, LT, LT, PU, PU, PU, PU, PU,  // 0x50
+  PU, LH, LH, LH, LH, LH, LH, LT, LT, LT, LT, LT, LT, LT, LT, LT,  // 0x60
+  LT, LT, LT, LT, LT, LT, LT, LT, LT, LT, LT, PU, PU, PU, PU,  0,  // 0x70
+};
 
-bool symchar(char c) {
-  const char *allowed = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+-*/=<>";
+#undef SP
+#undef PU
+#undef DG
+#undef LH
+#undef LT
 
-  int i = 0;
-  while (allowed[i] != 0) {
-    if (c == allowed[i++]) return true;
-  }
-  return false;
+static inline unsigned int char_class(char c) {
+  return char_class_table[(unsigned char)c];
 }
 
-int tok_symbol(tokenizer_char_stream str, char** res) {
-
-  if (!symchar0(peek(str,0)))  return 0;
-
-  int i = 0;
-  int len = 1;
-  int n = 0;
+static unsigned int tok_symbol(tokenizer_char_stream *str, const char **res) {
 
-  while (symchar((peek(str,len)))) {
+  unsigned int len = 1;
+  while (char_class(peek(str, len)) & CC_SYM) {
     len++;
   }
 
-  *res = malloc(len+1);
-  if (*res == NULL) return -1;
-  memset(*res,0,len+1);
-
-  for (i = 0; i < len; i ++) {
-    (*res)[i] = tolower(get(str));
-    n++;
-  }
-  return n;
+  *res = str->buf + str->pos;
+  drop(str, len);
+  return len;
 }
 
-int tok_string(tokenizer_char_stream str, char **res) {
-
-  int i = 0;
-  int n = 0;
-  int len = 0;
-  if (!(peek(str,0) == '\"')) return 0;
+static unsigned int tok_string(tokenizer_char_stream *str, const char **res) {
 
-  get(str); // remove the " char
-  n++;
+  unsigned int len = 0;
+  char c;
 
   // compute length of string
-  while (peek(str,len) != 0 &&
-	 peek(str,len) != '\"') {
+  while ((c = peek(str, len + 1)) != 0 && c != '\"') {
     len++;
   }
 
   // str ends before tokenized string is closed.
-  if ((peek(str,len)) != '\"') {
+  if (c != '\"') {
     return 0;
   }
 
-  // allocate memory for result string
-  *res = malloc(len+1);
-  if (*res == NULL) return -1;
-  memset(*res, 0, len+1);
-
-  for (i = 0; i < len; i ++) {
-    (*res)[i] = get(str);
-    n++;
-  }
-
-  get(str);  // throw away the "
-  return (n+1);
+  *res = str->buf + str->pos + 1;
+  drop(str, len + 2);
+  return len + 2;
 }
 
-int tok_char(tokenizer_char_stream str, char *res) {
+static int tok_char(tokenizer_char_stream *str, char *res) {
+  const char *newline = "\\#newline";
 
-  int count = 0;
-  if (peek(str,0) == '\\' &&
-      peek(str,1) == '#' &&
-      peek(str,2) == 'n' &&
-      peek(str,3) == 'e' &&
-      peek(str,4) == 'w' &&
-      peek(str,5) == 'l' &&
-      peek(str,6) == 'i' &&
-      peek(str,7) == 'n' &&
-      peek(str,8) == 'e') {
+  unsigned int n = 1;
+  while (n < 9 && peek(str, n) == newline[n]) n++;
+  if (n == 9) {
     *res = '\n';
-    drop(str,9);
-    count = 9;
-  } else if (peek(str,0) == '\\' &&
-	     peek(str,1) == '#' &&
-	     isgraph(peek(str,2))) {
-    *res = peek(str,2);
-    drop(str,3);
-    count = 3;
+    drop(str, 9);
+    return 9;
   }
-  return count;
-}
-
-int tok_i(tokenizer_char_stream str, INT *res) {
-
-  INT acc = 0;
-  int n = 0;
-
-  while ( peek(str,n) >= '0' && peek(str,n) <= '9' ){
-    acc = (acc*10) + (peek(str,n) - '0');
-    n++;
-  }
-
-  // Not needed if strict adherence to ordering of calls to tokenizers.
-  if (peek(str,n) == 'U' ||
-      peek(str,n) == 'u' ||
-      peek(str,n) == '.' ||
-      peek(str,n) == 'I') return 0;
-
-  drop(str,n);
-  *res = acc;
-  return n;
-}
-
-int tok_I(tokenizer_char_stream str, INT *res) {
-  INT acc = 0;
-  int n = 0;
-
-  while ( peek(str,n) >= '0' && peek(str,n) <= '9' ){
-    acc = (acc*10) + (peek(str,n) - '0');
-    n++;
-  }
-
-  if (peek(str,n) == 'i' &&
-      peek(str,n+1) == '3' &&
-      peek(str,n+2) == '2') {
-    *res = acc;
-    drop(str,n+3);
-    return n+3;
+  if (peek(str, 1) == '#' &&
+      (char_class(peek(str, 2)) & CC_GRAPH)) {
+    *res = peek(str, 2);
+    drop(str, 3);
+    return 3;
   }
   return 0;
 }
 
-int tok_u(tokenizer_char_stream str, UINT *res) {
-  UINT acc = 0;
-  int n = 0;
-
-  while ( peek(str,n) >= '0' && peek(str,n) <= '9' ){
-    acc = (acc*10) + (peek(str,n) - '0');
-    n++;
-  }
-
-  if (peek(str,n) == 'u' &&
-      peek(str,n+1) == '2' &&
-      peek(str,n+2) == '8' ) {
-    *res = acc;
-    drop(str,n+3);
-    return n+3;
-  }
-  return 0;
+static inline bool tok_suffix(tokenizer_char_stream *str, unsigned int n,
+			      char c0, char c1) {
+  return peek(str, n) == c0 && peek(str, n + 1) == c1;
 }
 
-int tok_U(tokenizer_char_stream str, UINT *res) {
+/*
+   Numbers are read in one pass, the characters after the digits
+   decide the kind:
+     0x1F      hex, boxed unsigned
+     1.5       float (also .5)
+     12u28     unsigned
+     12u32     boxed unsigned
+     12i32     boxed integer
+     12        integer, unless followed by U, u, . or I
+*/
+static bool tok_number(tokenizer_char_stream *str, token *t) {
+  unsigned int n = 0;
   UINT acc = 0;
-  int n = 0;
-
-  // Check if hex notation is used
-  if (peek(str,0) == '0' &&
-      (peek(str,1) == 'x' || peek(str,1) == 'X')) {
-    n+= 2;
-    while ( (peek(str,n) >= '0' && peek(str,n) <= '9') ||
-	    (peek(str,n) >= 'a' && peek(str,n) <= 'f') ||
-	    (peek(str,n) >= 'A' && peek(str,n) <= 'F')){
-      UINT val;
-      if (peek(str,n) >= 'a' && peek(str,n) <= 'f') {
-	val = 10 + (peek(str,n) - 'a');
-      } else if (peek(str,n) >= 'A' && peek(str,n) <= 'F') {
-	val = 10 + (peek(str,n) - 'A');
-      } else {
-	val = peek(str,n) - '0';
-      }
+  char c;
+
+  if (peek(str, 0) == '0' &&
+      (peek(str, 1) == 'x' || peek(str, 1) == 'X')) {
+    n = 2;
+    while (char_class(c = peek(str, n)) & CC_HEX) {
+      UINT val = (c <= '9') ? (UINT)(c - '0') : (UINT)((c | 0x20) - 'a' + 10);
       acc = (acc * 0x10) + val;
       n++;
     }
-    *res = acc;
-    drop(str,n);
-    return n;
+    drop(str, n);
+    t->type = TOKBOXEDUINT;
+    t->data.u = acc;
+    return true;
   }
 
-  // check if nonhex
-  while ( peek(str,n) >= '0' && peek(str,n) <= '9' ){
-    acc = (acc*10) + (peek(str,n) - '0');
+  while (char_class(c = peek(str, n)) & CC_DIGIT) {
+    acc = (acc * 10) + (UINT)(c - '0');
     n++;
   }
 
-  if (peek(str,n) == 'u' &&
-      peek(str,n+1) == '3' &&
-      peek(str,n+2) == '2') {
-    *res = acc;
-    drop(str,n+3);
-    return n+3;
-  }
-  return 0;
-}
-
-int tok_F(tokenizer_char_stream str, FLOAT *res) {
-
-  int n = 0;
-  int m = 0;
-  char fbuf[256];
-
-  while ( peek(str,n) >= '0' && peek(str,n) <= '9') n++;
-
-  if ( peek(str,n) == '.') n++;
-  else return 0;
-
-  if ( !(peek(str,n) >= '0' && peek(str,n) <= '9')) return 0;
-  while ( peek(str,n) >= '0' && peek(str,n) <= '9') n++;
-
-  if (n > 255) m = 255;
-  else m = n;
-
-  int i;
-  for (i = 0; i < m; i ++) {
-    fbuf[i] = get(str);
+  switch (c) {
+  case '.': {
+    if (!(char_class(peek(str, n + 1)) & CC_DIGIT)) return false;
+    n += 2;
+    while (char_class(peek(str, n)) & CC_DIGIT) n++;
+
+    /* Longer literals are an error rather than read truncated */
+    char fbuf[256];
+    if (n >= sizeof(fbuf)) return false;
+    memcpy(fbuf, str->buf + str->pos, n);
+    fbuf[n] = 0;
+    drop(str, n);
+    t->type = TOKBOXEDFLOAT;
+    t->data.f = (FLOAT)strtod(fbuf, NULL);
+    return true;
+  }
+  case 'u':
+    if (n > 0 && tok_suffix(str, n + 1, '2', '8')) {
+      t->type = TOKUINT;
+    } else if (n > 0 && tok_suffix(str, n + 1, '3', '2')) {
+      t->type = TOKBOXEDUINT;
+    } else {
+      return false;
+    }
+    drop(str, n + 3);
+    t->data.u = acc;
+    return true;
+  case 'i':
+    if (n > 0 && tok_suffix(str, n + 1, '3', '2')) {
+      drop(str, n + 3);
+      t->type = TOKBOXEDINT;
+      t->data.i = (INT)acc;
+      return true;
+    }
+    break;
+  case 'U':
+  case 'I':
+    return false;
   }
 
-  fbuf[i] = 0;
-  *res = strtod(fbuf, NULL);
-  return n;
+  if (n == 0) return false;
+  drop(str, n);
+  t->type = TOKINT;
+  t->data.i = (INT)acc;
+  return true;
 }
 
-
-token next_token(tokenizer_char_stream str) {
+/* Dispatches on the class of the first character, the kinds of token
+   can be told apart by it */
+token next_token(tokenizer_char_stream *str) {
   token t;
-
-  INT i_val;
-  UINT u_val;
-  char c_val;
-  FLOAT f_val;
-  int n = 0;
-
-  if (!more(str)) {
-    t.type = TOKENIZER_END;
-    return t;
-  }
+  int n;
+  char c;
 
   // Eat whitespace and comments.
-  bool clean_whitespace = true;
-  while ( clean_whitespace ){
-    if ( peek(str,0) == ';' ) {
-      while ( more(str) && peek(str, 0) != '\n') {
-	drop(str,1);
+  while (true) {
+    c = peek(str, 0);
+    if (c == ';') {
+      while (more(str) && peek(str, 0) != '\n') {
+	drop(str, 1);
       }
-    } else if ( isspace(peek(str,0))) {
-      drop(str,1);
+    } else if (char_class(c) & CC_SPACE) {
+      drop(str, 1);
     } else {
-      clean_whitespace = false;
+      break;
     }
   }
 
-  // Check for end of string again
   if (!more(str)) {
     t.type = TOKENIZER_END;
     return t;
   }
 
-  if (tok_quote(str)) {
+  switch (c) {
+  case '\'':
+    drop(str, 1);
     t.type = TOKQUOTE;
     return t;
-  }
-
-  if (tok_backquote(str)) {
+  case '`':
+    drop(str, 1);
     t.type = TOKBACKQUOTE;
     return t;
-  }
-
-  if (tok_commaat(str)) {
-    t.type= TOKCOMMAAT;
-    return t;
-  }
-  
-  if (tok_comma(str)) {
-    t.type = TOKCOMMA;
+  case ',':
+    if (peek(str, 1) == '@') {
+      drop(str, 2);
+      t.type = TOKCOMMAAT;
+    } else {
+      drop(str, 1);
+      t.type = TOKCOMMA;
+    }
     return t;
-  }
-
-  if (tok_openpar(str)) {
+  case '(':
+    drop(str, 1);
     t.type = TOKOPENPAR;
     return t;
-  }
-
-  if (tok_closepar(str)) {
+  case ')':
+    drop(str, 1);
     t.type = TOKCLOSEPAR;
     return t;
+  case '\\':
+    if (tok_char(str, &t.data.c)) {
+      t.type = TOKCHAR;
+      return t;
+    }
+    break;
+  case '\"':
+    n = tok_string(str, &t.data.text);
+    if (n > 0) {
+      t.text_len = n - 2;
+      t.type = TOKSTRING;
+      return t;
+    }
+    break;
+  default:
+    if (char_class(c) & CC_SYM0) {
+      t.text_len = tok_symbol(str, &t.data.text);
+      t.type = TOKSYMBOL;
+      return t;
+    } else if (tok_number(str, &t)) {
+      return t;
+    }
+    break;
   }
 
-  n = tok_symbol(str, &t.data.text);
-  if (n > 0) {
-    t.text_len = n;
-    t.type = TOKSYMBOL;
-    return t;
-  } else if (n < 0) {
-    t.type = TOKENIZER_ERROR;
-    return t;
-  }
-   
-  if (tok_char(str, &c_val)) {
-    t.data.c = c_val;
-    t.type = TOKCHAR;
-    return t;
-  }
+  t.type = TOKENIZER_ERROR;
+  return t;
+}
 
-  n = tok_string(str, &t.data.text);
-  if (n > 0) {
-    t.text_len = n - 2;
-    t.type = TOKSTRING;
-    return t;
-  } else if (n < 0) {
-    t.type = TOKENIZER_ERROR;
-    return t;
-  }
+/*
+   The parser does not recurse. The values of the lists that are being
+   read are kept on a value stack that is a root set for the garbage
+   collector, so when the heap is full the parser collects garbage and
+   continues. Each open list and each quote like prefix has a frame
+   (kind, base, cells) on a frame stack. base is the depth of the value
+   stack when the frame was opened, cells the number of cells the
+   parser had allocated then.
+*/
+#define FRAME_PROGRAM      0
+#define FRAME_LIST         1
+#define FRAME_QUOTE        2
+#define FRAME_BACKQUOTE    3
+#define FRAME_COMMA        4
+#define FRAME_COMMAAT      5
+#define FRAME_NONE         6   // the frame stack could not be read
+#define FRAME_SIZE         3
+
+/* Nesting deeper than this grows the stacks with malloc'd segments */
+#define PARSER_STACK_SIZE  32
+
+/* qq_expand allocates at most this many cells per cell of its
+   argument, plus this many for the argument itself */
+#define QQ_CELLS_PER_CELL  10
 
-  if (tok_F(str, &f_val)) {
-    t.data.f = f_val;
-    t.type = TOKBOXEDFLOAT;
-    return t;
-  }
+typedef struct {
+  stack values;         // GC roots
+  stack frames;
+  unsigned int depth;   // number of values on the value stack
+  unsigned int cells;   // cells allocated by the parser so far
+  UINT values_base[PARSER_STACK_SIZE];
+  UINT frames_base[PARSER_STACK_SIZE * FRAME_SIZE];
+} parser_state;
 
-  if (tok_U(str, &u_val)) {
-    t.data.u = u_val;
-    t.type = TOKBOXEDUINT;
-    return t;
-  }
+static bool is_parse_error(VALUE v) {
+  return is_symbol(v) && symrepr_is_error(dec_sym(v));
+}
 
+static bool parser_push(parser_state *p, VALUE v) {
+  if (!push_u32(&p->values, v)) return false;
+  p->depth ++;
+  return true;
+}
 
-  if (tok_u(str, &u_val)) {
-    t.data.u = u_val;
-    t.type = TOKUINT;
-    return t;
-  }
+static VALUE parser_pop(parser_state *p) {
+  VALUE v;
+  pop_u32(&p->values, &v);
+  p->depth --;
+  return v;
+}
 
-  if (tok_I(str, &i_val)) {
-    t.data.i = i_val;
-    t.type = TOKBOXEDINT;
-    return t;
-  }
+static void parser_gc(parser_state *p) {
+  eval_cps_gc(&p->values);
+}
 
-  // Shortest form of integer match. Move to last in chain of numerical tokens.
-  if (tok_i(str, &i_val)) {
-    t.data.i = i_val;
-    t.type = TOKINT;
-    return t;
+/* cons, collecting garbage and retrying once on failure. a and b are
+   roots during the collection. */
+static VALUE parser_cons(parser_state *p, VALUE a, VALUE b) {
+  VALUE c = cons(a, b);
+  if (is_symbol_merror(c)) {
+    if (!push_u32_2(&p->values, a, b)) return c;
+    parser_gc(p);
+    stack_drop(&p->values, 2);
+    c = cons(a, b);
   }
-
-  t.type = TOKENIZER_ERROR;
-  return t;
+  if (is_ptr(c)) p->cells ++;
+  return c;
 }
 
-VALUE parse_sexp(token tok, tokenizer_char_stream str);
-VALUE parse_sexp_list(token tok, tokenizer_char_stream str);
-
-VALUE parse_program(tokenizer_char_stream str) {
-  token tok = next_token(str);
-  VALUE head;
-  VALUE tail;
+static VALUE make_atom(token *tok) {
+  VALUE v = enc_sym(symrepr_merror());
 
-  if (tok.type == TOKENIZER_ERROR) {
-    return enc_sym(symrepr_rerror());
-  }
-
-  if (tok.type == TOKENIZER_END) {
-    return enc_sym(symrepr_nil());
+  switch (tok->type) {
+  case TOKSTRING:
+    heap_allocate_array(&v, tok->text_len+1, VAL_TYPE_CHAR);
+    if (type_of(v) == PTR_TYPE_ARRAY) {
+      array_header_t *arr = (array_header_t*)car(v);
+      char *data = (char *)arr + 8;
+      memset(data, 0, (tok->text_len+1) * sizeof(char));
+      memcpy(data, tok->data.text, tok->text_len * sizeof(char));
+    } else {
+      v = enc_sym(symrepr_merror());
+    }
+    return v;
+  case TOKINT:
+    return enc_i(tok->data.i);
+  case TOKUINT:
+    return enc_u(tok->data.u);
+  case TOKCHAR:
+    return enc_char(tok->data.c);
+  case TOKBOXEDINT:
+    return enc_I(tok->data.i);
+  case TOKBOXEDUINT:
+    return enc_U(tok->data.u);
+  case TOKBOXEDFLOAT:
+    return enc_F(tok->data.f);
   }
-
-  head = parse_sexp(tok, str);
-  tail = parse_program(str);
-
-  return cons(head, tail);
+  return enc_sym(symrepr_rerror());
 }
 
-VALUE parse_sexp(token tok, tokenizer_char_stream str) {
-
+static VALUE parser_atom(parser_state *p, token *tok) {
   VALUE v;
-  token t;
 
-  switch (tok.type) {
-  case TOKENIZER_END:
-    return enc_sym(symrepr_rerror());
-  case TOKENIZER_ERROR:
-    return enc_sym(symrepr_rerror());
-  case TOKOPENPAR:
-    t = next_token(str);
-    return parse_sexp_list(t,str);
-  case TOKSYMBOL: {
+  if (tok->type == TOKSYMBOL) {
     UINT symbol_id;
-
-    if (symrepr_lookup(tok.data.text, &symbol_id)) {
-      v = enc_sym(symbol_id);
-    }
-    else if (symrepr_addsym(tok.data.text, &symbol_id)) {
+    if (symrepr_lookup_lower(tok->data.text, tok->text_len, &symbol_id) ||
+	symrepr_addsym_lower(tok->data.text, tok->text_len, &symbol_id)) {
       v = enc_sym(symbol_id);
     } else {
       v = enc_sym(symrepr_rerror());
     }
-    free(tok.data.text);
     return v;
   }
-  case TOKSTRING: {
-    heap_allocate_array(&v, tok.text_len+1, VAL_TYPE_CHAR);
-    array_header_t *arr = (array_header_t*)car(v);
-    char *data = (char *)arr + 8;
-    memset(data, 0, (tok.text_len+1) * sizeof(char));
-    memcpy(data, tok.data.text, tok.text_len * sizeof(char));
-    free(tok.data.text);
-    return v;
+
+  v = make_atom(tok);
+  if (is_symbol_merror(v)) {
+    parser_gc(p);
+    v = make_atom(tok);
   }
-  case TOKINT:
-    return enc_i(tok.data.i);
-  case TOKUINT:
-    return enc_u(tok.data.u);
-  case TOKCHAR:
-    return enc_char(tok.data.c);
-  case TOKBOXEDINT:
-    return set_ptr_type(cons(tok.data.i, enc_sym(DEF_REPR_BOXED_I_TYPE)), PTR_TYPE_BOXED_I);
-  case TOKBOXEDUINT:
-    return set_ptr_type(cons(tok.data.u, enc_sym(DEF_REPR_BOXED_U_TYPE)), PTR_TYPE_BOXED_U);
-  case TOKBOXEDFLOAT:
-    return set_ptr_type(cons(tok.data.u, enc_sym(DEF_REPR_BOXED_F_TYPE)), PTR_TYPE_BOXED_F);
-  case TOKQUOTE: {
-    t = next_token(str);
-    VALUE quoted = parse_sexp(t, str);
-    if (type_of(quoted) == VAL_TYPE_SYMBOL &&
-	dec_sym(quoted) == symrepr_rerror()) return quoted;
-    return cons(enc_sym(symrepr_quote()), cons (quoted, enc_sym(symrepr_nil()))); 
-  }
-  case TOKBACKQUOTE: {
-    t = next_token(str);
-    VALUE quoted = parse_sexp(t, str);
-    if (type_of(quoted) == VAL_TYPE_SYMBOL &&
-	dec_sym(quoted) == symrepr_rerror()) return quoted;
-    VALUE expanded = qq_expand(quoted);
-    if (type_of(expanded) == VAL_TYPE_SYMBOL &&
-	symrepr_is_error(dec_sym(expanded))) return expanded;
-    return expanded;
-  }
-  case TOKCOMMAAT: {
-    t = next_token(str);
-    VALUE splice = parse_sexp(t, str);
-    if (type_of(splice) == VAL_TYPE_SYMBOL &&
-	dec_sym(splice) == symrepr_rerror()) return splice;
-    return cons(enc_sym(symrepr_commaat()), cons (splice, enc_sym(symrepr_nil())));
-  }
-  case TOKCOMMA: {
-    t = next_token(str);
-    VALUE unquoted = parse_sexp(t, str);
-    if (type_of(unquoted) == VAL_TYPE_SYMBOL &&
-	dec_sym(unquoted) == symrepr_rerror()) return unquoted;
-    return cons(enc_sym(symrepr_comma()), cons (unquoted, enc_sym(symrepr_nil()))); 
+  if (is_ptr(v)) p->cells ++;
+  return v;
+}
+
+/* The values above base as a list, they are removed from the stack */
+static VALUE parser_list(parser_state *p, unsigned int base) {
+  VALUE l = enc_sym(symrepr_nil());
+  while (p->depth > base) {
+    l = parser_cons(p, parser_pop(p), l);
+    if (is_parse_error(l)) return l;
+  }
+  return l;
+}
+
+/* (sym v) */
+static VALUE parser_tag(parser_state *p, UINT sym, VALUE v) {
+  VALUE l = parser_cons(p, v, enc_sym(symrepr_nil()));
+  if (is_parse_error(l)) return l;
+  return parser_cons(p, enc_sym(sym), l);
+}
+
+/* The expansion of `v, v has been built from the cells allocated
+   since the backquote frame was opened. Makes sure that the expansion
+   fits in the heap before starting it, qq_expand does not check its
+   allocations. */
+static VALUE parser_backquote(parser_state *p, unsigned int cells, VALUE v) {
+  unsigned int need = (p->cells - cells + 1) * QQ_CELLS_PER_CELL;
+  if (heap_size() - heap_num_allocated() < need) {
+    if (!parser_push(p, v)) return enc_sym(symrepr_merror());
+    parser_gc(p);
+    parser_pop(p);
+    if (heap_size() - heap_num_allocated() < need) {
+      return enc_sym(symrepr_merror());
+    }
   }
+  unsigned int before = heap_num_allocated();
+  VALUE expanded = qq_expand(v);
+  p->cells += heap_num_allocated() - before;
+  return expanded;
+}
+
+static VALUE parser_close_prefix(parser_state *p, unsigned int kind,
+				 unsigned int cells, VALUE v) {
+  switch (kind) {
+  case FRAME_QUOTE:
+    return parser_tag(p, symrepr_quote(), v);
+  case FRAME_BACKQUOTE:
+    return parser_backquote(p, cells, v);
+  case FRAME_COMMA:
+    return parser_tag(p, symrepr_comma(), v);
+  case FRAME_COMMAAT:
+    return parser_tag(p, symrepr_commaat(), v);
   }
   return enc_sym(symrepr_rerror());
 }
 
-VALUE parse_sexp_list(token tok, tokenizer_char_stream str) {
+static bool push_frame(parser_state *p, unsigned int kind) {
+  return push_u32_3(&p->frames, kind, p->depth, p->cells);
+}
 
-  token t;
-  VALUE head;
-  VALUE tail;
+static unsigned int top_frame_kind(parser_state *p) {
+  UINT *f = stack_ptr(&p->frames, FRAME_SIZE);
+  return f ? (unsigned int)f[0] : FRAME_NONE;
+}
+
+#define PARSE_CONTINUE     0
+#define PARSE_FORM         1   // a complete top level expression
+#define PARSE_END          2
+#define PARSE_ERROR        3   // rerror or merror
 
-  switch (tok.type) {
+/* Feeds one token to the parser. The value of a complete top level
+   expression or the error is returned in res. */
+static int parser_step(parser_state *p, token *tok, VALUE *res) {
+  unsigned int kind = top_frame_kind(p);
+  UINT frame_kind;
+  UINT base;
+  UINT cells;
+  VALUE v;
+
+  if (kind == FRAME_NONE) {
+    *res = enc_sym(symrepr_merror());
+    return PARSE_ERROR;
+  }
+
+  switch (tok->type) {
   case TOKENIZER_END:
-    return enc_sym(symrepr_rerror());
+    if (kind != FRAME_PROGRAM) {
+      *res = enc_sym(symrepr_rerror());
+      return PARSE_ERROR;
+    }
+    return PARSE_END;
   case TOKENIZER_ERROR:
-    return enc_sym(symrepr_rerror());
+    *res = enc_sym(symrepr_rerror());
+    return PARSE_ERROR;
+  case TOKOPENPAR:
+    kind = FRAME_LIST;
+    break;
+  case TOKQUOTE:
+    kind = FRAME_QUOTE;
+    break;
+  case TOKBACKQUOTE:
+    kind = FRAME_BACKQUOTE;
+    break;
+  case TOKCOMMA:
+    kind = FRAME_COMMA;
+    break;
+  case TOKCOMMAAT:
+    kind = FRAME_COMMAAT;
+    break;
   case TOKCLOSEPAR:
-    return enc_sym(symrepr_nil());
+    if (kind != FRAME_LIST) {
+      *res = enc_sym(symrepr_rerror());
+      return PARSE_ERROR;
+    }
+    pop_u32_3(&p->frames, &cells, &base, &frame_kind);
+    v = parser_list(p, (unsigned int)base);
+    goto value;
   default:
-    head = parse_sexp(tok, str);
-    t = next_token(str);
-    tail = parse_sexp_list(t, str);
-    if ((type_of(head) == VAL_TYPE_SYMBOL &&
-	 dec_sym(head) == symrepr_rerror() ) ||
-	(type_of(tail) == VAL_TYPE_SYMBOL &&
-	 dec_sym(tail) == symrepr_rerror() )) return enc_sym(symrepr_rerror());
-    return cons(head, tail);
+    v = parser_atom(p, tok);
+    goto value;
+  }
+  if (!push_frame(p, kind)) {
+    *res = enc_sym(symrepr_merror());
+    return PARSE_ERROR;
+  }
+  return PARSE_CONTINUE;
+
+ value:
+  kind = top_frame_kind(p);
+  while (!is_parse_error(v) &&
+	 kind != FRAME_PROGRAM &&
+	 kind != FRAME_LIST &&
+	 kind != FRAME_NONE) {
+    pop_u32_3(&p->frames, &cells, &base, &frame_kind);
+    v = parser_close_prefix(p, kind, (unsigned int)cells, v);
+    kind = top_frame_kind(p);
+  }
+  if (!is_parse_error(v) && kind == FRAME_NONE) v = enc_sym(symrepr_merror());
+  *res = v;
+  if (is_parse_error(v)) return PARSE_ERROR;
+  if (kind == FRAME_PROGRAM) return PARSE_FORM;
+  if (!parser_push(p, v)) {
+    *res = enc_sym(symrepr_merror());
+    return PARSE_ERROR;
+  }
+  return PARSE_CONTINUE;
+}
+
+/* The program is built in order as the expressions are read, its
+   first and last cell are kept in the two bottom slots of the value
+   stack */
+static VALUE parse(parser_state *p, tokenizer_char_stream *str) {
+  VALUE nil = enc_sym(symrepr_nil());
+
+  if (!parser_push(p, nil) ||
+      !parser_push(p, nil) ||
+      !push_frame(p, FRAME_PROGRAM)) {
+    return enc_sym(symrepr_merror());
+  }
+
+  while (true) {
+    token tok = next_token(str);
+    VALUE v;
+    UINT *prg;
+
+    switch (parser_step(p, &tok, &v)) {
+    case PARSE_FORM:
+      v = parser_cons(p, v, nil);
+      if (is_parse_error(v)) return v;
+      prg = stack_ptr(&p->values, 2);
+      if (prg[0] == nil) {
+	prg[0] = v;
+      } else {
+	set_cdr(prg[1], v);
+      }
+      prg[1] = v;
+      break;
+    case PARSE_END:
+      return stack_ptr(&p->values, 2)[0];
+    case PARSE_ERROR:
+      return v;
+    }
   }
+}
 
-  return enc_sym(symrepr_rerror());
+static void parser_state_init(parser_state *p) {
+  p->depth = 0;
+  p->cells = 0;
+
+  stack_create(&p->values, p->values_base, PARSER_STACK_SIZE);
+  stack_create(&p->frames, p->frames_base, PARSER_STACK_SIZE * FRAME_SIZE);
+  p->values.growable = true;
+  p->frames.growable = true;
 }
 
-bool more_string(tokenizer_char_stream str) {
-  tokenizer_state *s = (tokenizer_state*)str.state;
-  return s->str[s->pos] != 0;
+/* Frees the segments, the base is part of the state */
+static void parser_state_free(parser_state *p) {
+  stack_clear(&p->values);
+  stack_clear(&p->frames);
 }
 
-char get_string(tokenizer_char_stream str) {
-  tokenizer_state *s = (tokenizer_state*)str.state;
-  char c = s->str[s->pos];
-  s->pos = s->pos + 1;
-  return c;
+VALUE parse_program(tokenizer_char_stream *str) {
+  parser_state p;
+
+  parser_state_init(&p);
+
+  VALUE res = parse(&p, str);
+
+  parser_state_free(&p);
+  return res;
 }
 
-char peek_string(tokenizer_char_stream str, unsigned int n) {
-  tokenizer_state *s = (tokenizer_state*)str.state;
-  // TODO error checking ?? how ?
-  char c = s->str[s->pos + n];
-  return c;
+/* Keeps the program alive until it is evaluated */
+static VALUE hold_program(VALUE prg) {
+  if (!eval_cps_hold_program(prg)) return enc_sym(symrepr_merror());
+  return prg;
 }
 
-void drop_string(tokenizer_char_stream str, unsigned int n) {
-  tokenizer_state *s = (tokenizer_state*)str.state;
-  s->pos = s->pos + n;
+static bool fill_string(tokenizer_char_stream *str, unsigned int n) {
+  (void)str;
+  (void)n;
+  return false;
 }
 
 VALUE tokpar_parse(char *string) {
 
-  tokenizer_state ts;
-  ts.str = string;
-  ts.pos = 0;
-
   tokenizer_char_stream str;
-  str.state = &ts;
-  str.more = more_string;
-  str.peek = peek_string;
-  str.drop = drop_string;
-  str.get  = get_string;
+  str.state = NULL;
+  str.buf = string;
+  str.pos = 0;
+  str.len = (unsigned int)strlen(string);
+  str.fill = fill_string;
 
-  return parse_program(str);
+  return hold_program(parse_program(&str));
 }
 
+/* The decompressed lookahead. It moves to a malloc'd buffer, that is
+   grown, when a token is longer than the base window. */
 #define DECOMP_BUFF_SIZE 32
+#define DECOMP_WINDOW_SIZE 128
 typedef struct {
   decomp_state ds;
-  char decomp_buff[DECOMP_BUFF_SIZE];
-  int  decomp_bytes;
-  int  buff_pos;
+  char *window;
+  unsigned int size;
+  bool done;
+  bool error;
+  char base[DECOMP_WINDOW_SIZE];
 } tokenizer_compressed_state;
 
-bool more_compressed(tokenizer_char_stream str) {
-  tokenizer_compressed_state *s = (tokenizer_compressed_state*)str.state;
-  bool more =
-    (s->ds.i < s->ds.compressed_bits + 32) ||
-    (s->buff_pos < s->decomp_bytes);
-  return more;
-}
-
-char get_compressed(tokenizer_char_stream str) {
-  tokenizer_compressed_state *s = (tokenizer_compressed_state*)str.state;
+static bool fill_compressed(tokenizer_char_stream *str, unsigned int n) {
+  tokenizer_compressed_state *s = (tokenizer_compressed_state*)str->state;
 
-  if (s->ds.i >= s->ds.compressed_bits + 32 &&
-      (s->buff_pos >= s->decomp_bytes)) {
-    return 0;
+  if (str->pos > 0) {
+    memmove(s->window, s->window + str->pos, str->len - str->pos);
+    str->len -= str->pos;
+    str->pos = 0;
   }
 
-  if (s->buff_pos >= s->decomp_bytes) {
-    int n = compression_decompress_incremental(&s->ds, s->decomp_buff,DECOMP_BUFF_SIZE);
-    if (n == 0) {
-      return 0;
+  while (str->len < n && !s->done) {
+    if (s->size - str->len < DECOMP_BUFF_SIZE) {
+      char *w = malloc(s->size * 2);
+      if (w == NULL) {
+	s->done = true;
+	break;
+      }
+      memcpy(w, s->window, str->len);
+      if (s->window != s->base) free(s->window);
+      s->window = w;
+      s->size = s->size * 2;
+    }
+    int k = compression_decompress_incremental(&s->ds, s->window + str->len,
+					       DECOMP_BUFF_SIZE);
+    if (k <= 0) {
+      s->done = true;
+      s->error = k < 0;
+    } else {
+      str->len += (unsigned int)k;
     }
-    s->decomp_bytes = n;
-    s->buff_pos = 0;
   }
-  char c = s->decomp_buff[s->buff_pos];
-  s->buff_pos += 1;
-  return c;
+  str->buf = s->window;
+  return str->len >= n;
 }
 
-char peek_compressed(tokenizer_char_stream str, unsigned int n) {
-  tokenizer_compressed_state *s = (tokenizer_compressed_state*)str.state;
+VALUE tokpar_parse_compressed(char *bytes) {
 
-  tokenizer_compressed_state old;
+  tokenizer_compressed_state ts;
 
-  memcpy(&old, s, sizeof(tokenizer_compressed_state));
+  ts.window = ts.base;
+  ts.size = DECOMP_WINDOW_SIZE;
+  ts.done = false;
+  ts.error = false;
 
-  char c = get_compressed(str);;
-  for (unsigned int i = 1; i <= n; i ++) {
-    c = get_compressed(str);
-  }
+  compression_init_state(&ts.ds, bytes);
 
-  memcpy(str.state, &old, sizeof(tokenizer_compressed_state));
-  return c;
+  tokenizer_char_stream str;
+  str.state = &ts;
+  str.buf = ts.window;
+  str.pos = 0;
+  str.len = 0;
+  str.fill = fill_compressed;
+
+  VALUE res = parse_program(&str);
+  if (ts.window != ts.base) free(ts.window);
+  // Invalid code or unknown code table
+  if (ts.error) return enc_sym(symrepr_rerror());
+  return hold_program(res);
 }
 
+/*
+   Streaming parser. The input is buffered until a token is known to be
+   complete, that is when the tokenizer did not have to look past the
+   end of the input received so far to recognize it. Otherwise the
+   token is read again when more input arrives. Whitespace and comments
+   are dropped as they arrive, so the buffer holds at most the last,
+   unfinished, token and the unparsed part of the last chunk.
+
+   The values of the lists that are being read and the last expression
+   returned are kept on the value stack, which is registered as a root
+   with the evaluator. Slot 0 holds the last expression.
+*/
+struct tokpar_stream_s {
+  parser_state p;
+  eval_cps_root_t root;
+  char *buf;
+  unsigned int len;      // bytes in buf
+  unsigned int pos;      // bytes of buf that have been read
+  unsigned int size;
+  bool in_comment;
+  bool hit_end;          // the tokenizer looked past the input
+  bool end;              // no more input will arrive
+  int status;
+  VALUE error;
+};
+
+/* Tokens may continue in the next chunk */
+static bool fill_chunk(tokenizer_char_stream *str, unsigned int n) {
+  (void)n;
+  tokpar_stream_t *s = (tokpar_stream_t*)str->state;
+  s->hit_end = true;
+  return false;
+}
 
-void drop_compressed(tokenizer_char_stream str, unsigned int n) {
-  for (unsigned int i = 0; i < n; i ++) {
-    get_compressed(str);
+/* Drops whitespace and comments, true if a token starts at pos */
+static bool skip_blank(tokpar_stream_t *s) {
+  while (s->pos < s->len) {
+    char c = s->buf[s->pos];
+    if (s->in_comment) {
+      if (c == '\n') s->in_comment = false;
+    } else if (c == ';') {
+      s->in_comment = true;
+    } else if (!(char_class(c) & CC_SPACE)) {
+      return true;
+    }
+    s->pos ++;
   }
+  return false;
 }
 
+tokpar_stream_t *tokpar_stream_create(void) {
+  tokpar_stream_t *s = malloc(sizeof(tokpar_stream_t));
+  if (s == NULL) return NULL;
 
-VALUE tokpar_parse_compressed(char *bytes) {
+  parser_state_init(&s->p);
+  if (!parser_push(&s->p, enc_sym(symrepr_nil())) ||
+      !push_frame(&s->p, FRAME_PROGRAM)) {
+    parser_state_free(&s->p);
+    free(s);
+    return NULL;
+  }
 
-  tokenizer_compressed_state ts;
+  s->buf = NULL;
+  s->len = 0;
+  s->pos = 0;
+  s->size = 0;
+  s->in_comment = false;
+  s->hit_end = false;
+  s->end = false;
+  s->status = TOKPAR_STREAM_MORE;
+  s->error = enc_sym(symrepr_nil());
 
-  ts.decomp_bytes = 0;
-  memset(ts.decomp_buff, 0, 32);
-  ts.buff_pos = 0;
+  s->root.values = &s->p.values;
+  eval_cps_add_root(&s->root);
+  return s;
+}
 
-  compression_init_state(&ts.ds, bytes);
+void tokpar_stream_destroy(tokpar_stream_t *s) {
+  if (s == NULL) return;
+  eval_cps_remove_root(&s->root);
+  parser_state_free(&s->p);
+  free(s->buf);
+  free(s);
+}
+
+int tokpar_stream_feed(tokpar_stream_t *s, const char *data, unsigned int n) {
+  if (s->pos > 0) {
+    memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+    s->len -= s->pos;
+    s->pos = 0;
+  }
+  if (s->len + n > s->size) {
+    unsigned int size = s->size * 2;
+    if (size < s->len + n) size = s->len + n;
+    char *buf = realloc(s->buf, size);
+    if (buf == NULL) return 0;
+    s->buf = buf;
+    s->size = size;
+  }
+  memcpy(s->buf + s->len, data, n);
+  s->len += n;
+  return 1;
+}
+
+void tokpar_stream_end(tokpar_stream_t *s) {
+  s->end = true;
+}
+
+int tokpar_stream_next(tokpar_stream_t *s, VALUE *form) {
+
+  if (s->status != TOKPAR_STREAM_MORE) {
+    *form = s->error;
+    return s->status;
+  }
 
   tokenizer_char_stream str;
-  str.state = &ts;
-  str.more = more_compressed;
-  str.get = get_compressed;
-  str.peek = peek_compressed;
-  str.drop = drop_compressed;
+  str.state = s;
+  str.fill = fill_chunk;
+
+  while (true) {
+    token tok;
+    VALUE v;
+
+    if (skip_blank(s)) {
+      str.buf = s->buf;
+      str.pos = s->pos;
+      str.len = s->len;
+      s->hit_end = false;
+      tok = next_token(&str);
+      if (s->hit_end && !s->end) {
+	return TOKPAR_STREAM_MORE;
+      }
+      s->pos = str.pos;
+    } else if (s->end) {
+      tok.type = TOKENIZER_END;
+    } else {
+      return TOKPAR_STREAM_MORE;
+    }
 
-  return parse_program(str);
+    switch (parser_step(&s->p, &tok, &v)) {
+    case PARSE_FORM:
+      parser_pop(&s->p);
+      parser_push(&s->p, v);
+      s->p.cells = 0;
+      *form = v;
+      return TOKPAR_STREAM_FORM;
+    case PARSE_END:
+      s->status = TOKPAR_STREAM_END;
+      *form = s->error;
+      return s->status;
+    case PARSE_ERROR:
+      s->status = TOKPAR_STREAM_ERROR;
+      s->error = v;
+      *form = v;
+      return s->status;
+    }
+  }
 }
@@ -4,6 +4,7 @@ echo "BUILDING"
 
 make clean
 make
+make jit
 
 echo "PERFORMING TESTS:"
 
@@ -135,6 +136,25 @@ for prg in "test_lisp_code_cps" "test_lisp_code_cps_nc" "test_lisp_code_cps_nc -
 	fi
 	echo "------------------------------------------------------------"
     done
+
+    for lisp in *.lisp; do
+	./$prg -h 8388608 -g -a $lisp
+
+	result=$?
+
+	echo "------------------------------------------------------------"
+	echo ANALYSED CODE!
+	if [ $result -eq 1 ]
+	then
+	    success_count=$((success_count+1))
+	    echo $lisp SUCCESS
+	else
+	    failing_tests="$failing_tests ANALYSED: $prg $lisp \n"
+	    fail_count=$((fail_count+1))
+	    echo $lisp FAILED
+	fi
+	echo "------------------------------------------------------------"
+    done
 done
 
 echo -e $failing_tests
@@ -0,0 +1,206 @@
+/*
+    Copyright 2020 Joel Svensson	svenssonjoel@yahoo.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "heap.h"
+#include "symrepr.h"
+#include "env.h"
+#include "eval_cps.h"
+#include "tokpar.h"
+#include "memory.h"
+#include "bytecode.h"
+
+#define EVAL_CPS_STACK_SIZE 256
+
+/* Immediate operands of the image */
+#define IMM_U32(v)   (uint8_t)(v), (uint8_t)((v) >> 8), (uint8_t)((v) >> 16), (uint8_t)((v) >> 24)
+#define IND(n)       IMM_U32(((n) << BC_IMG_ADDRESS_SHIFT) | BC_IMG_PTR_TYPE_SYMBOL_INDIRECTION | BC_IMG_PTR)
+#define CONST(n)     IMM_U32(((n) << BC_IMG_ADDRESS_SHIFT) | BC_IMG_PTR_TYPE_CONST | BC_IMG_PTR)
+#define ADDR(n)      IMM_U32(((n) << BC_IMG_ADDRESS_SHIFT) | BC_IMG_PTR_TYPE_BYTECODE | BC_IMG_PTR)
+#define NIL_IMM      IMM_U32(DEF_REPR_NIL << BC_IMG_VAL_SHIFT)
+#define I28(n)       IMM_U32(((n) << BC_IMG_VAL_SHIFT) | BC_IMG_VAL_TYPE_I)
+
+#define CODE_SIZE    100
+#define ENTRY        31
+#define AFTER_LAMBDA 71
+
+/*
+   (define inc (lambda (x) (+ x 1)))
+   (define big 4294967295u32)
+   (define greeting "hello")
+   'inc
+*/
+static uint8_t image[] = {
+  IMM_U32(BC_MAGIC), IMM_U32(CODE_SIZE), IMM_U32(2), IMM_U32(6),
+  /*  0 */ BC_MOVIMM, BC_REG_VAL, NIL_IMM,
+  /*  6 */ BC_CONS, BC_REG_VAL, BC_REG_ENV,
+  /*  9 */ BC_CONSIMM, BC_REG_VAL, ADDR(ENTRY),
+  /* 15 */ BC_CONSIMM, BC_REG_VAL, IND(0),
+  /* 21 */ BC_SETGLBVAL, IND(1),
+  /* 26 */ BC_JMPIMM, IMM_U32(AFTER_LAMBDA),
+  /* 31 */ BC_CADDR, BC_REG_ENV, BC_REG_PROC,
+  /* 34 */ BC_EXENVARGL, IND(2),
+  /* 39 */ BC_LOOKUP, BC_REG_PROC, IND(3),
+  /* 45 */ BC_MOVIMM, BC_REG_VAL, I28(1),
+  /* 51 */ BC_MOVIMM, BC_REG_ARGL, NIL_IMM,
+  /* 57 */ BC_CONS, BC_REG_ARGL, BC_REG_VAL,
+  /* 60 */ BC_LOOKUP, BC_REG_VAL, IND(2),
+  /* 66 */ BC_CONS, BC_REG_ARGL, BC_REG_VAL,
+  /* 69 */ BC_CALLF,
+  /* 70 */ BC_JMPCNT,
+  /* 71 */ BC_MOVIMM, BC_REG_VAL, CONST(0),
+  /* 77 */ BC_SETGLBVAL, IND(4),
+  /* 82 */ BC_MOVIMM, BC_REG_VAL, CONST(1),
+  /* 88 */ BC_SETGLBVAL, IND(5),
+  /* 93 */ BC_MOVIMM, BC_REG_VAL, IND(1),
+  /* 99 */ BC_DONE,
+  /* constants */
+  BC_CONST_U32, IMM_U32(0xFFFFFFFFu),
+  BC_CONST_STRING, IMM_U32(5), 'h', 'e', 'l', 'l', 'o',
+  /* symbol indirections */
+  IND(0), IMM_U32(4), 'p', 'r', 'o', 'c',
+  IND(1), IMM_U32(3), 'i', 'n', 'c',
+  IND(2), IMM_U32(1), 'x',
+  IND(3), IMM_U32(1), '+',
+  IND(4), IMM_U32(3), 'b', 'i', 'g',
+  IND(5), IMM_U32(8), 'g', 'r', 'e', 'e', 't', 'i', 'n', 'g'
+};
+
+static VALUE run(char *str) {
+  VALUE t = tokpar_parse(str);
+  return eval_cps_program_nc(t);
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  int res;
+
+  unsigned char *memory = malloc(MEMORY_SIZE_16K);
+  unsigned char *bitmap = malloc(MEMORY_BITMAP_SIZE_16K);
+  if (memory == NULL || bitmap == NULL) return 0;
+
+  res = memory_init(memory, MEMORY_SIZE_16K,
+		    bitmap, MEMORY_BITMAP_SIZE_16K);
+  res = res && symrepr_init();
+  res = res && heap_init(1024);
+  res = res && eval_cps_init_nc(EVAL_CPS_STACK_SIZE, false);
+  if (!res) {
+    printf("Error initializing\n");
+    return 0;
+  }
+
+  uint8_t bad[sizeof(image)];
+  memcpy(bad, image, sizeof(image));
+  bad[0] = 0;
+  VALUE v = bytecode_create(bad, sizeof(bad));
+  if (!is_symbol(v) || dec_sym(v) != symrepr_rerror()) {
+    printf("Error: image with bad magic was accepted\n");
+    return 0;
+  }
+  /* A string length that runs past the end of the image */
+  memcpy(bad, image, sizeof(image));
+  memset(bad + BC_HEADER_SIZE + CODE_SIZE + 6, 0xFF, 4);
+  v = bytecode_create(bad, sizeof(bad));
+  if (!is_symbol(v) || dec_sym(v) != symrepr_rerror()) {
+    printf("Error: image with bad string length was accepted\n");
+    return 0;
+  }
+  printf("Bad image rejected: OK\n");
+
+  v = bytecode_create(image, sizeof(image));
+  if (type_of(v) != PTR_TYPE_BYTECODE) {
+    printf("Error loading image\n");
+    return 0;
+  }
+
+  UINT sym;
+  if (!symrepr_addsym("bc-prg", &sym)) return 0;
+  VALUE new_env = env_set(*env_get_global_ptr(), enc_sym(sym), v);
+  if (type_of(new_env) == VAL_TYPE_SYMBOL) return 0;
+  *env_get_global_ptr() = new_env;
+  printf("Image loaded: OK\n");
+
+  UINT inc;
+  v = run("(bc-prg)");
+  if (!symrepr_lookup("inc", &inc) || v != enc_sym(inc)) {
+    printf("Error running top level code\n");
+    return 0;
+  }
+
+  v = run("(inc 41)");
+  if (v != enc_i(42)) {
+    printf("Error applying compiled procedure\n");
+    return 0;
+  }
+  printf("Compiled procedure applied: OK\n");
+
+  /* Only the exact shape of a compiled procedure is callable */
+  if (!bytecode_is_callable(run("(list 'proc (car (cdr inc)) nil)")) ||
+      bytecode_is_callable(run("(list 'other (car (cdr inc)) nil)")) ||
+      bytecode_is_callable(run("(list 'proc (car (cdr inc)) nil 1)"))) {
+    printf("Error recognizing compiled procedures\n");
+    return 0;
+  }
+
+  /* Calls from C, by global symbol and by closure value */
+  VALUE args[2] = {enc_i(9), enc_i(4)};
+  v = eval_cps_call_nc(enc_sym(inc), args, 1);
+  if (v != enc_i(10)) {
+    printf("Error calling procedure by symbol\n");
+    return 0;
+  }
+  VALUE sub = run("(lambda (a b) (- a b))");
+  v = eval_cps_call_nc(sub, args, 2);
+  if (v != enc_i(5)) {
+    printf("Error calling closure\n");
+    return 0;
+  }
+  printf("Calls from C: OK\n");
+
+  v = run("(= big 4294967295u32)");
+  if (v != enc_sym(symrepr_true())) {
+    printf("Error in boxed constant\n");
+    return 0;
+  }
+  v = run("greeting");
+  if (type_of(v) != PTR_TYPE_ARRAY ||
+      strcmp((char*)car(v) + 8, "hello") != 0) {
+    printf("Error in string constant\n");
+    return 0;
+  }
+  printf("Constants: OK\n");
+
+  /* Many applications on a small heap, interleaving interpreted and
+     compiled code so that garbage collection runs inside the VM */
+  v = run("(define f (lambda (n acc) (if (= n 0) acc (f (- n 1) (inc acc))))) (f 20000 0)");
+  if (v != enc_i(20000)) {
+    printf("Error applying compiled procedure under GC\n");
+    return 0;
+  }
+  v = run("(= big 4294967295u32)");
+  if (v != enc_sym(symrepr_true())) {
+    printf("Error: constant lost in GC\n");
+    return 0;
+  }
+  printf("Compiled code under GC: OK\n");
+
+  return 1;
+}
@@ -0,0 +1,187 @@
+/*
+    Copyright 2020 Joel Svensson	svenssonjoel@yahoo.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "heap.h"
+#include "symrepr.h"
+#include "env.h"
+#include "eval_cps.h"
+#include "tokpar.h"
+#include "memory.h"
+#include "compression.h"
+
+#define HEAP_SIZE 2048
+#define MAX_CHUNK 9
+#define OUT_SIZE  1024
+
+/* Comments, whitespace runs and a string that looks like code */
+static const char *program =
+  ";; a comment\n"
+  "(define xs '(1 2 3))\n"
+  "(define s \"hello  (world) ; no comment\") ; trailing comment\n"
+  "(define f 3.25)\n"
+  "\t(define u 0xff)\r\n"
+  "(define c \\#a)\n"
+  "(define ys `(0 ,(car xs) ,(+ 1 3)))\n"
+  "(define g (lambda (l acc) (if (= l nil) acc (g (cdr l) (+ acc (car l))))))\n"
+  "(define result (list (g xs 0) s f u c ys 'sym))   \n";
+
+static bool eval_true(char *str) {
+  return eval_cps_program_nc(tokpar_parse(str)) == enc_sym(symrepr_true());
+}
+
+static bool compress_chunked(const char *str, uint32_t table, unsigned int chunk,
+			     compression_buffer_t *b, uint32_t *size) {
+  comp_state s;
+  if (!compression_compress_init(&s, table, compression_buffer_sink, b)) return false;
+
+  uint32_t len = (uint32_t)strlen(str);
+  for (uint32_t i = 0; i < len; i += chunk) {
+    uint32_t n = (len - i < chunk) ? len - i : chunk;
+    if (!compression_compress_chunk(&s, str + i, n)) return false;
+  }
+  return compression_compress_finish(&s, size);
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  unsigned char *memory = malloc(MEMORY_SIZE_16K);
+  unsigned char *bitmap = malloc(MEMORY_BITMAP_SIZE_16K);
+  if (memory == NULL || bitmap == NULL) return 0;
+
+  int res = memory_init(memory, MEMORY_SIZE_16K,
+			bitmap, MEMORY_BITMAP_SIZE_16K);
+  res = res && symrepr_init();
+  res = res && heap_init(HEAP_SIZE);
+  res = res && env_init();
+  res = res && eval_cps_init_nc(256, true);
+  if (!res) {
+    printf("Error initializing\n");
+    return 0;
+  }
+
+  eval_cps_program_nc(tokpar_parse((char*)program));
+  eval_cps_program_nc(tokpar_parse("(define expected result)"));
+  eval_cps_program_nc(tokpar_parse("(define result nil)"));
+
+  /* Compression leaves the input as it was */
+  char *copy = malloc(strlen(program) + 1);
+  if (copy == NULL) return 0;
+  strcpy(copy, program);
+  uint32_t size;
+  char *compressed = compression_compress(copy, &size);
+  if (compressed == NULL || strcmp(copy, program) != 0) {
+    printf("Error: compression changed its input\n");
+    return 0;
+  }
+  free(copy);
+
+  eval_cps_program_nc(tokpar_parse_compressed(compressed));
+  if (!eval_true("(= result expected)")) {
+    printf("Error: wrong result of compressed program\n");
+    return 0;
+  }
+  printf("Compress: OK\n");
+
+  /* Compressing in chunks gives the same stream */
+  uint32_t table = (uint8_t)compressed[3] >> (COMPRESSION_TABLE_SHIFT - 24);
+  char out[OUT_SIZE];
+  for (unsigned int chunk = 1; chunk <= MAX_CHUNK; chunk ++) {
+    compression_buffer_t b = { out, OUT_SIZE };
+    uint32_t chunked_size;
+    if (!compress_chunked(program, table, chunk, &b, &chunked_size) ||
+	chunked_size != size ||
+	memcmp(out, compressed, size) != 0) {
+      printf("Error compressing in chunks of %u bytes\n", chunk);
+      return 0;
+    }
+  }
+  printf("Chunked compression: OK\n");
+
+  /* Every code table reproduces the program */
+  for (table = 0; table < compression_num_tables(); table ++) {
+    compression_buffer_t b = { out, OUT_SIZE };
+    uint32_t table_size;
+    eval_cps_program_nc(tokpar_parse("(define result nil)"));
+    if (!compress_chunked(program, table, MAX_CHUNK, &b, &table_size) ||
+	(uint32_t)((uint8_t)out[3] >> (COMPRESSION_TABLE_SHIFT - 24)) != table ||
+	table_size < size) {
+      printf("Error compressing with code table %u\n", table);
+      return 0;
+    }
+    eval_cps_program_nc(tokpar_parse_compressed(out));
+    if (!eval_true("(= result expected)")) {
+      printf("Error: wrong result with code table %u\n", table);
+      return 0;
+    }
+  }
+  printf("Code tables: OK\n");
+
+  /* A full buffer and uncompressable input are reported */
+  compression_buffer_t small = { out, size - 1 };
+  uint32_t small_size;
+  if (compress_chunked(program, 0, MAX_CHUNK, &small, &small_size)) {
+    printf("Error: output larger than the buffer was accepted\n");
+    return 0;
+  }
+  if (compression_compress("(define Upper 1)", &small_size) != NULL) {
+    printf("Error: uncompressable input was accepted\n");
+    return 0;
+  }
+  comp_state cs;
+  if (compression_compress_init(&cs, compression_num_tables(), compression_buffer_sink, &small)) {
+    printf("Error: an unknown code table was accepted\n");
+    return 0;
+  }
+  /* A stream naming a code table that does not exist */
+  compressed[3] = (char)(compression_num_tables() << (COMPRESSION_TABLE_SHIFT - 24));
+  if (compression_num_tables() < (1 << (32 - COMPRESSION_TABLE_SHIFT)) &&
+      (compression_decompress(out, OUT_SIZE, compressed) ||
+       !is_symbol(tokpar_parse_compressed(compressed)) ||
+       dec_sym(tokpar_parse_compressed(compressed)) != symrepr_rerror())) {
+    printf("Error: a stream with an unknown code table was read\n");
+    return 0;
+  }
+  /* A stream coded with a generated table that has a different id */
+  if (compression_num_tables() > 1) {
+    compression_buffer_t b = { out, OUT_SIZE };
+    uint32_t table_size;
+    char text[OUT_SIZE];
+    if (!compress_chunked(program, 1, MAX_CHUNK, &b, &table_size) ||
+	!compression_decompress(text, OUT_SIZE, out)) {
+      printf("Error compressing with code table 1\n");
+      return 0;
+    }
+    out[4] ^= 1;
+    if (compression_decompress(text, OUT_SIZE, out) ||
+	!is_symbol(tokpar_parse_compressed(out)) ||
+	dec_sym(tokpar_parse_compressed(out)) != symrepr_rerror()) {
+      printf("Error: a stream with a different code table id was read\n");
+      return 0;
+    }
+  }
+  printf("Compression errors: OK\n");
+
+  free(compressed);
+  return 1;
+}
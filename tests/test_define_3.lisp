@@ -0,0 +1,3 @@
+(define f (lambda () (+ later 1)))
+(define later 41)
+(= (f) 42)
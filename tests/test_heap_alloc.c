@@ -11,7 +11,7 @@ int main(int argc, char **argv) {
   int res = 1;
 
   unsigned int heap_size = 1024 * 1024; 
-  uint32_t cell;
+  VALUE cell;
 
   res = symrepr_init();
   if (!res) {
@@ -0,0 +1,115 @@
+/*
+    Copyright 2020 Joel Svensson	svenssonjoel@yahoo.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "heap.h"
+#include "symrepr.h"
+#include "env.h"
+#include "eval_cps.h"
+#include "tokpar.h"
+#include "memory.h"
+#include "instance.h"
+
+#define NUM_INSTANCES 4
+
+typedef struct {
+  int n;
+  bool ok;
+} job_t;
+
+/* Every instance defines its own x and a symbol of its own, then
+   runs a computation with plenty of garbage collection on a small
+   heap */
+static char *program =
+  "(define f (lambda (n acc) (if (= n 0) acc (f (- n 1) (+ acc x)))))"
+  "(f 20000 0)";
+
+void *instance_thd(void *v) {
+  job_t *job = (job_t*)v;
+  job->ok = false;
+
+  instance_t *inst = instance_create();
+  if (inst == NULL) return NULL;
+  instance_bind(inst);
+
+  unsigned char *memory = malloc(MEMORY_SIZE_16K);
+  unsigned char *bitmap = malloc(MEMORY_BITMAP_SIZE_16K);
+  if (memory == NULL || bitmap == NULL) return NULL;
+
+  int res = memory_init(memory, MEMORY_SIZE_16K,
+			bitmap, MEMORY_BITMAP_SIZE_16K);
+  res = res && symrepr_init();
+  res = res && heap_init(1024);
+  res = res && env_init();
+  res = res && eval_cps_init_nc(256, true);
+  if (!res) return NULL;
+
+  char name[16];
+  UINT sym;
+  snprintf(name, 16, "only-in-%d", job->n);
+  if (!symrepr_addsym(name, &sym)) return NULL;
+
+  if (!symrepr_addsym("x", &sym)) return NULL;
+  VALUE env = env_set(*env_get_global_ptr(), enc_sym(sym), enc_i(job->n));
+  if (type_of(env) == VAL_TYPE_SYMBOL) return NULL;
+  *env_get_global_ptr() = env;
+
+  VALUE r = eval_cps_program_nc(tokpar_parse(program));
+
+  /* The symbols of the other instances are not visible here */
+  bool others = false;
+  for (int i = 0; i < NUM_INSTANCES; i ++) {
+    snprintf(name, 16, "only-in-%d", i);
+    if (i != job->n && symrepr_lookup(name, &sym)) others = true;
+  }
+
+  job->ok = (r == enc_i(20000 * job->n)) && !others;
+
+  instance_destroy(inst);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  pthread_t thds[NUM_INSTANCES];
+  job_t jobs[NUM_INSTANCES];
+
+  for (int i = 0; i < NUM_INSTANCES; i ++) {
+    jobs[i].n = i;
+    if (pthread_create(&thds[i], NULL, instance_thd, &jobs[i])) {
+      printf("Error creating thread\n");
+      return 0;
+    }
+  }
+  for (int i = 0; i < NUM_INSTANCES; i ++) {
+    pthread_join(thds[i], NULL);
+  }
+  for (int i = 0; i < NUM_INSTANCES; i ++) {
+    if (!jobs[i].ok) {
+      printf("Error in instance %d\n", i);
+      return 0;
+    }
+  }
+  printf("Independent instances on %d threads: OK\n", NUM_INSTANCES);
+  return 1;
+}
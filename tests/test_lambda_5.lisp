@@ -0,0 +1,4 @@
+(define f (lambda (x) (+ x 1)))
+(define g (lambda (f) (f 10)))
+(define h (lambda (n acc) (if (= n 0) acc (h (- n 1) (+ acc (f 1) (g (lambda (x) (* x 2))))))))
+(= (h 1000 0) 22000)
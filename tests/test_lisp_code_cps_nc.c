@@ -34,9 +34,21 @@
 #include "prelude.h"
 #include "compression.h"
 #include "memory.h"
+#include "analyze.h"
+#include "env.h"
 
 #define EVAL_CPS_STACK_SIZE 256
 
+VALUE analyze(VALUE prg) {
+  VALUE r = analyze_program(prg);
+  if (is_symbol_merror(r)) {
+    heap_perform_gc_aux(*env_get_global_ptr(), enc_sym(symrepr_nil()), prg,
+			enc_sym(symrepr_nil()), enc_sym(symrepr_nil()), NULL, 0);
+    r = analyze_program(prg);
+  }
+  return r;
+}
+
 int main(int argc, char **argv) {
 
   int res = 0;
@@ -44,12 +56,13 @@ int main(int argc, char **argv) {
   unsigned int heap_size = 8 * 1024 * 1024;  // 8 Megabytes is standard  
   bool growing_continuation_stack = false;
   bool compress_decompress = false;
+  bool analyze_code = false;
   bool use_ec_eval = false;
   
   int c;
   opterr = 1;
   
-  while (( c = getopt(argc, argv, "gceh:")) != -1) {
+  while (( c = getopt(argc, argv, "gceah:")) != -1) {
     switch (c) {
     case 'h':
       heap_size = (unsigned int)atoi((char *)optarg);
@@ -57,6 +70,9 @@ int main(int argc, char **argv) {
     case 'g':
       growing_continuation_stack = true;
       break;
+    case 'a':
+      analyze_code = true;
+      break;
     case 'c':
       compress_decompress = true;
       break;
@@ -72,6 +88,7 @@ int main(int argc, char **argv) {
   printf("Heap size: %u\n", heap_size);
   printf("Growing stack: %s\n", growing_continuation_stack ? "yes" : "no");
   printf("Compression: %s\n", compress_decompress ? "yes" : "no");
+  printf("Analyse code: %s\n", analyze_code ? "yes" : "no");
   printf("Evaluator: %s\n", use_ec_eval ? "ec_eval" : "eval_cps");
   printf("------------------------------------------------------------\n");
 	 
@@ -143,6 +160,10 @@ int main(int argc, char **argv) {
   }
 
   VALUE prelude = prelude_load();
+  if (analyze_code && is_symbol_merror(analyze(prelude))) {
+    printf("Error analysing prelude\n");
+    return 0;
+  }
   if (use_ec_eval) {
     ec_eval_program(prelude);
   } else {
@@ -171,6 +192,11 @@ int main(int argc, char **argv) {
   char output[1024];
   char error[1024];
 
+  if (analyze_code && is_symbol_merror(analyze(t))) {
+    printf("Error analysing program\n");
+    return 0;
+  }
+
   res = print_value(output, 1024, error, 1024, t); 
 
   if ( res >= 0) {
@@ -0,0 +1,385 @@
+/*
+    Copyright 2020 Joel Svensson	svenssonjoel@yahoo.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "heap.h"
+#include "symrepr.h"
+#include "env.h"
+#include "eval_cps.h"
+#include "tokpar.h"
+#include "memory.h"
+
+#define NUM_SLEEPERS 40
+
+/* Spawns sleepers in a scrambled order, each one conses its sleep
+   time (in ms) onto r when it wakes up. */
+static char *program =
+  "(define r nil)"
+  "(define sleeper (lambda (n) (progn (yield (* n 1000)) (define r (cons n r)))))"
+  "(define go (lambda (k) (if (= k 40) nil"
+  "                         (progn (spawn ((sleeper (+ 10 (mod (* k 17) 40)))))"
+  "                                (go (+ k 1))))))"
+  "(go 0)"
+  "(yield 200000)"
+  "r";
+
+/* 20 sequential joins of spawned contexts */
+static char *joins =
+  "(define join (lambda (k acc) (if (= k 0) acc"
+  "  (join (- k 1) (+ acc (wait (car (spawn ((+ k 1))))))))))"
+  "(join 20 0)";
+
+/* A consumer that blocks in recv, sums the messages until it gets 0 */
+static char *messages =
+  "(define consumer (lambda (acc) (let ((m (recv))) (if (= m 0) acc (consumer (+ acc m))))))"
+  "(define producer (lambda (cid n) (if (= n 0) (send cid 0)"
+  "  (progn (send cid n) (producer cid (- n 1))))))"
+  "(define c (car (spawn ((consumer 0)))))"
+  "(yield 10000)"
+  "(producer c 100)"
+  "(wait c)";
+
+/* Sums events from the host, set-got is called by a posted call */
+static char *events =
+  "(define got nil)"
+  "(define set-got (lambda (x) (define got x)))"
+  "(define esum (lambda (n acc) (if (= n 0) acc (esum (- n 1) (+ acc (recv))))))"
+  "(esum 2000 0)";
+
+static CID event_cid;
+
+void sleep_callback(uint32_t us);
+
+void *producer_thd(void *v) {
+  (void)v;
+  for (int i = 0; i < 1000; i ++) {
+    while (!eval_cps_post_event(event_cid, enc_i(1))) {
+      sleep_callback(100);
+    }
+  }
+  return NULL;
+}
+
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  done_cond = PTHREAD_COND_INITIALIZER;
+static bool done_flag = false;
+
+void wait_callback(void) {
+  pthread_mutex_lock(&done_mutex);
+  while (!done_flag) {
+    pthread_cond_wait(&done_cond, &done_mutex);
+  }
+  done_flag = false;
+  pthread_mutex_unlock(&done_mutex);
+}
+
+void notify_callback(void) {
+  pthread_mutex_lock(&done_mutex);
+  done_flag = true;
+  pthread_cond_signal(&done_cond);
+  pthread_mutex_unlock(&done_mutex);
+}
+
+/* Every context is removed when it finishes, as in the REPLs. Joins
+   and eval_cps_wait_ctx still get the results. */
+void done_callback(eval_context_t *ctx) {
+  VALUE r;
+  eval_cps_remove_done_ctx(ctx->id, &r);
+}
+
+void *eval_thd_wrapper(void *v) {
+  (void)v;
+  eval_cps_run_eval();
+  return NULL;
+}
+
+uint32_t timestamp_callback(void) {
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return (uint32_t)(tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+void sleep_callback(uint32_t us) {
+  struct timespec s;
+  struct timespec r;
+  s.tv_sec = us / 1000000;
+  s.tv_nsec = (long)(us % 1000000) * 1000;
+  nanosleep(&s, &r);
+}
+
+/* The heap is shared with the evaluator thread, it is paused while
+   the program is parsed and its context created */
+static CID start(char *str) {
+  eval_cps_pause_eval();
+  CID cid = eval_cps_program(tokpar_parse(str));
+  eval_cps_continue_eval();
+  return cid;
+}
+
+static bool lookup(char *name, UINT *sym) {
+  eval_cps_pause_eval();
+  bool found = symrepr_lookup(name, sym);
+  eval_cps_continue_eval();
+  return found;
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  int res;
+  pthread_t lispbm_thd;
+
+  unsigned char *memory = malloc(MEMORY_SIZE_16K);
+  unsigned char *bitmap = malloc(MEMORY_BITMAP_SIZE_16K);
+  if (memory == NULL || bitmap == NULL) return 0;
+
+  res = memory_init(memory, MEMORY_SIZE_16K,
+		    bitmap, MEMORY_BITMAP_SIZE_16K);
+  res = res && symrepr_init();
+  res = res && heap_init(8192);
+  res = res && env_init();
+  res = res && eval_cps_init_ext(64, 256);
+  if (!res) {
+    printf("Error initializing\n");
+    return 0;
+  }
+
+  eval_cps_set_timestamp_us_callback(timestamp_callback);
+  eval_cps_set_usleep_callback(sleep_callback);
+  eval_cps_set_ctx_notify_callbacks(wait_callback, notify_callback);
+  eval_cps_set_ctx_done_callback(done_callback);
+
+  VALUE prg = tokpar_parse(program);
+  CID cid = eval_cps_program(prg);
+  if (cid == 0) {
+    printf("Error creating context\n");
+    return 0;
+  }
+
+  if (pthread_create(&lispbm_thd, NULL, eval_thd_wrapper, NULL)) {
+    printf("Error creating evaluation thread\n");
+    return 0;
+  }
+
+  VALUE r = eval_cps_wait_ctx(cid);
+
+  /* Sleepers wake up in order of their wake up time, the last one
+     to wake up is first in r */
+  INT expected = 10 + NUM_SLEEPERS - 1;
+  eval_cps_pause_eval();
+  while (type_of(r) == PTR_TYPE_CONS && car(r) == enc_i(expected)) {
+    expected --;
+    r = cdr(r);
+  }
+  eval_cps_continue_eval();
+  if (type_of(r) == PTR_TYPE_CONS) {
+    printf("Error: sleepers woke up out of order\n");
+    return 0;
+  }
+  if (expected != 9) {
+    printf("Error: %"PRI_INT" sleepers did not wake up\n", expected - 9);
+    return 0;
+  }
+  printf("Sleepers woke up in order: OK\n");
+
+  /* A join completes as soon as the joined context finishes, polling
+     for it would take at least a second here */
+  uint32_t t0 = timestamp_callback();
+  cid = start(joins);
+  r = eval_cps_wait_ctx(cid);
+  uint32_t t_join = timestamp_callback() - t0;
+  if (r != enc_i(230)) {
+    printf("Error: wrong result of joins\n");
+    return 0;
+  }
+  if (t_join > 500000) {
+    printf("Error: 20 joins took %u us\n", t_join);
+    return 0;
+  }
+  printf("Joins: OK\n");
+
+  /* Many more contexts than there are pool slots, they are recycled */
+  cid = start("(define count (lambda (k acc) (if (= k 0) acc"
+	      "  (count (- k 1) (+ acc (wait (car (spawn (1)))))))))"
+	      "(count 70000 0)");
+  r = eval_cps_wait_ctx(cid);
+  if (r != enc_i(70000)) {
+    printf("Error: wrong result of joins after CID wraparound\n");
+    return 0;
+  }
+  printf("CID recycling: OK\n");
+
+  /* A joined context is removed, waiting for it again fails even
+     after its pool slot has been taken by another context */
+  cid = start("(define c (car (spawn (1)))) (wait c) (spawn (2)) (wait c)");
+  r = eval_cps_wait_ctx(cid);
+  if (!is_symbol(r) || dec_sym(r) != symrepr_eerror()) {
+    printf("Error: wait for a removed context did not fail\n");
+    return 0;
+  }
+  /* A CID is not cut to fewer bits, this one names the same slot
+     with another generation */
+  cid = start("(define c (car (spawn ((progn (yield 20000) 1))))) (wait (+ c 65536))");
+  r = eval_cps_wait_ctx(cid);
+  if (!is_symbol(r) || dec_sym(r) != symrepr_eerror() ||
+      eval_cps_wait_ctx(start("(wait c)")) != enc_i(1)) {
+    printf("Error: wait for a CID of another generation did not fail\n");
+    return 0;
+  }
+  /* The same from the host, the slot of the removed context is taken
+     by the next one */
+  CID removed = start("(+ 1 2)");
+  r = eval_cps_wait_ctx(removed);
+  cid = start("(progn (yield 100000) 4)");
+  if (r != enc_i(3) || (cid & 63) != (removed & 63)) {
+    printf("Error: the pool slot of a removed context was not reused\n");
+    return 0;
+  }
+  r = eval_cps_wait_ctx(removed);
+  if (!is_symbol(r) || dec_sym(r) != symrepr_eerror() ||
+      eval_cps_wait_ctx(cid) != enc_i(4)) {
+    printf("Error: host wait for a removed context did not fail\n");
+    return 0;
+  }
+  printf("Stale CID: OK\n");
+
+  cid = start(messages);
+  r = eval_cps_wait_ctx(cid);
+  if (r != enc_i(5050)) {
+    printf("Error: wrong sum of messages\n");
+    return 0;
+  }
+  printf("Messages: OK\n");
+
+  /* Events from two threads while the evaluator runs */
+  pthread_t producers[2];
+  event_cid = start(events);
+  for (int i = 0; i < 2; i ++) {
+    if (pthread_create(&producers[i], NULL, producer_thd, NULL)) {
+      printf("Error creating producer thread\n");
+      return 0;
+    }
+  }
+  r = eval_cps_wait_ctx(event_cid);
+  pthread_join(producers[0], NULL);
+  pthread_join(producers[1], NULL);
+  if (r != enc_i(2000)) {
+    printf("Error: wrong sum of events\n");
+    return 0;
+  }
+  /* The polling context is started before the call is posted */
+  cid = start("(define poll (lambda () (if (= got 7) got (progn (yield 1000) (poll))))) (poll)");
+  UINT set_got;
+  if (!lookup("set-got", &set_got) ||
+      !eval_cps_post_call(enc_sym(set_got), enc_i(7))) {
+    printf("Error posting call\n");
+    return 0;
+  }
+  r = eval_cps_wait_ctx(cid);
+  if (r != enc_i(7)) {
+    printf("Error: posted call did not run\n");
+    return 0;
+  }
+  /* A call posted while sleepers use up the pool is delivered when
+     they finish */
+  cid = start("(define fill (lambda (k) (if (= k 0) nil"
+	      "  (progn (spawn ((yield 200000))) (fill (- k 1))))))"
+	      "(define poll-8 (lambda () (if (= got 8) got (progn (yield 1000) (poll-8)))))"
+	      "(fill 63) (poll-8)");
+  sleep_callback(20000);
+  if (!eval_cps_post_call(enc_sym(set_got), enc_i(8))) {
+    printf("Error posting call\n");
+    return 0;
+  }
+  r = eval_cps_wait_ctx(cid);
+  if (r != enc_i(8)) {
+    printf("Error: call posted to a full pool did not run\n");
+    return 0;
+  }
+  /* The argument of a posted call is passed as is, a symbol is not
+     looked up as a variable */
+  cid = start("(define poll-sym (lambda () (if (= got 'set-got) 1 (progn (yield 1000) (poll-sym))))) (poll-sym)");
+  if (!eval_cps_post_call(enc_sym(set_got), enc_sym(set_got))) {
+    printf("Error posting call\n");
+    return 0;
+  }
+  r = eval_cps_wait_ctx(cid);
+  if (r != enc_i(1)) {
+    printf("Error: posted call with a symbol argument did not run\n");
+    return 0;
+  }
+  printf("Events: OK\n");
+
+  /* Non tail recursion deeper than the initial continuation stack */
+  cid = start("(define sum (lambda (n) (if (= n 0) 0 (+ n (sum (- n 1)))))) (sum 1000)");
+  r = eval_cps_wait_ctx(cid);
+  if (r != enc_i(500500)) {
+    printf("Error: deep recursion failed\n");
+    return 0;
+  }
+  printf("Deep recursion: OK\n");
+
+  /* A global function applied from C in a new context */
+  VALUE args[1] = {enc_i(100)};
+  UINT sum;
+  if (!lookup("sum", &sum)) return 0;
+  eval_cps_pause_eval();
+  cid = eval_cps_call(enc_sym(sum), args, 1);
+  eval_cps_continue_eval();
+  r = eval_cps_wait_ctx(cid);
+  if (r != enc_i(5050)) {
+    printf("Error: wrong result of call from C\n");
+    return 0;
+  }
+  printf("Call from C: OK\n");
+
+  /* A context that never yields must not starve the others */
+  if (start("(define spin (lambda (n) (spin (+ n 1)))) (spin 0)") == 0) {
+    printf("Error creating context\n");
+    return 0;
+  }
+  cid = start("(+ 1 2)");
+  r = eval_cps_wait_ctx(cid);
+  if (r != enc_i(3)) {
+    printf("Error: wrong result next to a spinning context\n");
+    return 0;
+  }
+  printf("Spinning context preempted: OK\n");
+
+  /* The host collects garbage only while the evaluator is paused */
+  if (eval_cps_gc(NULL)) {
+    printf("Error: collected while the evaluator runs\n");
+    return 0;
+  }
+  eval_cps_pause_eval();
+  res = eval_cps_gc(NULL);
+  eval_cps_continue_eval();
+  if (!res) {
+    printf("Error: no collection while the evaluator is paused\n");
+    return 0;
+  }
+  printf("Pause: OK\n");
+
+  return 1;
+}
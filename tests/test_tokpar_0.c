@@ -0,0 +1,171 @@
+/*
+    Copyright 2020 Joel Svensson	svenssonjoel@yahoo.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "heap.h"
+#include "symrepr.h"
+#include "env.h"
+#include "eval_cps.h"
+#include "tokpar.h"
+#include "memory.h"
+
+#define HEAP_SIZE 131072
+#define DEPTH     100000
+#define NUM_ELTS  1000
+#define FLOAT_LEN 255
+
+/* Leaves no free cells */
+static void fill_heap(void) {
+  while (is_ptr(cons(enc_sym(symrepr_nil()), enc_sym(symrepr_nil()))));
+}
+
+static bool is_read_error(VALUE v) {
+  return is_symbol(v) && dec_sym(v) == symrepr_rerror();
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  unsigned char *memory = malloc(MEMORY_SIZE_16K);
+  unsigned char *bitmap = malloc(MEMORY_BITMAP_SIZE_16K);
+  if (memory == NULL || bitmap == NULL) return 0;
+
+  int res = memory_init(memory, MEMORY_SIZE_16K,
+			bitmap, MEMORY_BITMAP_SIZE_16K);
+  res = res && symrepr_init();
+  res = res && heap_init(HEAP_SIZE);
+  res = res && env_init();
+  res = res && eval_cps_init_nc(256, true);
+  if (!res) {
+    printf("Error initializing\n");
+    return 0;
+  }
+
+  /* A program read into a heap that is full of garbage */
+  char *prg = malloc(NUM_ELTS * 8 + 256);
+  if (prg == NULL) return 0;
+  strcpy(prg, "(define sum (lambda (xs acc) (if (= xs nil) acc (sum (cdr xs) (+ acc (car xs))))))"
+	 "(sum '(");
+  char *p = prg + strlen(prg);
+  for (int i = 1; i <= NUM_ELTS; i ++) {
+    p += sprintf(p, "%d ", i);
+  }
+  strcpy(p, ") 0)");
+
+  fill_heap();
+  VALUE v = tokpar_parse(prg);
+  free(prg);
+  if (type_of(v) != PTR_TYPE_CONS) {
+    printf("Error reading into a full heap\n");
+    return 0;
+  }
+  v = eval_cps_program_nc(v);
+  if (v != enc_i(NUM_ELTS * (NUM_ELTS + 1) / 2)) {
+    printf("Error: wrong result of program read into a full heap\n");
+    return 0;
+  }
+  printf("Read into a full heap: OK\n");
+
+  /* Backquote expansion after a collection */
+  fill_heap();
+  v = eval_cps_program_nc(tokpar_parse("`(1 ,(+ 1 1) ,@(list 3 4) \"five\")"));
+  if (type_of(v) != PTR_TYPE_CONS ||
+      car(v) != enc_i(1) ||
+      car(cdr(v)) != enc_i(2) ||
+      car(cdr(cdr(cdr(v)))) != enc_i(4) ||
+      type_of(car(cdr(cdr(cdr(cdr(v)))))) != PTR_TYPE_ARRAY) {
+    printf("Error: wrong backquote expansion in a full heap\n");
+    return 0;
+  }
+  printf("Backquote in a full heap: OK\n");
+
+  /* Nesting deeper than a recursive parser could handle */
+  char *deep = malloc(2 * DEPTH + 2);
+  if (deep == NULL) return 0;
+  deep[0] = '\'';
+  memset(deep + 1, '(', DEPTH);
+  memset(deep + 1 + DEPTH, ')', DEPTH);
+  deep[2 * DEPTH + 1] = 0;
+
+  fill_heap();
+  v = eval_cps_program_nc(tokpar_parse(deep));
+  free(deep);
+  int depth = 0;
+  while (type_of(v) == PTR_TYPE_CONS) {
+    v = car(v);
+    depth ++;
+  }
+  if (depth != DEPTH - 1 || !is_symbol_nil(v)) {
+    printf("Error: deep nesting read to depth %d\n", depth);
+    return 0;
+  }
+  printf("Deep nesting: OK\n");
+
+  /* A program parsed before another one that fills the heap */
+  VALUE first = tokpar_parse("(+ 1 2 3)");
+  fill_heap();
+  VALUE second = tokpar_parse("(list 4 5 6)");
+  if (eval_cps_program_nc(first) != enc_i(6) ||
+      type_of(eval_cps_program_nc(second)) != PTR_TYPE_CONS) {
+    printf("Error: a parsed program was collected before it was evaluated\n");
+    return 0;
+  }
+  printf("Parsed programs are kept: OK\n");
+
+  /* Symbols are read in lower case */
+  v = eval_cps_program_nc(tokpar_parse("(define Mixed-Case 42) (+ mixed-case MIXED-CASE)"));
+  if (v != enc_i(84)) {
+    printf("Error: symbols that differ in case are different\n");
+    return 0;
+  }
+  printf("Symbol case: OK\n");
+
+  if (!is_read_error(tokpar_parse("(+ 1 2")) ||
+      !is_read_error(tokpar_parse("(+ 1 2))")) ||
+      !is_read_error(tokpar_parse("(quote ')")) ||
+      !is_read_error(tokpar_parse("`,@(1 2)")) ||
+      !is_read_error(tokpar_parse("(+ 1 \"two)"))) {
+    printf("Error: malformed input was accepted\n");
+    return 0;
+  }
+  printf("Read errors: OK\n");
+
+  /* Float literals of up to 255 characters, longer ones are errors */
+  char flt[FLOAT_LEN + 2];
+  memset(flt, '0', FLOAT_LEN + 1);
+  memcpy(flt, "1.5", 3);
+  flt[FLOAT_LEN] = 0;
+  v = eval_cps_program_nc(tokpar_parse(flt));
+  if (type_of(v) != PTR_TYPE_BOXED_F || dec_f(v) != 1.5) {
+    printf("Error: wrong value of a long float literal\n");
+    return 0;
+  }
+  flt[FLOAT_LEN] = '0';
+  flt[FLOAT_LEN + 1] = 0;
+  if (!is_read_error(tokpar_parse(flt))) {
+    printf("Error: a too long float literal was accepted\n");
+    return 0;
+  }
+  printf("Long float literals: OK\n");
+
+  return 1;
+}
@@ -0,0 +1,175 @@
+/*
+    Copyright 2020 Joel Svensson	svenssonjoel@yahoo.se
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "heap.h"
+#include "symrepr.h"
+#include "env.h"
+#include "eval_cps.h"
+#include "tokpar.h"
+#include "memory.h"
+
+#define HEAP_SIZE 2048
+#define MAX_CHUNK 9
+
+/* Every kind of token, with comments and whitespace in between */
+static char *program =
+  ";; a comment\n"
+  "(define xs '(1 2 3))\n"
+  "(define s \"hello (world)\") ; trailing comment\n"
+  "(define f 3.25)\n"
+  "(define u 0xFF)\n"
+  "(define b 100000i32)\n"
+  "(define c \\#a)\n"
+  "(define ys `(0 ,@xs ,(+ 1 3)))\n"
+  "(define g (lambda (l acc) (if (= l nil) acc (g (cdr l) (+ acc (car l))))))\n"
+  "(define result (list (g ys 0) s f u b c 7u28 'sym))";
+
+#define NUM_FORMS 9
+
+static char *garbage =
+  "(define loop (lambda (n) (if (= n 0) 0 (progn (list 1 2 3 4) (loop (- n 1))))))"
+  "(loop 10000)";
+
+static VALUE eval_form(VALUE form) {
+  VALUE prg = cons(form, enc_sym(symrepr_nil()));
+  if (is_symbol_merror(prg)) {
+    eval_cps_gc(NULL);
+    prg = cons(form, enc_sym(symrepr_nil()));
+  }
+  return eval_cps_program_nc(prg);
+}
+
+static bool eval_true(char *str) {
+  return eval_cps_program_nc(tokpar_parse(str)) == enc_sym(symrepr_true());
+}
+
+/* Reads from s and evaluates until more input is needed or the input
+   ends. Returns the last status. */
+static int drain(tokpar_stream_t *s, int *forms) {
+  VALUE v;
+  int status;
+  while ((status = tokpar_stream_next(s, &v)) == TOKPAR_STREAM_FORM) {
+    eval_form(v);
+    (*forms) ++;
+  }
+  return status;
+}
+
+static bool run_chunked(unsigned int chunk) {
+  tokpar_stream_t *s = tokpar_stream_create();
+  if (s == NULL) return false;
+
+  unsigned int len = (unsigned int)strlen(program);
+  int forms = 0;
+  int status = TOKPAR_STREAM_MORE;
+  for (unsigned int i = 0; i < len && status == TOKPAR_STREAM_MORE; i += chunk) {
+    unsigned int n = (len - i < chunk) ? len - i : chunk;
+    if (!tokpar_stream_feed(s, program + i, n)) break;
+    status = drain(s, &forms);
+  }
+  tokpar_stream_end(s);
+  if (status == TOKPAR_STREAM_MORE) status = drain(s, &forms);
+  tokpar_stream_destroy(s);
+
+  return (status == TOKPAR_STREAM_END &&
+	  forms == NUM_FORMS &&
+	  eval_true("(= result expected)"));
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  unsigned char *memory = malloc(MEMORY_SIZE_16K);
+  unsigned char *bitmap = malloc(MEMORY_BITMAP_SIZE_16K);
+  if (memory == NULL || bitmap == NULL) return 0;
+
+  int res = memory_init(memory, MEMORY_SIZE_16K,
+			bitmap, MEMORY_BITMAP_SIZE_16K);
+  res = res && symrepr_init();
+  res = res && heap_init(HEAP_SIZE);
+  res = res && env_init();
+  res = res && eval_cps_init_nc(256, true);
+  if (!res) {
+    printf("Error initializing\n");
+    return 0;
+  }
+
+  /* The same program read at once */
+  eval_cps_program_nc(tokpar_parse(program));
+  eval_cps_program_nc(tokpar_parse("(define expected result)"));
+
+  for (unsigned int chunk = 1; chunk <= MAX_CHUNK; chunk ++) {
+    if (!run_chunked(chunk)) {
+      printf("Error reading in chunks of %u bytes\n", chunk);
+      return 0;
+    }
+  }
+  printf("Chunked input: OK\n");
+
+  /* A partial list survives collections while other code runs */
+  tokpar_stream_t *s = tokpar_stream_create();
+  if (s == NULL) return 0;
+  char *first = "(define big (list 1 `(2 ,(+ 1 2)) \"thr";
+  char *rest = "ee\" 4.5 'five))";
+  int forms = 0;
+  tokpar_stream_feed(s, first, (unsigned int)strlen(first));
+  if (drain(s, &forms) != TOKPAR_STREAM_MORE || forms != 0) {
+    printf("Error: incomplete input was returned\n");
+    return 0;
+  }
+  if (eval_cps_program_nc(tokpar_parse(garbage)) != enc_i(0)) {
+    printf("Error evaluating between chunks\n");
+    return 0;
+  }
+  tokpar_stream_feed(s, rest, (unsigned int)strlen(rest));
+  tokpar_stream_end(s);
+  if (drain(s, &forms) != TOKPAR_STREAM_END || forms != 1 ||
+      !eval_true("(= big (list 1 '(2 3) \"three\" 4.5 'five))")) {
+    printf("Error: partial list was not kept across collections\n");
+    return 0;
+  }
+  tokpar_stream_destroy(s);
+  printf("Collection between chunks: OK\n");
+
+  /* Errors are reported once the input shows them, and stay */
+  char *bad[] = { "(+ 1 2", "(+ 1 2))", "(quote ')", "\"open" };
+  for (int i = 0; i < 4; i ++) {
+    VALUE v;
+    s = tokpar_stream_create();
+    if (s == NULL) return 0;
+    tokpar_stream_feed(s, bad[i], (unsigned int)strlen(bad[i]));
+    tokpar_stream_end(s);
+    forms = 0;
+    int status = drain(s, &forms);
+    if (status != TOKPAR_STREAM_ERROR ||
+	tokpar_stream_next(s, &v) != TOKPAR_STREAM_ERROR ||
+	dec_sym(v) != symrepr_rerror()) {
+      printf("Error: malformed input %s was accepted\n", bad[i]);
+      return 0;
+    }
+    tokpar_stream_destroy(s);
+  }
+  printf("Read errors: OK\n");
+
+  return 1;
+}
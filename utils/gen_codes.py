@@ -15,8 +15,27 @@
     # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 
-import huffman
 import collections
+import heapq
+import os
+import sys
+
+def codebook(weights) :
+    """ Huffman codes for a list of (key, weight) """
+    heap = [(w, i, [k]) for i, (k, w) in enumerate(weights)]
+    heapq.heapify(heap)
+    codes = dict((k, '') for (k, w) in weights)
+    n = len(heap)
+    while len(heap) > 1 :
+        (w0, i0, ks0) = heapq.heappop(heap)
+        (w1, i1, ks1) = heapq.heappop(heap)
+        for k in ks0 :
+            codes[k] = '0' + codes[k]
+        for k in ks1 :
+            codes[k] = '1' + codes[k]
+        heapq.heappush(heap, (w0 + w1, n, ks0 + ks1))
+        n += 1
+    return codes
 
 symchars  = 'abcdefghijklmnopqrstuvwxyz'
 numchars  = '0123456789'
@@ -55,7 +74,7 @@ def minimum_total_bits_codes() :
         funchars_w  = [(x, (point[2] * 20) / len(funchars)) for x in funchars]
         lispnames_w = [(x, (point[3] * 15) / len(lispnames)) for x in lispnames]
         all_w = symchars_w + lispnames_w + funchars_w + numchars_w
-        codes = huffman.codebook(all_w).items()
+        codes = codebook(all_w).items()
         size = total_bits(codes)
         # print("smallest: % d current: % d\n" % (min_total_num_bits, size)  )
         if size < min_total_num_bits :
@@ -99,7 +118,7 @@ def generate_codes() :
     funchars_w = [(x, 9) for x in funchars]
 
     all_w = funchars_w + numchars_w + symchars_w + short_lispnames_w + long_lispnames_w
-    codes = huffman.codebook(all_w).items()
+    codes = codebook(all_w).items()
     
     return codes
     
@@ -128,9 +147,179 @@ def make_c_codes() :
     
     
     return c_str
-    
 
 
-    
-    
-    
+# Code tables trained on a corpus of programs. The build runs
+#   python3 utils/gen_codes.py corpus1 [corpus2 ...] > build/.../compression_tables.inc
+# where a corpus is a file or a directory of .lisp files. Corpus n
+# gives code table n, table 0 is the one built into compression.c.
+
+# Must agree with COMPRESSION_MAX_KEY_LENGTH and
+# COMPRESSION_MAX_CODE_LENGTH in compression.h
+MAX_KEY_LENGTH  = 12
+MAX_CODE_LENGTH = 7
+MAX_CODES = 1 << MAX_CODE_LENGTH
+
+base_keys = list(symchars + numchars) + ['+','-','*','/','=','<','>','.',
+                                         '#','"','\\', '\'', ' ', '`', ',',
+                                         '(', ')']
+delimiters = '()\'`," '
+
+def read_corpus(path) :
+    if os.path.isdir(path) :
+        files = sorted([os.path.join(path, f) for f in os.listdir(path)
+                        if f.endswith('.lisp')])
+    else :
+        files = [path]
+    text = ''
+    for f in files :
+        with open(f, encoding='latin-1') as fd :
+            text += fd.read() + '\n'
+    return text
+
+def code_parts(text) :
+    """ The text that is coded by keys, as the compressor sees it:
+        comments dropped, whitespace runs made a single space and
+        string contents, which are stored as is, left out. """
+    parts = []
+    cur = ''
+    i = 0
+    gobbling = False
+    while i < len(text) :
+        c = text[i]
+        if c == ';' :
+            while i < len(text) and text[i] != '\n' :
+                i += 1
+            continue
+        if c in '\n \t\r' :
+            gobbling = True
+            i += 1
+            continue
+        if gobbling :
+            cur += ' '
+            gobbling = False
+        if c == '"' :
+            parts.append(cur + '"')
+            cur = ''
+            i += 1
+            last = c
+            while i < len(text) and not (text[i] == '"' and last != '\\') :
+                last = text[i]
+                i += 1
+            i += 1
+            continue
+        cur += c
+        i += 1
+    parts.append(cur)
+    return parts
+
+def greedy_counts(parts, keys) :
+    """ How often the compressor codes each key """
+    counts = dict((k, 0) for k in keys)
+    for part in parts :
+        i = 0
+        while i < len(part) :
+            for n in range(min(MAX_KEY_LENGTH, len(part) - i), 0, -1) :
+                if part[i:i + n] in counts :
+                    counts[part[i:i + n]] += 1
+                    i += n
+                    break
+            else :
+                i += 1
+    return counts
+
+def limited_codes(weights, limit) :
+    """ Optimal prefix codes of at most limit bits for a list of
+        (key, weight), by package-merge. The codes are canonical. """
+    leaves = sorted([(w, [k]) for (k, w) in weights])
+    items = leaves
+    for _ in range(limit - 1) :
+        packages = [(items[i][0] + items[i + 1][0], items[i][1] + items[i + 1][1])
+                    for i in range(0, len(items) - 1, 2)]
+        items = sorted(leaves + packages, key=lambda x : x[0])
+    lengths = collections.Counter()
+    for (w, ks) in items[:2 * len(leaves) - 2] :
+        lengths.update(ks)
+    codes = {}
+    code = 0
+    prev = 0
+    for k in sorted(lengths, key=lambda k : (lengths[k], k)) :
+        code <<= lengths[k] - prev
+        prev = lengths[k]
+        codes[k] = format(code, '0%db' % prev)
+        code += 1
+    return codes
+
+def train(text) :
+    parts = code_parts(text)
+
+    base = set(base_keys)
+    for part in parts :
+        base.update(part)
+
+    words = collections.Counter()
+    for part in parts :
+        for d in delimiters :
+            part = part.replace(d, ' ' + d + ' ' if d in '()' else ' ')
+        toks = part.split()
+        for t in toks :
+            if 1 < len(t) <= MAX_KEY_LENGTH :
+                words[t] += 1
+        # Runs of parentheses
+        for j in range(len(toks) - 1) :
+            if toks[j] in '()' and toks[j] == toks[j + 1] :
+                words[toks[j] * 2] += 1
+    ranked = [w for (w, n) in
+              sorted(words.items(), key=lambda kv : (-kv[1] * (len(kv[0]) - 1), kv[0]))
+              if n > 1 and w not in base]
+
+    # Every word costs code space for the others, so try a few numbers
+    # of words and keep the best
+    best = None
+    for n in range(0, MAX_CODES - len(base) + 1, 8) :
+        keys = base | set(ranked[:n])
+        counts = greedy_counts(parts, keys)
+        codes = limited_codes([(k, counts[k] + 1) for k in keys], MAX_CODE_LENGTH)
+        bits = sum([counts[k] * len(codes[k]) for k in keys])
+        if best is None or bits < best[1] :
+            best = (codes, bits)
+        if n >= len(ranked) :
+            break
+    return best
+
+def table_id(codes) :
+    """ 32 bit FNV-1a of the keys and codes, in table order. Streams
+        coded with a generated table carry it in their header. """
+    h = 0x811c9dc5
+    for (k, c) in codes :
+        for b in k.encode('latin-1') + b'\0' + c.encode('latin-1') + b'\0' :
+            h = ((h ^ b) * 0x01000193) & 0xffffffff
+    return h
+
+def c_string(s) :
+    return '"' + s.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+def make_c_tables(paths) :
+    out = '/* Generated by utils/gen_codes.py, do not edit */\n\n'
+    out += '#if %d > COMPRESSION_MAX_KEY_LENGTH || %d > COMPRESSION_MAX_CODE_LENGTH\n' \
+           % (MAX_KEY_LENGTH, MAX_CODE_LENGTH)
+    out += '#error "The generated code tables do not fit the decode tables"\n#endif\n\n'
+    tables = []
+    for (n, path) in enumerate(paths, 1) :
+        (codes, bits) = train(read_corpus(path))
+        name = 'codes_%d' % n
+        out += '/* Table %d, from %s: %d bits of code */\n' % (n, path, bits)
+        ordered = sorted(codes.items(), key=lambda kc : (len(kc[1]), kc[0]))
+        out += 'static const char *%s[%d][2] = {\n' % (name, len(codes))
+        out += ',\n'.join(['    { %s, "%s" }' % (c_string(k), c)
+                           for (k, c) in ordered])
+        out += '\n    };\n\n'
+        tables.append('  { %s, %d, 0x%08xu }' % (name, len(codes), table_id(ordered)))
+    out += '#define COMPRESSION_NUM_GENERATED_TABLES %d\n' % len(tables)
+    out += '#define COMPRESSION_GENERATED_TABLES \\\n' + ', \\\n'.join(tables) + '\n'
+    return out
+
+if __name__ == '__main__' :
+    if len(sys.argv) < 2 :
+        sys.exit('usage: gen_codes.py corpus [corpus ...]')
+    sys.stdout.write(make_c_tables(sys.argv[1:]))